@@ -105,6 +105,194 @@ for task in "${TASKS[@]}"; do
   echo ""
 done
 
+# Compresie pe blocuri: fișierul decomprimat trebuie să fie identic cu intrarea
+# (fără punctaj; rulează doar când nu s-a cerut un task anume)
+COMPRESS_DIR="$TASKS_DIR/compress/tests"
+if [[ -z "$1" && -d "$COMPRESS_DIR" ]]; then
+  echo "======================================"
+  echo "Compresie (-compress / -decompress, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  # Un fișier de peste 1 MiB, ca să fie mai multe blocuri
+  multi_dir="$work_dir/multi_block"
+  mkdir -p "$multi_dir"
+  for i in $(seq 1 100); do
+    cat $TASKS_DIR/task*/tests/*/*.in
+  done > "$multi_dir/multi_block.in"
+  for test_dir in $COMPRESS_DIR/* "$multi_dir"; do
+    base=$(basename "$test_dir")
+    in_file="$test_dir/$base.in"
+    packed="$work_dir/$base.satz"
+    unpacked="$work_dir/$base.out"
+    if ./tema2 -compress "$in_file" "$packed" && \
+       ./tema2 -j 3 -decompress "$packed" "$unpacked" && \
+       cmp -s "$in_file" "$unpacked"; then
+      echo -e "[${GREEN}OK${NC}] $base ($(stat -c %s "$in_file") -> $(stat -c %s "$packed") octeți)"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
+# Actualizări adaptive: arborele după -u este un arbore Huffman al
+# satelitilor finali. La frecvențe egale forma lui poate diferi de cea a
+# arborelui reconstruit (cu aceeași lungime totală a codurilor), așa că .ref
+# (arborele reconstruit) e ales pe cazuri în care cei doi coincid
+# (fără punctaj; rulează doar când nu s-a cerut un task)
+UPDATES_DIR="$TASKS_DIR/updates/tests"
+if [[ -z "$1" && -d "$UPDATES_DIR" ]]; then
+  echo "======================================"
+  echo "Actualizări (-u, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  for test_dir in $UPDATES_DIR/*; do
+    base=$(basename "$test_dir")
+    out_file="$work_dir/$base.out"
+    if ./tema2 -u "$test_dir/$base.upd" -c1 "$test_dir/$base.in" "$out_file" && \
+       diff -q -w -B "$out_file" "$test_dir/$base.ref" > /dev/null; then
+      echo -e "[${GREEN}OK${NC}] $base"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
+# Loturi de constelații (-batch): batch.summary urmat de ieșirile
+# constelațiilor "ok", în ordinea din sumar (fără punctaj)
+BATCH_DIR="$TASKS_DIR/batch/tests"
+if [[ -z "$1" && -d "$BATCH_DIR" ]]; then
+  echo "======================================"
+  echo "Loturi (-batch, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  for test_dir in $BATCH_DIR/*; do
+    base=$(basename "$test_dir")
+    out_dir="$work_dir/$base"
+    # Constelațiile greșite dau cod de ieșire 1, dar apar în sumar
+    ./tema2 -j 2 -batch "$test_dir/$base.in" "$out_dir" > /dev/null 2>&1
+    summary="$out_dir/batch.summary"
+    if [[ -f "$summary" ]]; then
+      {
+        cat "$summary"
+        awk '$3 == "ok" {print $1}' "$summary" | while read -r name; do
+          cat "$out_dir/$name.out"
+          echo
+        done
+      } > "$work_dir/$base.out"
+    fi
+    if [[ -f "$summary" ]] && diff -q -w -B "$work_dir/$base.out" "$test_dir/$base.ref" > /dev/null; then
+      echo -e "[${GREEN}OK${NC}] $base"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
+# Fluxuri împachetate: -c3p apoi -c2p trebuie să dea numele din .ref.
+# Prima linie din .args are opțiunile pentru -c3p (ex. -i), a doua pe cele
+# pentru -c2p (ex. -j, -r) (fără punctaj)
+PACKED_DIR="$TASKS_DIR/packed/tests"
+if [[ -z "$1" && -d "$PACKED_DIR" ]]; then
+  echo "======================================"
+  echo "Fluxuri împachetate (-c3p / -c2p, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  for test_dir in $PACKED_DIR/*; do
+    base=$(basename "$test_dir")
+    in_file="$test_dir/$base.in"
+    pack_args=$(sed -n 1p "$test_dir/$base.args" 2>/dev/null)
+    unpack_args=$(sed -n 2p "$test_dir/$base.args" 2>/dev/null)
+    # -c2p primește sateliții separat (-t): primele n + 1 linii din .in
+    head -n $(( $(head -n 1 "$in_file") + 1 )) "$in_file" > "$work_dir/$base.sat"
+    if ./tema2 $pack_args -c3p "$in_file" "$work_dir/$base.bin" && \
+       ./tema2 $unpack_args -t "$work_dir/$base.sat" -c2p "$work_dir/$base.bin" "$work_dir/$base.out" && \
+       diff -q -w -B "$work_dir/$base.out" "$test_dir/$base.ref" > /dev/null; then
+      echo -e "[${GREEN}OK${NC}] $base"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
+# Cartea de coduri canonice (-cc), cu opțiunile din .args (ex. -l)
+# (fără punctaj)
+CC_DIR="$TASKS_DIR/cc/tests"
+if [[ -z "$1" && -d "$CC_DIR" ]]; then
+  echo "======================================"
+  echo "Coduri canonice (-cc, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  for test_dir in $CC_DIR/*; do
+    base=$(basename "$test_dir")
+    args=$(cat "$test_dir/$base.args" 2>/dev/null)
+    if ./tema2 $args -cc "$test_dir/$base.in" "$work_dir/$base.out" && \
+       diff -q -w -B "$work_dir/$base.out" "$test_dir/$base.ref" > /dev/null; then
+      echo -e "[${GREEN}OK${NC}] $base"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
+# Snapshot-uri: arborele din .in e salvat cu -build, apoi task-ul din .args
+# rulează cu -s pe interogările din .q (și actualizările din .upd, dacă
+# există) (fără punctaj)
+SNAPSHOT_DIR="$TASKS_DIR/snapshot/tests"
+if [[ -z "$1" && -d "$SNAPSHOT_DIR" ]]; then
+  echo "======================================"
+  echo "Snapshot-uri (-build / -s, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  for test_dir in $SNAPSHOT_DIR/*; do
+    base=$(basename "$test_dir")
+    task=$(cat "$test_dir/$base.args")
+    updates=()
+    if [[ -f "$test_dir/$base.upd" ]]; then
+      updates=(-u "$test_dir/$base.upd")
+    fi
+    if ./tema2 -build "$test_dir/$base.in" "$work_dir/$base.snap" && \
+       ./tema2 -s "$work_dir/$base.snap" "${updates[@]}" $task "$test_dir/$base.q" "$work_dir/$base.out" && \
+       diff -q -w -B "$work_dir/$base.out" "$test_dir/$base.ref" > /dev/null; then
+      echo -e "[${GREEN}OK${NC}] $base"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
+# Serverul de interogări: cererile din .req, trimise pe stdin, trebuie să
+# primească răspunsurile din .ref (fără punctaj)
+SERVE_DIR="$TASKS_DIR/serve/tests"
+if [[ -z "$1" && -d "$SERVE_DIR" ]]; then
+  echo "======================================"
+  echo "Server (-serve, fără punctaj)"
+  echo "======================================"
+  work_dir=$(mktemp -d)
+  for test_dir in $SERVE_DIR/*; do
+    base=$(basename "$test_dir")
+    if ./tema2 -serve "$test_dir/$base.in" - < "$test_dir/$base.req" > "$work_dir/$base.out" && \
+       diff -q -w -B "$work_dir/$base.out" "$test_dir/$base.ref" > /dev/null; then
+      echo -e "[${GREEN}OK${NC}] $base"
+    else
+      echo -e "[${RED}FAIL${NC}] $base"
+    fi
+  done
+  rm -rf "$work_dir"
+  echo ""
+fi
+
 # Rezumat global
 echo "======================================"
 echo "Scor total: $(printf "%.2f" "$global_score") puncte din 115."
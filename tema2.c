@@ -2,12 +2,116 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+enum stats_phase {
+    stats_read, stats_build, stats_index, stats_flat, stats_updates,
+    stats_task, stats_free, stats_phase_count
+};
+
+typedef struct Stats
+{
+    // Phase timings and hot path counters of one run, written by --stats
+    // Nothing is measured unless enabled is set, so every counter costs a
+    // single predictable branch when the flag is not given
+    int enabled;
+    double started; // Monotonic clock
+    // Clock of the phases: monotonic, or the CPU time of the calling
+    // thread with -batch, where every worker times its own phases
+    clockid_t phase_clock;
+    double phase_seconds[stats_phase_count];
+    unsigned long long node_cmp; // NODE_CMP calls and heap entry comparisons
+    unsigned long long name_cmp; // Comparisons that had to read the names
+    unsigned long long heap_sifts; // Levels moved by heap sifts
+    unsigned long long pool_allocations; // Slabs and name chunks of NodePools
+    unsigned long long pool_bytes;
+    unsigned long long queries; // Paths, names or pairs given to the task
+    // Tree edges walked by decoding, encoding and searches, plus one per
+    // LCA index query
+    unsigned long long nodes_visited;
+} Stats;
+
+Stats run_stats; // Counters are added atomically, -j threads share them
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // Guards phase_seconds
+
+#define STATS_COUNT(counter, amount) \
+    do { \
+        if (run_stats.enabled) \
+            __atomic_fetch_add(&run_stats.counter, (amount), __ATOMIC_RELAXED); \
+    } while (0)
+
+double STATS_CLOCK(clockid_t clock)
+{
+    // Helper function to read a clock in seconds
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+double STATS_NOW(void)
+{
+    // Helper function to read the clock of the phases (0 when stats are off)
+    if (!run_stats.enabled) return 0;
+    return STATS_CLOCK(run_stats.phase_clock);
+}
+
+void STATS_PHASE_END(int phase, double started)
+{
+    // Helper function to add the time since started to a phase
+    // (a phase starts and ends on the same thread, so with -batch the
+    // phases add up the CPU seconds of all workers)
+    if (!run_stats.enabled) return;
+    double seconds = STATS_NOW() - started;
+    pthread_mutex_lock(&stats_lock);
+    run_stats.phase_seconds[phase] += seconds;
+    pthread_mutex_unlock(&stats_lock);
+}
 
 typedef struct Item
 {
     // Struct to store data, used in the Tree structure and Heap
     int frequency;
-    char* name;
+    char* name; // Only leaves store their name
+    // The name of an internal node is the concatenation of the names of
+    // its leaves, from first_leaf to last_leaf (following next_leaf).
+    // It is never copied, only read through this view
+    struct node* first_leaf;
+    struct node* last_leaf;
+    size_t name_len;
+    // Polynomial hash of the full name and NAME_HASH_BASE^name_len,
+    // so the hash of a parent is computed from its children in O(1)
+    unsigned long long name_hash;
+    unsigned long long name_pow;
+    int depth; // Distance from the root (also the code length)
+    int height; // Number of levels of the subtree rooted here
+    int name_shared; // Another node of the tree has the same full name
+    size_t code_offset; // Position of the leaf code in the CodeTable
+    int flat_id; // Position of the node in the FlatTree
+    int preorder; // Position in the preorder walk
+    int order; // Position in the SiblingOrder (adaptive updates)
+    int changed; // On a path changed by the current batch of updates
+    int moved; // Its place changed in the current batch (REFRESH_TREE only)
+    // Rank of the name of the first leaf among the leaf names (0 if the
+    // leaves were not ranked), the low half of the heap key
+    unsigned int name_rank;
 } Item;
 typedef struct node
 {
@@ -15,17 +119,242 @@ typedef struct node
     Item* data; // Holds the data for the node
     struct node* left;
     struct node* right;
+    struct node* next_leaf; // Next leaf in name order (leaves only)
+    struct node* parent;
 } node;
 
+typedef struct NodeSlab
+{
+    // Contiguous block of nodes and their data containers
+    // (nodes[i].data always points to items[i])
+    struct NodeSlab* next;
+    node* nodes;
+    Item* items;
+    int n_used;
+    int capacity;
+} NodeSlab;
+
+typedef struct NameChunk
+{
+    // Bump arena block for name bytes
+    struct NameChunk* next;
+    size_t used;
+    size_t capacity;
+    char bytes[];
+} NameChunk;
+
+typedef struct NodePool
+{
+    // All memory of a tree: nodes, items and names are carved out of
+    // a few large blocks and released together
+    NodeSlab* slabs;
+    NameChunk* names;
+} NodePool;
+
+typedef struct NameIndex
+{
+    // Open addressing hash table from full names to tree nodes
+    node** slots;
+    size_t mask;
+    size_t n_used;
+} NameIndex;
+
+typedef struct CodeTable
+{
+    // Codes of all leaves, packed back to back (bit i of the table is
+    // bit i % 64 of bits[i / 64]). A leaf code starts at code_offset
+    // and is depth bits long. bits is NULL if the table would be too big
+    unsigned long long* bits;
+    size_t n_bits;
+    size_t capacity; // In words (the updates append the codes they change)
+    size_t n_stale; // Bits of replaced codes, until PACK_CODE_TABLE
+    int mapped; // bits point into a snapshot mapping and are not freed
+} CodeTable;
+
+typedef struct Snapshot
+{
+    // Mapping of the snapshot file the tree was loaded from (LOAD_SNAPSHOT)
+    void* base;
+    size_t size;
+} Snapshot;
+
+#define LCA_BLOCK 32
+
+typedef struct LcaIndex
+{
+    // Euler tour of the tree with a range minimum structure over depths:
+    // the LCA of two nodes is the shallowest node of the tour between
+    // their first occurrences. The tour is split in blocks of LCA_BLOCK
+    // positions; prefix/suffix minima answer the partial blocks and a
+    // sparse table over block minima answers the full blocks between them
+    int* euler; // FlatTree positions (or GraftForest ids)
+    int* depth;
+    int* first; // First tour position of every FlatTree position
+    int* prefix_min; // Position of the minimum from the block start to i
+    int* suffix_min; // Position of the minimum from i to the block end
+    int* sparse;     // sparse[level * n_blocks + b]: minimum of 2^level blocks
+    int n_euler;
+    int n_blocks;
+    int n_levels;
+    long long climbed; // Parent links walked by FIND_LCA while there is no index
+} LcaIndex;
+
+typedef struct FlatTree
+{
+    // Read-only copy of the final tree in breadth-first order (the root
+    // is 0), stored as parallel arrays so that walks read a few dense
+    // arrays instead of following node and item pointers. Children and
+    // parents are positions in these arrays (-1 for none)
+    int n;
+    int* left;
+    int* right;
+    int* parent;
+    int* frequency;
+    int* depth;
+    int* height;
+    size_t* code_offset; // Leaves: position of the code in the CodeTable
+    // The leaves of any subtree are consecutive in the leaf chain of the
+    // root, so with all leaf names written in that order into one string,
+    // the name of every node is the slice at name_offset, name_len long
+    size_t* name_offset;
+    size_t* name_len;
+    char* names;
+    unsigned char* name_shared; // Another node has the same full name
+    // Name index of a tree mapped from a snapshot (position + 1, 0 for an
+    // empty slot); trees built in memory use the NameIndex of their nodes
+    int* index_slots;
+    size_t index_mask;
+    int mapped; // The arrays above point into a snapshot mapping
+    struct node** source; // Node every position was copied from (NULL if mapped)
+    struct DecodeTable** decode_tables; // Built on demand by the decoder
+    // The updates patch the layout in place (PATCH_FLAT_TREE): positions
+    // are then no longer breadth-first, new leaf names are appended to
+    // names and renamed internal nodes have no slice (FLAT_NO_NAME)
+    int patched;
+    int capacity; // Positions allocated
+    size_t names_used;
+    size_t names_capacity;
+} FlatTree;
+
+#define FLAT_NO_NAME ((size_t)-1)
+
+typedef struct GraftNode
+{
+    // Node of a sub-constellation grafted under the tree (-c5). Children
+    // are kept as a first child / next sibling list, so a node can have
+    // any number of them
+    const char* name; // View into the task input
+    size_t name_len;
+    unsigned long long name_hash;
+    int parent; // Grafted node, -1 for the root of a graft
+    int first_child;
+    int next_sibling; // Also links the roots of all grafts
+    int depth; // Depth in the whole tree (tree node depths included)
+    int anchor; // Node of the tree the graft hangs under (FlatTree position)
+} GraftNode;
+
+typedef struct GraftForest
+{
+    // Every grafted node, with a name index (slots hold id + 1, 0 for an
+    // empty slot) and an LCA index over the forest
+    GraftNode* nodes;
+    int n;
+    int capacity;
+    int first_root;
+    int* slots;
+    size_t mask;
+    LcaIndex lca; // Position n of the tour is the virtual root of the forest
+} GraftForest;
+
+typedef struct NodeStack
+{
+    // Explicit stack for tree walks, so that the depth of the tree never
+    // reaches the call stack (degenerate trees can be n levels deep)
+    node** items;
+    int top;
+    int capacity;
+} NodeStack;
+
+typedef struct SiblingOrder
+{
+    // All nodes by non-increasing frequency, with every pair of siblings
+    // side by side (positions 2i - 1 and 2i, the root alone at 0). A tree
+    // has such a list exactly when it is a Huffman tree for its leaf
+    // frequencies, so the adaptive updates keep it instead of rebuilding
+    node** nodes;
+    int n;
+    int capacity;
+    NodeStack path; // Ancestors whose name changes with one swap
+    int lost_shared; // A shared name left the index during the batch
+    NodeStack removed; // Nodes the batch took out of the tree
+    NodeStack touched; // Other nodes whose flat entry the batch changes
+} SiblingOrder;
+
 typedef struct Tree
 {
     int n_nodes;
     struct node* root;
+    NodePool pool; // Owns every node of the tree
+    NameIndex index; // Built by BUILD_TREE_INDEX after the tree is final
+    CodeTable codes;
+    unsigned long long fingerprint; // Hash of the shape, frequencies and names
+    FlatTree flat; // Built by BUILD_FLAT_TREE once the tree is final
+    LcaIndex lca; // Built on the first LCA query (BUILD_LCA_INDEX)
+    Snapshot snapshot; // base is NULL unless the tree was loaded with -s
+    SiblingOrder order; // Built on the first update (APPLY_UPDATES)
 } Tree;
 
+typedef struct DecodeEntry
+{
+    // Result of reading up to n_bits bits of a code from some start node:
+    // the leaf that was reached, or the internal node where the table ends
+    // (a FlatTree position)
+    int target;
+    int n_bits;
+} DecodeEntry;
+
+typedef struct DecodeTable
+{
+    // Lookup table indexed by the next n_bits bits of the input
+    // (first bit in the lowest position)
+    struct DecodeTable* next; // All tables of a decoder, to free them
+    int owner;
+    int n_bits;
+    DecodeEntry entries[];
+} DecodeTable;
+
+typedef struct Decoder
+{
+    int max_bits; // Bits consumed by one table lookup (k)
+    DecodeTable* tables;
+    pthread_mutex_t* lock; // Guards table building when threads share it
+    FlatTree* flat; // Tree the tables are built for
+    int failed; // Set when a table could not be built
+} Decoder;
+
+typedef struct BitBuffer
+{
+    // Bits of a code stored 64 per word, bit i is bit i % 64 of words[i / 64]
+    unsigned long long* words;
+    size_t n_bits;
+    size_t capacity; // In words
+} BitBuffer;
+
+#ifndef HEAP_ARITY
+#define HEAP_ARITY 4 // Children per heap node (4 entries fill a cache line)
+#endif
+
+typedef struct HeapEntry
+{
+    // The key of a node is stored next to it, so sifts compare integers
+    // without following the node pointers
+    unsigned long long key; // NODE_KEY(item)
+    struct node* item;
+} HeapEntry;
+
 typedef struct Heap
 {
-    node** data_arr; // Array to store pointers to nodes (heap elements)
+    HeapEntry* data_arr; // Array to store the heap elements
     int n_nodes;
     int max_capacity;
 } Heap;
@@ -42,6 +371,20 @@ void INIT_TREE(Tree** src_tree)
     }
     (*src_tree)->n_nodes = 0;
     (*src_tree)->root = NULL;
+    (*src_tree)->pool.slabs = NULL;
+    (*src_tree)->pool.names = NULL;
+    (*src_tree)->index.slots = NULL;
+    (*src_tree)->index.mask = 0;
+    (*src_tree)->index.n_used = 0;
+    (*src_tree)->codes.bits = NULL;
+    (*src_tree)->codes.n_bits = 0;
+    (*src_tree)->codes.mapped = 0;
+    (*src_tree)->snapshot.base = NULL;
+    (*src_tree)->snapshot.size = 0;
+    (*src_tree)->fingerprint = 0;
+    memset(&(*src_tree)->flat, 0, sizeof(FlatTree));
+    memset(&(*src_tree)->lca, 0, sizeof(LcaIndex));
+    memset(&(*src_tree)->order, 0, sizeof(SiblingOrder));
 }
 
 void INIT_HEAP(Heap** src_heap)
@@ -55,602 +398,7257 @@ void INIT_HEAP(Heap** src_heap)
     }
     (*src_heap)->n_nodes = 0;
     (*src_heap)->max_capacity = 10;
-    (*src_heap)->data_arr = (node**)malloc(sizeof(node*) * 10);
-}
-
-void HEAP_SWAP(node** el_a, node** el_b)
-{
-    // Function to swap two nodes in the heap array, used in insert and remove operations
-    node* temp = *el_a;
-    *el_a = *el_b;
-    *el_b = temp;
+    (*src_heap)->data_arr = (HeapEntry*)malloc(sizeof(HeapEntry) * 10);
 }
 
-int NODE_CMP(node* el_a, node* el_b)
+void FREE_HEAP(Heap* min_heap)
 {
-    // Function to handle cases when nodes have the same frequency
-    // In such cases, they are ordered by their name (lexicographically)
-    if (el_a->data->frequency < el_b->data->frequency)
-    {
-        return -1;
-    } else if (el_a->data->frequency > el_b->data->frequency)
+    // Helper function to free the heap memory
+    if (min_heap == NULL) return;
+    if (min_heap->data_arr != NULL)
     {
-        return 1;
-    } else{
-        return strcmp(el_a->data->name, el_b->data->name);
+        free(min_heap->data_arr);
     }
+    free(min_heap);
 }
 
-void INSERT_MIN_HEAP(Heap* min_heap, char* name, int freq, node* inserted_node)
+int POOL_ADD_SLAB(NodePool* pool, int capacity)
 {
-    // Function to insert a new item into the min-heap
-    node* new_node;
-    if (inserted_node == NULL)
+    // Function to add a new block of nodes to the pool
+    NodeSlab* slab = (NodeSlab*)malloc(sizeof(NodeSlab));
+    if (slab == NULL)
     {
-        Item* new_item = (Item*)malloc(sizeof(Item)); // Initialize new data container
-        if (new_item == NULL)
-        {
-            perror("Error on malloc new item");
-            return;
-        }
-        new_node = (node*)malloc(sizeof(node));
-        if (new_node == NULL)
-        {
-            free(new_item);
-            perror("Error on malloc new node");
-            return;
-        }
-        new_item->frequency = freq;
-        new_item->name = strdup(name);
-        new_node->data = new_item;
-        new_node->left = NULL;
-        new_node->right = NULL;
-    } else {
-        new_node = inserted_node;
+        perror("Error on malloc node slab");
+        return 0;
     }
-    // Perform insertion
-    int n = min_heap->n_nodes;
-    int max_cap = min_heap->max_capacity;
-    // If the data array is full, double its capacity using realloc
-    if (n == max_cap)
+    slab->nodes = (node*)malloc(sizeof(node) * capacity);
+    slab->items = (Item*)malloc(sizeof(Item) * capacity);
+    if (slab->nodes == NULL || slab->items == NULL)
     {
-        max_cap *= 2; // Increase max capacity
-        node** new_data_arr = (node**)realloc(min_heap->data_arr,
-                                              sizeof(node*) * max_cap);
-        if (new_data_arr == NULL)
-        {
-            perror("Error on realloc new data_arr");
-            return;
-        }
-        min_heap->data_arr = new_data_arr;
-        min_heap->max_capacity = max_cap;
+        perror("Error on malloc node slab arrays");
+        free(slab->nodes);
+        free(slab->items);
+        free(slab);
+        return 0;
     }
-    min_heap->data_arr[n] = new_node;
-    min_heap->n_nodes++;
+    slab->n_used = 0;
+    slab->capacity = capacity;
+    STATS_COUNT(pool_allocations, 1);
+    STATS_COUNT(pool_bytes, (sizeof(node) + sizeof(Item)) * (size_t)capacity);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    return 1;
+}
 
-    // Perform heapify according to min-heap rules
-    while (n > 0 && NODE_CMP(min_heap->data_arr[n], 
-           min_heap->data_arr[(n-1) / 2]) < 0)
+void INIT_NODE_POOL(NodePool* pool, int expected_nodes)
+{
+    // Helper function to reserve room for a whole tree up front
+    // (a Huffman tree with n leaves always has 2n - 1 nodes)
+    if (expected_nodes > 0)
     {
-        HEAP_SWAP(&min_heap->data_arr[n], &min_heap->data_arr[(n-1) / 2]);
-        n = (n-1) / 2;
+        POOL_ADD_SLAB(pool, expected_nodes);
     }
 }
 
-node* GET_MIN(Heap* min_heap)
+void POOL_INIT_NODE(node* new_node, Item* data)
 {
-    // Function to get the minimum element in the heap
-    if (min_heap->n_nodes == 0) return NULL;
-    return min_heap->data_arr[0]; // In a min-heap, the minimum is the first element
+    // Helper function to reset a node taken from a slab and link its item
+    new_node->data = data;
+    new_node->data->frequency = 0;
+    new_node->data->name = NULL;
+    new_node->data->first_leaf = new_node;
+    new_node->data->last_leaf = new_node;
+    new_node->data->name_len = 0;
+    new_node->data->name_hash = 0;
+    new_node->data->name_pow = 1;
+    new_node->data->depth = 0;
+    new_node->data->height = 1;
+    new_node->data->name_shared = 0;
+    new_node->data->flat_id = -1;
+    new_node->data->preorder = -1;
+    new_node->data->order = -1;
+    new_node->data->changed = 0;
+    new_node->data->moved = 0;
+    new_node->data->name_rank = 0;
+    new_node->data->code_offset = 0;
+    new_node->left = NULL;
+    new_node->right = NULL;
+    new_node->next_leaf = NULL;
+    new_node->parent = NULL;
 }
 
-void REMOVE_ELEMENT(Heap* min_heap, int val)
+node* POOL_NEW_NODE(NodePool* pool)
 {
-    int idx = -1;
-    int n = min_heap->n_nodes;
-    // Try to find a specific element by its value (frequency)
-    for (int i = 0; i < n; i++)
+    // Function to take the next free node from the pool
+    // If the current slab is full, a new one (twice as big) is added
+    if (pool->slabs == NULL || pool->slabs->n_used == pool->slabs->capacity)
     {
-        if (min_heap->data_arr[i]->data->frequency == val)
+        int capacity = pool->slabs == NULL ? 64 : pool->slabs->capacity * 2;
+        if (!POOL_ADD_SLAB(pool, capacity))
         {
-            idx = i;
-            break;
+            return NULL;
         }
     }
+    NodeSlab* slab = pool->slabs;
+    node* new_node = &slab->nodes[slab->n_used];
+    POOL_INIT_NODE(new_node, &slab->items[slab->n_used]);
+    slab->n_used++;
+    return new_node;
+}
 
-    if (idx == -1)
-    {
-        printf("Val not found in min heap");
-        return;
-    }
-    // Replace current element with the last one
-    min_heap->data_arr[idx] = min_heap->data_arr[n-1];
-    // Remove that element from the min-heap
-    min_heap->data_arr[n-1] = NULL;
-    min_heap->n_nodes--;
-    n--;
-    // Perform heapify according to min-heap rules
-    while (1)
+int POOL_TAKE_NODES(NodePool* pool, int n)
+{
+    // Function to take n consecutive nodes of the current slab at once, so
+    // several threads can fill them (each one with POOL_INIT_NODE)
+    // Returns the position of the first one in pool->slabs, -1 on error
+    if (pool->slabs == NULL || pool->slabs->capacity - pool->slabs->n_used < n)
     {
-        int child_l = 2 * idx + 1;
-        int child_r = 2 * idx + 2;
-        int lowest = idx;
-        if (child_l < n && NODE_CMP(min_heap->data_arr[child_l], 
-                min_heap->data_arr[lowest]) < 0)
+        if (!POOL_ADD_SLAB(pool, n > 64 ? n : 64))
         {
-            lowest = child_l;
+            return -1;
         }
-        if(child_r < n && NODE_CMP(min_heap->data_arr[child_r], 
-                min_heap->data_arr[lowest]) < 0)
+    }
+    int first = pool->slabs->n_used;
+    pool->slabs->n_used += n;
+    return first;
+}
+
+char* POOL_ALLOC_NAME(NodePool* pool, size_t len)
+{
+    // Function to reserve len + 1 bytes in the bump arena
+    if (pool->names == NULL || pool->names->used + len + 1 > pool->names->capacity)
+    {
+        size_t capacity = 64 * 1024;
+        if (capacity < len + 1)
         {
-            lowest = child_r;
+            capacity = len + 1;
         }
-        if(lowest != idx)
+        NameChunk* chunk = (NameChunk*)malloc(sizeof(NameChunk) + capacity);
+        if (chunk == NULL)
         {
-            HEAP_SWAP(&min_heap->data_arr[idx], &min_heap->data_arr[lowest]);
-            idx = lowest;
-        } else {
-            break;
+            perror("Error on malloc name chunk");
+            return NULL;
         }
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        STATS_COUNT(pool_allocations, 1);
+        STATS_COUNT(pool_bytes, sizeof(NameChunk) + capacity);
+        chunk->next = pool->names;
+        pool->names = chunk;
     }
+    char* dest = pool->names->bytes + pool->names->used;
+    dest[len] = '\0';
+    pool->names->used += len + 1;
+    return dest;
 }
 
-node* HEAP_BUILD_MIN_NODE(Heap* min_heap)
+char* POOL_STORE_NAME(NodePool* pool, const char* name, size_t len)
 {
-    // Function to get the minimum element from the heap and remove it
-    // (In the first version, the heap was built using an array of Item*,
-    // so this function created a new node from an Item element)
-    node* min_element = GET_MIN(min_heap);
-    if (min_element == NULL) return NULL;
-    REMOVE_ELEMENT(min_heap, min_element->data->frequency);
-    return min_element;
+    // Function to copy a name into the bump arena
+    char* dest = POOL_ALLOC_NAME(pool, len);
+    if (dest != NULL)
+    {
+        memcpy(dest, name, len);
+    }
+    return dest;
 }
 
-void CONSTRUCT_HEAP(Heap* min_heap, int* satellites_freq,
-                    char** satellites_name, int n)
+void FREE_NODE_POOL(NodePool* pool)
 {
-    // Function to build the initial heap from input data
-    for (int i=0; i < n; i++)
+    // Helper function to release all blocks of the pool at once
+    while (pool->slabs != NULL)
+    {
+        NodeSlab* next = pool->slabs->next;
+        free(pool->slabs->nodes);
+        free(pool->slabs->items);
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    while (pool->names != NULL)
     {
-        INSERT_MIN_HEAP(min_heap, satellites_name[i], satellites_freq[i], NULL);
+        NameChunk* next = pool->names->next;
+        free(pool->names);
+        pool->names = next;
     }
 }
 
-void CONSTRUCT_TREE(Heap* min_heap, Tree* final_tree)
+int NODE_STACK_INIT(NodeStack* stack, int capacity)
 {
-    // Function to build the final tree from the heap
-    node* parent = NULL;
-    while (min_heap->n_nodes > 1)
+    // Helper function to set up an empty stack
+    stack->top = 0;
+    stack->capacity = capacity > 0 ? capacity : 1;
+    stack->items = (node**)malloc(sizeof(node*) * stack->capacity);
+    if (stack->items == NULL)
     {
-        // Get two nodes with the lowest frequency
-        node* min_left = HEAP_BUILD_MIN_NODE(min_heap);
-        node* min_right = HEAP_BUILD_MIN_NODE(min_heap);
-        Item* new_data_container = (Item*)malloc(sizeof(Item));
-        if (new_data_container == NULL)
-        {
-            perror("Error on malloc new data container for parent node");
-        }
-        int new_name_len = (int)strlen(min_left->data->name) +
-                           (int)strlen(min_right->data->name) + 1;
-        // Initialize a new parent node to store concatenated data
-        parent = (node*)malloc(sizeof(node));
-        if (parent == NULL)
-        {
-            perror("Error on malloc new parent node");
-            free(new_data_container);
-            return;
-        }
-        parent->left = min_left; // Store addresses for those two nodes
-        parent->right = min_right;
-        new_data_container->frequency = min_left->data->frequency +
-                                        min_right->data->frequency;
-        new_data_container->name = (char*)malloc(sizeof(char) * new_name_len);
-        if (new_data_container->name == NULL)
-        {
-            perror("Error on malloc name field for parent node");
-            free(new_data_container);
-            free(parent);
-        }
-        // Again, handle the case when nodes have the same frequency
-        if (NODE_CMP(min_left, min_right) < 0)
+        perror("Error on malloc node stack");
+        return 0;
+    }
+    return 1;
+}
+
+int NODE_STACK_PUSH(NodeStack* stack, node* src)
+{
+    // Helper function to push a node, doubling the stack when it is full
+    if (stack->top == stack->capacity)
+    {
+        node** temp = (node**)realloc(stack->items,
+                                      sizeof(node*) * stack->capacity * 2);
+        if (temp == NULL)
         {
-            strcpy(new_data_container->name, min_left->data->name);
-            strcat(new_data_container->name, min_right->data->name);
-        } else {
-            strcpy(new_data_container->name, min_right->data->name);
-            strcat(new_data_container->name, min_left->data->name);
+            perror("Error on realloc node stack");
+            return 0;
         }
-        parent->data = new_data_container;
-        final_tree->n_nodes++;
-        INSERT_MIN_HEAP(min_heap, NULL, 0, parent);
+        stack->items = temp;
+        stack->capacity *= 2;
     }
-    final_tree->root = parent;
+    stack->items[stack->top++] = src;
+    return 1;
 }
 
-int GET_MAX(int a, int b)
+void FREE_NODE_STACK(NodeStack* stack)
 {
-    // Function equivalent to max()
-    return a > b ? a : b;
+    // Helper function to release the memory of a stack
+    free(stack->items);
+    stack->items = NULL;
+    stack->top = 0;
+    stack->capacity = 0;
 }
 
-int GET_TREE_HEIGHT(node* root)
+#define NAME_HASH_BASE 0x100000001b3ULL
+
+unsigned long long NAME_HASH_STRING(const char* name, size_t len,
+                                    unsigned long long* pow)
 {
-    // Function that recursively finds the deepest leaf in the tree
-    if (root == NULL)
+    // Function to compute the polynomial hash of the first len characters
+    // of name (and NAME_HASH_BASE^len if pow is not NULL)
+    unsigned long long hash = 0, base_pow = 1;
+    for (size_t i = 0; i < len; i++)
     {
-        return 0;
+        hash = hash * NAME_HASH_BASE + (unsigned char)name[i];
+        base_pow *= NAME_HASH_BASE;
     }
-    int left_height = GET_TREE_HEIGHT(root->left);
-    int right_height = GET_TREE_HEIGHT(root->right);
-    return 1 + GET_MAX(left_height, right_height);
+    if (pow != NULL)
+    {
+        *pow = base_pow;
+    }
+    return hash;
 }
 
-void PRINT_SPECIFIC_TREE_LEVEL(node* root, int level, FILE* out_file)
+typedef struct NameCursor
 {
-    // Recursively, starting from the root node, go down "level" times
-    // then print the node at that level
-    if (root == NULL) {return;}
-    if (level == 0)
-    {
-        fprintf(out_file, "%d-%s ", root->data->frequency, root->data->name);
-    } else {
-        PRINT_SPECIFIC_TREE_LEVEL(root->left, level-1, out_file);
-        PRINT_SPECIFIC_TREE_LEVEL(root->right, level-1, out_file);
-    }
+    // Iterator over the characters of a (possibly internal) node name
+    node* leaf;
+    node* last_leaf;
+    const char* pos;
+} NameCursor;
+
+void NAME_CURSOR_INIT(NameCursor* cursor, node* src)
+{
+    // Helper function to place a cursor on the first character of a name
+    cursor->leaf = src->data->first_leaf;
+    cursor->last_leaf = src->data->last_leaf;
+    cursor->pos = cursor->leaf->data->name;
 }
-void PRINT_TREE_LEVELS(Tree* final_tree, FILE* out_file)
+
+int NAME_CURSOR_NEXT(NameCursor* cursor)
 {
-    // Helper function to print all levels, starting from the root
-    if (final_tree->root == NULL)
-    {
-        printf("Tree is empty\n");
-        return;
-    }
-    int levels = GET_TREE_HEIGHT(final_tree->root);
-    for (int i = 0; i < levels; i++)
+    // Function to return the next character of the name, or 0 at its end
+    while (*cursor->pos == '\0')
     {
-        PRINT_SPECIFIC_TREE_LEVEL(final_tree->root, i, out_file);
-        fprintf(out_file, "\n");
+        if (cursor->leaf == cursor->last_leaf)
+        {
+            return 0;
+        }
+        cursor->leaf = cursor->leaf->next_leaf;
+        cursor->pos = cursor->leaf->data->name;
     }
+    return (unsigned char)*cursor->pos++;
 }
 
-void PROCEED_TASK_1(Tree* final_tree, Heap* min_heap, FILE* in_file)
+int NAME_CMP(node* el_a, node* el_b)
 {
-    // Main function to perform task 1 and build the final tree for all other tasks
-    int satellit_count, temp;
-    char buff[256];
-    fscanf(in_file, "%d", &satellit_count); // Get number of satellites
-    while ((temp = fgetc(in_file)) != '\n' && temp != EOF){}
-    // Array to store all satellites' frequencies
-    int* satellites_freq = (int*)malloc(sizeof(int) * satellit_count);
-    if (satellites_freq == NULL)
+    // Function equivalent to strcmp() on the full names of two nodes
+    STATS_COUNT(name_cmp, 1);
+    if (el_a->data->name != NULL && el_b->data->name != NULL)
     {
-        perror("Error on malloc satellites_freq");
-        return;
-    }
-    // Array to store all satellites' names
-    char** satellites_name = (char**)malloc(sizeof(char*) * satellit_count);
-    if (satellites_name == NULL)
-    {
-        perror("Error on malloc satellites_name vector");
-        free(satellites_freq);
-        return;
-    }
-
-    // Read n satellites from input
-    for (int i = 0; i < satellit_count; i++){
-        fscanf(in_file, "%d %s", &satellites_freq[i], buff);
-        buff[strcspn (buff, "\n")] = '\0';
-        satellites_name[i] = strdup(buff);
-        if (satellites_name[i] == NULL)
-        {
-            perror("Error on malloc satellites_name_i");
-            for (int j = 0; j < i; j++){
-                if (satellites_name[i] != NULL)
-                {
-                    free(satellites_name[j]);
-                }
-            }
-            free(satellites_freq);
-            free(satellites_name);
-            return;
-        }		
+        return strcmp(el_a->data->name, el_b->data->name);
     }
-    // After obtaining all input data, build the heap and construct the tree
-    CONSTRUCT_HEAP(min_heap, satellites_freq, satellites_name, satellit_count);
-    for (int i = 0; i < satellit_count; i++)
+    NameCursor cursor_a, cursor_b;
+    NAME_CURSOR_INIT(&cursor_a, el_a);
+    NAME_CURSOR_INIT(&cursor_b, el_b);
+    while (1)
     {
-        free(satellites_name[i]);
-    }
-    free(satellites_freq);
-    free(satellites_name);
-    CONSTRUCT_TREE(min_heap, final_tree);
-}
-void PROCEED_TASK_2(Tree* final_tree, FILE* in_file, FILE* out_file)
-{
-    // Main function to perform task 2
-    // (Traverse the tree by a given binary path)
-    int n_codif, temp;
-    char buff[256];
-    fscanf(in_file, "%d", &n_codif);
-    while ((temp = fgetc(in_file)) != '\n' && temp != EOF){}
-    for (int i = 0; i < n_codif; i++){
-        fscanf(in_file, "%s", buff);
-        node* root = final_tree->root;
-        for (int j = 0; j < (int)strlen(buff); j++)
-        // If 0, go left; if 1, go right in the tree
+        int char_a = NAME_CURSOR_NEXT(&cursor_a);
+        int char_b = NAME_CURSOR_NEXT(&cursor_b);
+        if (char_a != char_b || char_a == 0)
         {
-            if (buff[j] == '0')
-            {
-                root = root->left;
-            } else if (buff[j] == '1')
-            {
-                root = root->right;
-            }
-            if (root->left == NULL && root->right == NULL)
-            {
-                fprintf(out_file, "%s ", root->data->name);
-                root = final_tree->root;
-            }
+            return char_a - char_b;
         }
-        fprintf(out_file, "\n");
     }
 }
 
-int BUILD_PATH_NODE(node* root, char** path, int level, char* name, int* max_len)
+int NAME_EQUALS(node* src, const char* name, size_t len)
 {
-    // Helper function used for task 3.
-    // Recursively traverses left and right until it finds the specific node
-    // If found, builds the binary path
-    if (root == NULL)
+    // Function to check if the full name of a node is the given string
+    // (len characters, not necessarily '\0' terminated)
+    if (len != src->data->name_len)
     {
         return 0;
     }
-    if (strcmp(root->data->name, name) == 0) 
+    if (src->data->name != NULL)
     {
-        // If we are at the searched node, we know the depth in the tree
-        // so we can build the path
-        *max_len = level;
-        if ((int)strlen(*path) <= level)
-        {
-            char* temp_buff = (char*)realloc(*path, sizeof(char) * (level * 2));
-            if (temp_buff == NULL)
-            {
-                perror("Error on malloc new temp buffer");
-                return 0;
-            }
-            *path = temp_buff;
-        }
-        return 1;
+        return memcmp(src->data->name, name, len) == 0;
     }
-    if (BUILD_PATH_NODE(root->right, path, level + 1, name, max_len))
+    NameCursor cursor;
+    NAME_CURSOR_INIT(&cursor, src);
+    for (size_t i = 0; i < src->data->name_len; i++)
     {
-        (*path)[level] = '1'; 
-        return 1;
-    } else if (BUILD_PATH_NODE(root->left, path, level + 1, name, max_len))
-    {
-        (*path)[level] = '0';
-        return 1;
+        if (NAME_CURSOR_NEXT(&cursor) != (unsigned char)name[i])
+        {
+            return 0;
+        }
     }
-    return 0;
+    return 1;
 }
-void PROCEED_TASK_3(Tree* final_tree, FILE* in_file, FILE* out_file)
+
+void PRINT_NODE_NAME(FlatTree* flat, int pos, FILE* out_file)
 {
-    // Main function to perform task 3
-    // Reads n satellites and tries to find the binary path to each of them
-    int n_satellites, temp;
-    char buff[512] = {0};
-    char* path = (char*)calloc(sizeof(char), 256); // buffer for build_path_node
-    int concat_capacity = 1024; // initial max capacity of final path
-    char* concat_path = (char*)calloc(sizeof(char), concat_capacity);
-    if (path == NULL || concat_path == NULL)
-    {
-        perror("Error on calloc path | concat_path");
-    }
-    fscanf(in_file, "%d", &n_satellites);
-    while ((temp = fgetc(in_file)) != '\n' && temp != EOF){}
-    int n;
-    // Read n satellites and call build_path_node for each
-    // Then concatenate each path to the final path
-    for (int i = 0; i < n_satellites; i++)
+    // Function to write the full name of a node, a slice of the leaf names
+    // A node renamed by the updates has no slice; its leaves are read
+    if (flat->name_offset[pos] == FLAT_NO_NAME)
     {
-        fscanf(in_file, "%s", buff);
-        buff[strcspn (buff, "\n")] = '\0';
-        BUILD_PATH_NODE(final_tree->root, &path, 0, buff, &n);
-        path[n] = '\0';
-        if ((int)strlen(concat_path) + n >= concat_capacity)
+        node* src = flat->source[pos];
+        for (node* leaf = src->data->first_leaf; ; leaf = leaf->next_leaf)
         {
-            char* temp_buff = (char*)realloc(
-                              concat_path, sizeof(char) * strlen(concat_path));
-            if (temp_buff == NULL)
-            {
-                perror("Error on realloc new tmp buffer");
-                free(path);
-                free(concat_path);
-                return;
-            }
-            concat_path = temp_buff;
+            fwrite(leaf->data->name, 1, leaf->data->name_len, out_file);
+            if (leaf == src->data->last_leaf) break;
         }
-        strncat(concat_path, path, n);
+        return;
     }
-    fprintf(out_file, "%s", concat_path);
-    free(path);
-    free(concat_path);
+    fwrite(flat->names + flat->name_offset[pos], 1, flat->name_len[pos], out_file);
 }
-node* GET_NODE(node* root, char* name)
+
+unsigned long long NODE_KEY(node* src)
 {
-    // Helper function to find a specific node in the tree
-    if (root == NULL)
-    {
-        return NULL;
-    }
-    if (strcmp(root->data->name,name) == 0)
-    {
-        return root;
-    }
-    return GET_NODE(root->left, name) != NULL ? GET_NODE(root->left, name) : 
-                                                GET_NODE(root->right, name);
+    // Function to pack the frequency (biased, so negative values keep
+    // their order) and the name rank into one integer
+    unsigned int frequency = (unsigned int)src->data->frequency ^ 0x80000000u;
+    return ((unsigned long long)frequency << 32) | src->data->name_rank;
 }
 
-node* LOWEST_COMMON_NODE(node* root, node* left, node* right)
+int HEAP_ENTRY_LESS(HeapEntry* el_a, HeapEntry* el_b)
 {
-    // Helper function for Lowest Common Ancestor
-    // If NULL, nothing found
-    // If root == left or root == right, found the searched node
-    if (root == NULL || root == left || root == right)
-    {
-        return root;
-    }
-    // Recursively call LOWEST_COMMON_NODE for left and right subtrees
-    // to find the two specific nodes
-    node* left_side = LOWEST_COMMON_NODE(root->left, left, right);
-    node* right_side = LOWEST_COMMON_NODE(root->right, left, right);
-    if (left_side != NULL && right_side != NULL)
-    {
-        // In this case, root is the lowest common ancestor.
-        return root;
-    }
-    if (left_side != NULL)
+    // Function to compare two heap entries: the keys decide, unless they
+    // are equal (same frequency and names that share a prefix group, see
+    // RANK_LEAF_NAMES); only then are the names compared
+    STATS_COUNT(node_cmp, 1);
+    if (el_a->key != el_b->key)
     {
-        return left_side;
+        return el_a->key < el_b->key;
     }
-    return right_side;
+    return NAME_CMP(el_a->item, el_b->item) < 0;
 }
 
-void PROCEED_TASK_4(Tree* final_tree, FILE* in_file, FILE* out_file)
+int NODE_CMP(node* el_a, node* el_b)
 {
-    // Main function for solving task 4
-    // (Finding the lowest common ancestor of all given nodes)
-    int n_satellites, temp;
-    char buff[256];
-    fscanf(in_file, "%d", &n_satellites); // Read number of given nodes
-    while ((temp = fgetc(in_file)) != '\n' && temp != EOF){}
-    // Array of node pointers (addresses of the given nodes in the tree)
-    node** node_arr = malloc(sizeof(node*) * n_satellites); 
+    // Function to handle cases when nodes have the same frequency
+    // In such cases, they are ordered by their name (lexicographically)
+    STATS_COUNT(node_cmp, 1);
+    unsigned long long key_a = NODE_KEY(el_a);
+    unsigned long long key_b = NODE_KEY(el_b);
+    if (key_a < key_b)
+    {
+        return -1;
+    } else if (key_a > key_b)
+    {
+        return 1;
+    } else{
+        return NAME_CMP(el_a, el_b);
+    }
+}
+
+void INIT_LEAF_NODE(node* new_node, char* name, size_t len, int freq)
+{
+    // Helper function to fill the data of a leaf (name of len characters)
+    new_node->data->frequency = freq;
+    new_node->data->name = name;
+    new_node->data->name_len = len;
+    new_node->data->name_hash = NAME_HASH_STRING(name, len, &new_node->data->name_pow);
+}
+
+node* CREATE_LEAF_NODE(NodePool* pool, char* name, int freq)
+{
+    // Function to take a new leaf node from the pool
+    // The name must already be stored in the pool
+    node* new_node = POOL_NEW_NODE(pool);
+    if (new_node == NULL)
+    {
+        return NULL;
+    }
+    INIT_LEAF_NODE(new_node, name, strlen(name), freq);
+    return new_node;
+}
+
+int GET_MAX(int a, int b)
+{
+    // Function equivalent to max()
+    return a > b ? a : b;
+}
+
+int GET_MIN_INT(int a, int b)
+{
+    // Function equivalent to min()
+    return a < b ? a : b;
+}
+
+void HEAP_SIFT_UP(Heap* min_heap, int idx)
+{
+    // Move the element at position idx up until its parent is lower
+    // (the parents are shifted down into the hole instead of swapped)
+    HeapEntry moving = min_heap->data_arr[idx];
+    while (idx > 0)
+    {
+        int parent = (idx - 1) / HEAP_ARITY;
+        if (!HEAP_ENTRY_LESS(&moving, &min_heap->data_arr[parent]))
+        {
+            break;
+        }
+        min_heap->data_arr[idx] = min_heap->data_arr[parent];
+        idx = parent;
+        STATS_COUNT(heap_sifts, 1);
+    }
+    min_heap->data_arr[idx] = moving;
+}
+
+void INSERT_MIN_HEAP(Heap* min_heap, node* new_node)
+{
+    // Function to insert a node into the min-heap
+    // Perform insertion
+    int n = min_heap->n_nodes;
+    int max_cap = min_heap->max_capacity;
+    // If the data array is full, double its capacity using realloc
+    if (n == max_cap)
+    {
+        max_cap *= 2; // Increase max capacity
+        HeapEntry* new_data_arr = (HeapEntry*)realloc(min_heap->data_arr,
+                                                      sizeof(HeapEntry) * max_cap);
+        if (new_data_arr == NULL)
+        {
+            perror("Error on realloc new data_arr");
+            return;
+        }
+        min_heap->data_arr = new_data_arr;
+        min_heap->max_capacity = max_cap;
+    }
+    min_heap->data_arr[n].key = NODE_KEY(new_node);
+    min_heap->data_arr[n].item = new_node;
+    min_heap->n_nodes++;
+
+    // Perform heapify according to min-heap rules
+    HEAP_SIFT_UP(min_heap, n);
+}
+
+node* GET_MIN(Heap* min_heap)
+{
+    // Function to get the minimum element in the heap
+    if (min_heap->n_nodes == 0) return NULL;
+    return min_heap->data_arr[0].item; // In a min-heap, the minimum is the first element
+}
+
+void HEAP_SIFT_DOWN(Heap* min_heap, int idx)
+{
+    // Move the element at position idx down until all its children are
+    // greater; the lowest child is shifted up into the hole at each level
+    int n = min_heap->n_nodes;
+    if (idx >= n) return;
+    HeapEntry moving = min_heap->data_arr[idx];
+    while (1)
+    {
+        int first_child = HEAP_ARITY * idx + 1;
+        if (first_child >= n)
+        {
+            break;
+        }
+        int last_child = GET_MIN_INT(first_child + HEAP_ARITY, n);
+        int lowest = first_child;
+        for (int child = first_child + 1; child < last_child; child++)
+        {
+            if (HEAP_ENTRY_LESS(&min_heap->data_arr[child], &min_heap->data_arr[lowest]))
+            {
+                lowest = child;
+            }
+        }
+        if (!HEAP_ENTRY_LESS(&min_heap->data_arr[lowest], &moving))
+        {
+            break;
+        }
+        min_heap->data_arr[idx] = min_heap->data_arr[lowest];
+        idx = lowest;
+        STATS_COUNT(heap_sifts, 1);
+    }
+    min_heap->data_arr[idx] = moving;
+}
+
+void REMOVE_ELEMENT(Heap* min_heap, int val)
+{
+    int idx = -1;
+    int n = min_heap->n_nodes;
+    // Try to find a specific element by its value (frequency)
+    for (int i = 0; i < n; i++)
+    {
+        if (min_heap->data_arr[i].item->data->frequency == val)
+        {
+            idx = i;
+            break;
+        }
+    }
+
+    if (idx == -1)
+    {
+        printf("Val not found in min heap");
+        return;
+    }
+    // Replace current element with the last one
+    min_heap->data_arr[idx] = min_heap->data_arr[n-1];
+    // Remove that element from the min-heap
+    min_heap->n_nodes--;
+    // Perform heapify according to min-heap rules
+    HEAP_SIFT_DOWN(min_heap, idx);
+}
+
+node* HEAP_EXTRACT_MIN(Heap* min_heap)
+{
+    // Function to remove the root of the heap in O(log n):
+    // the last element takes its place and is sifted down
+    if (min_heap->n_nodes == 0) return NULL;
+    node* min_element = min_heap->data_arr[0].item;
+    min_heap->n_nodes--;
+    min_heap->data_arr[0] = min_heap->data_arr[min_heap->n_nodes];
+    HEAP_SIFT_DOWN(min_heap, 0);
+    return min_element;
+}
+
+node* HEAP_BUILD_MIN_NODE(Heap* min_heap)
+{
+    // Function to get the minimum element from the heap and remove it
+    // (In the first version, the heap was built using an array of Item*,
+    // so this function created a new node from an Item element)
+    // The root is always the minimum, so there is no need to search
+    // the array for it (REMOVE_ELEMENT did that in O(n))
+    return HEAP_EXTRACT_MIN(min_heap);
+}
+
+void CONSTRUCT_HEAP(Heap* min_heap, node** leaves, int n)
+{
+    // Function to build the initial heap from the leaves in O(n): the
+    // entries are copied as they are, then every inner position is sifted
+    // down, from the last one to the root
+    if (n > min_heap->max_capacity)
+    {
+        HeapEntry* new_data_arr = (HeapEntry*)realloc(min_heap->data_arr,
+                                                      sizeof(HeapEntry) * n);
+        if (new_data_arr == NULL)
+        {
+            perror("Error on realloc new data_arr");
+            return;
+        }
+        min_heap->data_arr = new_data_arr;
+        min_heap->max_capacity = n;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        min_heap->data_arr[i].key = NODE_KEY(leaves[i]);
+        min_heap->data_arr[i].item = leaves[i];
+    }
+    min_heap->n_nodes = n;
+    for (int i = (n - 2) / HEAP_ARITY; i >= 0; i--)
+    {
+        HEAP_SIFT_DOWN(min_heap, i);
+    }
+}
+
+node* MERGE_NODES(node* min_left, node* min_right, Tree* final_tree)
+{
+    // Function to build the parent of the two lowest nodes
+    // Take a new parent node from the pool
+    node* parent = POOL_NEW_NODE(&final_tree->pool);
+    if (parent == NULL)
+    {
+        return NULL;
+    }
+    parent->left = min_left; // Store addresses for those two nodes
+    parent->right = min_right;
+    parent->data->frequency = min_left->data->frequency +
+                              min_right->data->frequency;
+    // Again, handle the case when nodes have the same frequency
+    node* first = min_left;
+    node* second = min_right;
+    if (NODE_CMP(min_left, min_right) >= 0)
+    {
+        first = min_right;
+        second = min_left;
+    }
+    // The parent name is first's name followed by second's name, so it is
+    // enough to link the two leaf ranges instead of copying the strings
+    first->data->last_leaf->next_leaf = second->data->first_leaf;
+    parent->data->first_leaf = first->data->first_leaf;
+    parent->data->last_leaf = second->data->last_leaf;
+    parent->data->name_len = first->data->name_len + second->data->name_len;
+    parent->data->name_hash = first->data->name_hash * second->data->name_pow +
+                              second->data->name_hash;
+    parent->data->name_pow = first->data->name_pow * second->data->name_pow;
+    parent->data->name_rank = first->data->name_rank;
+    parent->data->height = 1 + GET_MAX(min_left->data->height,
+                                       min_right->data->height);
+    min_left->parent = parent;
+    min_right->parent = parent;
+    final_tree->n_nodes++;
+    return parent;
+}
+
+void CONSTRUCT_TREE(Heap* min_heap, Tree* final_tree)
+{
+    // Function to build the final tree from the heap
+    node* parent = final_tree->root;
+    while (min_heap->n_nodes > 1)
+    {
+        // Get two nodes with the lowest frequency
+        node* min_left = HEAP_BUILD_MIN_NODE(min_heap);
+        node* min_right = HEAP_BUILD_MIN_NODE(min_heap);
+        parent = MERGE_NODES(min_left, min_right, final_tree);
+        if (parent == NULL)
+        {
+            return;
+        }
+        INSERT_MIN_HEAP(min_heap, parent);
+    }
+    final_tree->root = parent;
+}
+
+int SATELLITES_ARE_SORTED(int* satellites_freq, char** satellites_name, int n)
+{
+    // Function to check if the input already comes in NODE_CMP order
+    for (int i = 1; i < n; i++)
+    {
+        if (satellites_freq[i-1] > satellites_freq[i] ||
+            (satellites_freq[i-1] == satellites_freq[i] &&
+             strcmp(satellites_name[i-1], satellites_name[i]) > 0))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+node* QUEUE_POP_MIN(node** leaves, int* leaf_head, int n_leaves,
+                    node** merged, int* merged_head, int merged_tail)
+{
+    // Function to pop the lowest front of the two queues
+    // (leaves win ties, as equal nodes are interchangeable)
+    if (*leaf_head < n_leaves && (*merged_head == merged_tail ||
+        NODE_CMP(leaves[*leaf_head], merged[*merged_head]) <= 0))
+    {
+        return leaves[(*leaf_head)++];
+    }
+    return merged[(*merged_head)++];
+}
+
+void CONSTRUCT_TREE_SORTED(Heap* min_heap, Tree* final_tree,
+                           node** leaves, int n_leaves)
+{
+    // Linear-time variant of CONSTRUCT_TREE for leaves that are already
+    // sorted: the sorted leaves form one queue and the merged parents form
+    // a second one, so the minimum is always at the front of one of them.
+    // Parents usually come out in increasing order, but equal frequencies
+    // with names that are prefixes of each other can break that. When it
+    // happens, the remaining nodes are moved into the heap and the build
+    // continues with CONSTRUCT_TREE, so the result is always the same tree.
+    node** merged = (node**)malloc(sizeof(node*) * n_leaves);
+    if (merged == NULL)
+    {
+        perror("Error on malloc merged queue");
+        return;
+    }
+    int leaf_head = 0, merged_head = 0, merged_tail = 0;
+    node* parent = NULL;
+    while ((n_leaves - leaf_head) + (merged_tail - merged_head) > 1)
+    {
+        node* min_left = QUEUE_POP_MIN(leaves, &leaf_head, n_leaves,
+                                       merged, &merged_head, merged_tail);
+        node* min_right = QUEUE_POP_MIN(leaves, &leaf_head, n_leaves,
+                                        merged, &merged_head, merged_tail);
+        parent = MERGE_NODES(min_left, min_right, final_tree);
+        if (parent == NULL)
+        {
+            free(merged);
+            return;
+        }
+        if (merged_tail > merged_head &&
+            NODE_CMP(parent, merged[merged_tail - 1]) < 0)
+        {
+            // Order of the second queue is broken, fall back to the heap
+            for (int i = leaf_head; i < n_leaves; i++)
+            {
+                INSERT_MIN_HEAP(min_heap, leaves[i]);
+            }
+            for (int i = merged_head; i < merged_tail; i++)
+            {
+                INSERT_MIN_HEAP(min_heap, merged[i]);
+            }
+            INSERT_MIN_HEAP(min_heap, parent);
+            free(merged);
+            final_tree->root = parent;
+            CONSTRUCT_TREE(min_heap, final_tree);
+            return;
+        }
+        merged[merged_tail++] = parent;
+    }
+    free(merged);
+    final_tree->root = parent;
+}
+
+size_t NAME_INDEX_SLOT(unsigned long long hash, size_t mask)
+{
+    // Function to spread the hash bits before masking
+    // (the low bits of a polynomial hash are weak on their own)
+    hash ^= hash >> 31;
+    hash *= 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+    return (size_t)hash & mask;
+}
+
+node* INDEX_LOOKUP(NameIndex* index, const char* name, size_t len)
+{
+    // Function to find a node by its full name in O(len)
+    if (index->slots == NULL) return NULL;
+    unsigned long long hash = NAME_HASH_STRING(name, len, NULL);
+    size_t slot = NAME_INDEX_SLOT(hash, index->mask);
+    while (index->slots[slot] != NULL)
+    {
+        node* candidate = index->slots[slot];
+        if (candidate->data->name_hash == hash && NAME_EQUALS(candidate, name, len))
+        {
+            return candidate;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return NULL;
+}
+
+void INDEX_INSERT(NameIndex* index, node* src)
+{
+    // Function to add a node to the index. If another node already has
+    // the same name, the first one inserted is kept (both are marked)
+    size_t slot = NAME_INDEX_SLOT(src->data->name_hash, index->mask);
+    while (index->slots[slot] != NULL)
+    {
+        node* other = index->slots[slot];
+        if (other->data->name_hash == src->data->name_hash &&
+            other->data->name_len == src->data->name_len &&
+            NAME_CMP(other, src) == 0)
+        {
+            other->data->name_shared = 1;
+            src->data->name_shared = 1;
+            return;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot] = src;
+    index->n_used++;
+}
+
+int INDEX_REMOVE(NameIndex* index, node* src)
+{
+    // Function to take a node out of the index (before its name changes)
+    // The entries after it in the probe run are shifted back, so lookups
+    // never stop early. Returns 0 if the node was not in the index
+    size_t slot = NAME_INDEX_SLOT(src->data->name_hash, index->mask);
+    while (index->slots[slot] != src)
+    {
+        if (index->slots[slot] == NULL) return 0;
+        slot = (slot + 1) & index->mask;
+    }
+    size_t hole = slot;
+    while (1)
+    {
+        slot = (slot + 1) & index->mask;
+        node* moved = index->slots[slot];
+        if (moved == NULL) break;
+        // An entry can move back to the hole unless its home slot lies
+        // cyclically in (hole, slot]
+        size_t home = NAME_INDEX_SLOT(moved->data->name_hash, index->mask);
+        if (((slot - home) & index->mask) >= ((slot - hole) & index->mask))
+        {
+            index->slots[hole] = moved;
+            hole = slot;
+        }
+    }
+    index->slots[hole] = NULL;
+    index->n_used--;
+    return 1;
+}
+
+int INDEX_RESERVE(NameIndex* index, size_t extra)
+{
+    // Function to keep the index at most half full before adding nodes
+    size_t capacity = index->mask + 1;
+    if ((index->n_used + extra) * 2 <= capacity) return 1;
+    while ((index->n_used + extra) * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+    node** slots = (node**)calloc(capacity, sizeof(node*));
+    if (slots == NULL)
+    {
+        perror("Error on calloc tree index");
+        return 0;
+    }
+    for (size_t i = 0; index->slots != NULL && i <= index->mask; i++)
+    {
+        node* entry = index->slots[i];
+        if (entry == NULL) continue;
+        size_t slot = NAME_INDEX_SLOT(entry->data->name_hash, capacity - 1);
+        while (slots[slot] != NULL)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = entry;
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->mask = capacity - 1;
+    return 1;
+}
+
+void STORE_LEAF_CODE(CodeTable* codes, node* leaf, size_t offset)
+{
+    // Helper function to write the code of a leaf at offset (the bits
+    // there are 0) from the leaf up to the root, last bit first
+    leaf->data->code_offset = offset;
+    size_t bit = offset + leaf->data->depth;
+    for (node* it = leaf; it->parent != NULL; it = it->parent)
+    {
+        bit--;
+        if (it == it->parent->right)
+        {
+            codes->bits[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+}
+
+void BUILD_CODE_TABLE(Tree* final_tree, node** leaves, int n_leaves,
+                      size_t total_bits)
+{
+    // Function to pack the code of every leaf into the code table
+    CodeTable* codes = &final_tree->codes;
+    // One spare word at the end, so PEEK_BITS can read past the last code
+    codes->capacity = total_bits / 64 + 2;
+    codes->bits = (unsigned long long*)calloc(codes->capacity,
+                                              sizeof(unsigned long long));
+    if (codes->bits == NULL)
+    {
+        perror("Error on calloc code table");
+        return;
+    }
+    codes->n_bits = total_bits;
+    codes->n_stale = 0;
+    size_t offset = 0;
+    for (int i = 0; i < n_leaves; i++)
+    {
+        STORE_LEAF_CODE(codes, leaves[i], offset);
+        offset += leaves[i]->data->depth;
+    }
+}
+
+#define CODE_TABLE_MAX_BITS ((size_t)1 << 32)
+
+unsigned long long FINGERPRINT_MIX(unsigned long long fingerprint,
+                                   unsigned long long value)
+{
+    // Function to fold one value into a tree fingerprint
+    fingerprint ^= value + 0x9e3779b97f4a7c15ULL + (fingerprint << 6) +
+                   (fingerprint >> 2);
+    return fingerprint * NAME_HASH_BASE;
+}
+
+unsigned long long FINGERPRINT_NODE(unsigned long long fingerprint, node* src)
+{
+    // Function to fold the next node of a preorder walk into a fingerprint
+    // The preorder sequence of (frequency, name, is_leaf) identifies the tree
+    fingerprint = FINGERPRINT_MIX(fingerprint, (unsigned)src->data->frequency);
+    fingerprint = FINGERPRINT_MIX(fingerprint, src->data->name_hash);
+    return FINGERPRINT_MIX(fingerprint, src->left == NULL);
+}
+
+void BUILD_TREE_INDEX(Tree* final_tree)
+{
+    // Function to build the name index and the code table once the tree
+    // is final. Nodes are visited in preorder (left first), the same
+    // order SEARCH_NODE searches in, so duplicate names resolve the same way
+    if (final_tree->root == NULL) return;
+    int total_nodes = 2 * final_tree->n_nodes + 1;
+    size_t capacity = 2;
+    while (capacity < (size_t)total_nodes * 2)
+    {
+        capacity *= 2;
+    }
+    final_tree->index.slots = (node**)calloc(capacity, sizeof(node*));
+    node** stack = (node**)malloc(sizeof(node*) * total_nodes);
+    node** leaves = (node**)malloc(sizeof(node*) * (final_tree->n_nodes + 1));
+    if (final_tree->index.slots == NULL || stack == NULL || leaves == NULL)
+    {
+        perror("Error on malloc tree index");
+        free(final_tree->index.slots);
+        final_tree->index.slots = NULL;
+        free(stack);
+        free(leaves);
+        return;
+    }
+    final_tree->index.mask = capacity - 1;
+    int top = 0, n_leaves = 0, n_visited = 0;
+    size_t total_bits = 0;
+    unsigned long long fingerprint = 0;
+    final_tree->root->data->depth = 0;
+    stack[top++] = final_tree->root;
+    while (top > 0)
+    {
+        node* current = stack[--top];
+        current->data->preorder = n_visited++;
+        INDEX_INSERT(&final_tree->index, current);
+        int is_leaf = current->left == NULL && current->right == NULL;
+        fingerprint = FINGERPRINT_NODE(fingerprint, current);
+        if (is_leaf)
+        {
+            leaves[n_leaves++] = current;
+            total_bits += current->data->depth;
+            continue;
+        }
+        current->right->data->depth = current->data->depth + 1;
+        current->left->data->depth = current->data->depth + 1;
+        stack[top++] = current->right;
+        stack[top++] = current->left;
+    }
+    final_tree->fingerprint = fingerprint;
+    // Degenerate trees can have codes with a total length close to n^2 / 2
+    // bits; in that case codes are rebuilt from the parent links instead
+    if (total_bits <= CODE_TABLE_MAX_BITS)
+    {
+        BUILD_CODE_TABLE(final_tree, leaves, n_leaves, total_bits);
+    }
+    free(stack);
+    free(leaves);
+}
+
+int WRITE_NODE_CODE(Tree* final_tree, int id, char** path, int* path_cap)
+{
+    // Function to write the binary path of a node (a FlatTree position)
+    // as '0'/'1' characters
+    // Returns the length of the path (the depth of the node)
+    FlatTree* flat = &final_tree->flat;
+    int len = flat->depth[id];
+    if (len + 1 > *path_cap)
+    {
+        char* temp_buff = (char*)realloc(*path, sizeof(char) * (len + 1));
+        if (temp_buff == NULL)
+        {
+            perror("Error on realloc path buffer");
+            return 0;
+        }
+        *path = temp_buff;
+        *path_cap = len + 1;
+    }
+    CodeTable* codes = &final_tree->codes;
+    if (codes->bits != NULL && flat->left[id] == -1)
+    {
+        size_t bit = flat->code_offset[id];
+        for (int i = 0; i < len; i++, bit++)
+        {
+            (*path)[i] = (codes->bits[bit / 64] >> (bit % 64)) & 1 ? '1' : '0';
+        }
+    } else {
+        int i = len;
+        for (int it = id; flat->parent[it] != -1; it = flat->parent[it])
+        {
+            (*path)[--i] = flat->right[flat->parent[it]] == it ? '1' : '0';
+        }
+    }
+    (*path)[len] = '\0';
+    STATS_COUNT(nodes_visited, len);
+    return len;
+}
+
+void FREE_TREE_INDEX(Tree* final_tree)
+{
+    // Helper function to free the name index and the code table
+    free(final_tree->index.slots);
+    final_tree->index.slots = NULL;
+    if (!final_tree->codes.mapped)
+    {
+        free(final_tree->codes.bits);
+    }
+    final_tree->codes.bits = NULL;
+}
+
+void FREE_FLAT_TREE(FlatTree* flat)
+{
+    // Helper function to free the flat layout
+    if (!flat->mapped)
+    {
+        free(flat->left);
+        free(flat->right);
+        free(flat->parent);
+        free(flat->frequency);
+        free(flat->depth);
+        free(flat->height);
+        free(flat->code_offset);
+        free(flat->name_offset);
+        free(flat->name_len);
+        free(flat->names);
+        free(flat->name_shared);
+    }
+    free(flat->source);
+    free(flat->decode_tables);
+    memset(flat, 0, sizeof(FlatTree));
+}
+
+int BUILD_FLAT_TREE(Tree* final_tree)
+{
+    // Function to copy the final tree into the flat layout
+    // Positions are given breadth-first, so source doubles as the queue
+    FlatTree* flat = &final_tree->flat;
+    if (final_tree->root == NULL) return 1;
+    int n = 2 * final_tree->n_nodes + 1;
+    size_t names_size = final_tree->root->data->name_len;
+    flat->left = (int*)malloc(sizeof(int) * n);
+    flat->right = (int*)malloc(sizeof(int) * n);
+    flat->parent = (int*)malloc(sizeof(int) * n);
+    flat->frequency = (int*)malloc(sizeof(int) * n);
+    flat->depth = (int*)malloc(sizeof(int) * n);
+    flat->height = (int*)malloc(sizeof(int) * n);
+    flat->code_offset = (size_t*)malloc(sizeof(size_t) * n);
+    flat->name_offset = (size_t*)malloc(sizeof(size_t) * n);
+    flat->name_len = (size_t*)malloc(sizeof(size_t) * n);
+    flat->names = (char*)malloc(names_size + 1);
+    flat->name_shared = (unsigned char*)malloc(n);
+    flat->source = (node**)malloc(sizeof(node*) * n);
+    flat->decode_tables = (struct DecodeTable**)calloc(n, sizeof(struct DecodeTable*));
+    if (flat->left == NULL || flat->right == NULL || flat->parent == NULL ||
+        flat->frequency == NULL || flat->depth == NULL || flat->height == NULL ||
+        flat->code_offset == NULL || flat->name_offset == NULL ||
+        flat->name_len == NULL || flat->names == NULL || flat->name_shared == NULL ||
+        flat->source == NULL || flat->decode_tables == NULL)
+    {
+        perror("Error on malloc flat tree");
+        FREE_FLAT_TREE(flat);
+        return 0;
+    }
+    int tail = 0;
+    flat->source[tail++] = final_tree->root;
+    final_tree->root->data->flat_id = 0;
+    for (int i = 0; i < tail; i++)
+    {
+        node* current = flat->source[i];
+        Item* data = current->data;
+        flat->parent[i] = current->parent == NULL ? -1 : current->parent->data->flat_id;
+        flat->depth[i] = current->parent == NULL ? 0 : flat->depth[flat->parent[i]] + 1;
+        flat->frequency[i] = data->frequency;
+        flat->height[i] = data->height;
+        flat->code_offset[i] = data->code_offset;
+        data->depth = flat->depth[i];
+        flat->name_len[i] = data->name_len;
+        flat->name_shared[i] = (unsigned char)data->name_shared;
+        flat->left[i] = -1;
+        flat->right[i] = -1;
+        if (current->left != NULL)
+        {
+            flat->left[i] = tail;
+            current->left->data->flat_id = tail;
+            flat->source[tail++] = current->left;
+            flat->right[i] = tail;
+            current->right->data->flat_id = tail;
+            flat->source[tail++] = current->right;
+        }
+    }
+    flat->n = tail;
+    flat->capacity = n;
+    flat->names_used = names_size;
+    flat->names_capacity = names_size + 1;
+    // Leaf names in the order of the root's leaf chain
+    size_t offset = 0;
+    node* leaf = final_tree->root->data->first_leaf;
+    while (1)
+    {
+        memcpy(flat->names + offset, leaf->data->name, leaf->data->name_len);
+        flat->name_offset[leaf->data->flat_id] = offset;
+        offset += leaf->data->name_len;
+        if (leaf == final_tree->root->data->last_leaf)
+        {
+            break;
+        }
+        leaf = leaf->next_leaf;
+    }
+    flat->names[names_size] = '\0';
+    for (int i = 0; i < flat->n; i++)
+    {
+        flat->name_offset[i] =
+            flat->name_offset[flat->source[i]->data->first_leaf->data->flat_id];
+    }
+    return 1;
+}
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef struct OutputBuffer
+{
+    // Large write buffer: text is formatted here and written to the file
+    // in blocks of OUTPUT_BUFFER_SIZE bytes
+    FILE* out_file;
+    char* data;
+    size_t used;
+} OutputBuffer;
+
+int OUTPUT_OPEN(OutputBuffer* output, FILE* out_file)
+{
+    // Helper function to set up an output buffer for a file
+    output->out_file = out_file;
+    output->used = 0;
+    output->data = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    if (output->data == NULL)
+    {
+        perror("Error on malloc output buffer");
+        return 0;
+    }
+    return 1;
+}
+
+void OUTPUT_FLUSH(OutputBuffer* output)
+{
+    // Helper function to write out everything buffered so far
+    fwrite(output->data, 1, output->used, output->out_file);
+    output->used = 0;
+}
+
+void OUTPUT_CLOSE(OutputBuffer* output)
+{
+    // Helper function to flush and release an output buffer
+    OUTPUT_FLUSH(output);
+    free(output->data);
+    output->data = NULL;
+}
+
+void OUTPUT_WRITE(OutputBuffer* output, const char* text, size_t len)
+{
+    // Function to append len bytes, flushing whenever the buffer fills up
+    while (len > 0)
+    {
+        size_t room = OUTPUT_BUFFER_SIZE - output->used;
+        size_t count = len < room ? len : room;
+        memcpy(output->data + output->used, text, count);
+        output->used += count;
+        text += count;
+        len -= count;
+        if (output->used == OUTPUT_BUFFER_SIZE)
+        {
+            OUTPUT_FLUSH(output);
+        }
+    }
+}
+
+void OUTPUT_CHAR(OutputBuffer* output, char c)
+{
+    // Helper function to append one character
+    if (output->used == OUTPUT_BUFFER_SIZE)
+    {
+        OUTPUT_FLUSH(output);
+    }
+    output->data[output->used++] = c;
+}
+
+void OUTPUT_INT(OutputBuffer* output, int value)
+{
+    // Function to append a decimal integer, like "%d"
+    char digits[16];
+    int pos = sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do
+    {
+        digits[--pos] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+    {
+        digits[--pos] = '-';
+    }
+    OUTPUT_WRITE(output, digits + pos, sizeof(digits) - pos);
+}
+
+int PRINT_TREE_LEVELS(Tree* final_tree, FILE* out_file)
+{
+    // Function to print the tree level by level, one line per level
+    // The flat layout is already in breadth-first order: it is printed
+    // front to back, ending a line wherever the depth changes
+    // Returns 0 on error
+    if (final_tree->flat.n < 2)
+    {
+        // A lone satellite is kept for the updates, but has no code
+        printf("Tree is empty\n");
+        return 1;
+    }
+    FlatTree* flat = &final_tree->flat;
+    OutputBuffer output;
+    if (!OUTPUT_OPEN(&output, out_file))
+    {
+        return 0;
+    }
+    for (int i = 0; i < flat->n; i++)
+    {
+        OUTPUT_INT(&output, flat->frequency[i]);
+        OUTPUT_CHAR(&output, '-');
+        OUTPUT_WRITE(&output, flat->names + flat->name_offset[i], flat->name_len[i]);
+        OUTPUT_CHAR(&output, ' ');
+        if (i + 1 == flat->n || flat->depth[i + 1] != flat->depth[i])
+        {
+            OUTPUT_CHAR(&output, '\n');
+        }
+    }
+    OUTPUT_CLOSE(&output);
+    return 1;
+}
+
+// Input scanner
+// Text inputs are mapped with mmap (or read whole when the file cannot be
+// mapped, e.g. a pipe) and tokenised in place: numbers are parsed by hand
+// and words come back as (pointer, length) views into the text, so no
+// token is copied and there is no limit on the length of a name or path
+typedef struct Scanner
+{
+    const char* text;
+    size_t size;
+    size_t pos;
+    void* map; // mmap of the file, or NULL
+    char* owned; // Buffer the file was read into when it could not be mapped
+} Scanner;
+
+void SCANNER_FROM_TEXT(Scanner* scanner, const char* text, size_t size)
+{
+    // Helper function to scan a buffer that the caller keeps alive
+    scanner->text = text;
+    scanner->size = size;
+    scanner->pos = 0;
+    scanner->map = NULL;
+    scanner->owned = NULL;
+}
+
+int SCANNER_OPEN(Scanner* scanner, FILE* file)
+{
+    // Function to make the rest of a file scannable
+    SCANNER_FROM_TEXT(scanner, NULL, 0);
+    struct stat info;
+    long start = ftell(file);
+    if (start >= 0 && fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) &&
+        info.st_size > 0)
+    {
+        void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+                         fileno(file), 0);
+        if (map != MAP_FAILED)
+        {
+            scanner->map = map;
+            scanner->text = (const char*)map;
+            scanner->size = info.st_size;
+            scanner->pos = (size_t)start < scanner->size ? (size_t)start : scanner->size;
+            return 1;
+        }
+    }
+    // Not a regular file: read everything that is left
+    size_t capacity = 64 * 1024, size = 0, n_read;
+    char* buffer = (char*)malloc(capacity);
+    while (buffer != NULL &&
+           (n_read = fread(buffer + size, 1, capacity - size, file)) > 0)
+    {
+        size += n_read;
+        if (size == capacity)
+        {
+            char* temp_buffer = (char*)realloc(buffer, capacity * 2);
+            if (temp_buffer == NULL)
+            {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = temp_buffer;
+            capacity *= 2;
+        }
+    }
+    if (buffer == NULL)
+    {
+        perror("Error on reading input");
+        return 0;
+    }
+    scanner->owned = buffer;
+    scanner->text = buffer;
+    scanner->size = size;
+    return 1;
+}
+
+void SCANNER_CLOSE(Scanner* scanner)
+{
+    // Helper function to release the mapping or the buffer of a scanner
+    if (scanner->map != NULL)
+    {
+        munmap(scanner->map, scanner->size);
+    }
+    free(scanner->owned);
+    SCANNER_FROM_TEXT(scanner, NULL, 0);
+}
+
+void SCAN_SKIP_SPACE(Scanner* scanner)
+{
+    // Helper function to move past whitespace
+    while (scanner->pos < scanner->size &&
+           isspace((unsigned char)scanner->text[scanner->pos]))
+    {
+        scanner->pos++;
+    }
+}
+
+int SCAN_INT(Scanner* scanner, int* value)
+{
+    // Function to read a decimal integer, like fscanf("%d")
+    // Returns 0 (and leaves *value unchanged) if there is none
+    SCAN_SKIP_SPACE(scanner);
+    size_t pos = scanner->pos;
+    int negative = 0;
+    if (pos < scanner->size && (scanner->text[pos] == '-' || scanner->text[pos] == '+'))
+    {
+        negative = scanner->text[pos] == '-';
+        pos++;
+    }
+    size_t digits_at = pos;
+    long long result = 0;
+    while (pos < scanner->size && scanner->text[pos] >= '0' && scanner->text[pos] <= '9')
+    {
+        if (result <= 0x7fffffffLL)
+        {
+            result = result * 10 + (scanner->text[pos] - '0');
+        }
+        pos++;
+    }
+    if (pos == digits_at) return 0;
+    scanner->pos = pos;
+    *value = (int)(negative ? -result : result);
+    return 1;
+}
+
+size_t SCAN_TOKEN(Scanner* scanner, const char** token)
+{
+    // Function to read the next whitespace separated word, like
+    // fscanf("%s"), as a view into the text. Returns its length (0 at the end)
+    SCAN_SKIP_SPACE(scanner);
+    size_t start = scanner->pos;
+    while (scanner->pos < scanner->size &&
+           !isspace((unsigned char)scanner->text[scanner->pos]))
+    {
+        scanner->pos++;
+    }
+    *token = scanner->text + start;
+    return scanner->pos - start;
+}
+
+void SCAN_SKIP_LINE(Scanner* scanner)
+{
+    // Helper function to move past the end of the current line
+    while (scanner->pos < scanner->size && scanner->text[scanner->pos++] != '\n'){}
+}
+
+int SCAN_COUNT(Scanner* scanner)
+{
+    // Helper function to read the count line that starts every task input
+    int count = 0;
+    if (!SCAN_INT(scanner, &count) || count < 0)
+    {
+        count = 0;
+    }
+    SCAN_SKIP_LINE(scanner);
+    return count;
+}
+
+int LEAF_NAME_CMP(const void* a, const void* b)
+{
+    // Helper function for qsort: leaves by name
+    return strcmp((*(node* const*)a)->data->name, (*(node* const*)b)->data->name);
+}
+
+void ASSIGN_NAME_RANKS(node** by_name, int n)
+{
+    // Helper function to rank leaves that are sorted by name (see below)
+    unsigned int rank = 0;
+    node* group = NULL;
+    for (int i = 0; i < n; i++)
+    {
+        Item* leaf = by_name[i]->data;
+        if (group == NULL ||
+            strncmp(leaf->name, group->data->name, group->data->name_len) != 0)
+        {
+            group = by_name[i];
+            rank++;
+        }
+        leaf->name_rank = rank;
+    }
+}
+
+void RANK_LEAF_NAMES(node** leaves, int n)
+{
+    // Function to rank the leaf names once, before the tree is built, so
+    // the heap compares (frequency, rank) integers instead of names.
+    // In name order, every name that has an earlier name as a prefix
+    // joins the group of the shortest such prefix; groups are ranked
+    // 1, 2, ... Two names of different groups are not prefixes of each
+    // other, so they compare like their groups, and so does every name
+    // that starts with them. The parent of two nodes takes the rank of its
+    // first leaf, and only nodes of the same group and frequency need
+    // NAME_CMP. If the leaves cannot be ranked, all ranks stay 0 and every
+    // tie is decided by NAME_CMP, as before
+    node** by_name = leaves;
+    int sorted = 1;
+    for (int i = 1; i < n && sorted; i++)
+    {
+        sorted = LEAF_NAME_CMP(&leaves[i - 1], &leaves[i]) <= 0;
+    }
+    if (!sorted)
+    {
+        by_name = (node**)malloc(sizeof(node*) * n);
+        if (by_name == NULL)
+        {
+            perror("Error on malloc leaf ranks");
+            return;
+        }
+        memcpy(by_name, leaves, sizeof(node*) * n);
+        qsort(by_name, n, sizeof(node*), LEAF_NAME_CMP);
+    }
+    ASSIGN_NAME_RANKS(by_name, n);
+    if (by_name != leaves)
+    {
+        free(by_name);
+    }
+}
+
+void INDEX_SATELLITE_TREE(Tree* final_tree)
+{
+    // Helper function to build the index and the flat layout of a new tree
+    double started = STATS_NOW();
+    BUILD_TREE_INDEX(final_tree);
+    STATS_PHASE_END(stats_index, started);
+    started = STATS_NOW();
+    BUILD_FLAT_TREE(final_tree);
+    STATS_PHASE_END(stats_flat, started);
+}
+
+void BUILD_SATELLITE_TREE(Tree* final_tree, Heap* min_heap, int* satellites_freq,
+                          char** satellites_name, int satellit_count)
+{
+    // Function to build the tree, its index and its flat layout from the
+    // satellites (names stored in the pool of the tree). Sorted input can
+    // skip the heap and use the linear two-queue construction
+    double started = STATS_NOW();
+    node** leaves = (node**)malloc(sizeof(node*) * satellit_count);
+    if (leaves == NULL)
+    {
+        perror("Error on malloc leaves");
+        return;
+    }
+    for (int i = 0; i < satellit_count; i++)
+    {
+        leaves[i] = CREATE_LEAF_NODE(&final_tree->pool, satellites_name[i],
+                                     satellites_freq[i]);
+        if (leaves[i] == NULL)
+        {
+            free(leaves);
+            return;
+        }
+    }
+    RANK_LEAF_NAMES(leaves, satellit_count);
+    if (SATELLITES_ARE_SORTED(satellites_freq, satellites_name, satellit_count))
+    {
+        CONSTRUCT_TREE_SORTED(min_heap, final_tree, leaves, satellit_count);
+    } else {
+        CONSTRUCT_HEAP(min_heap, leaves, satellit_count);
+        CONSTRUCT_TREE(min_heap, final_tree);
+    }
+    if (satellit_count == 1)
+    {
+        // Nothing is merged; the lone leaf is the whole tree, which the
+        // updates can grow again (it has no code, see INDEXED_POSITION)
+        final_tree->root = leaves[0];
+    }
+    free(leaves);
+    STATS_PHASE_END(stats_build, started);
+    INDEX_SATELLITE_TREE(final_tree);
+}
+
+// Parallel tree construction (-j N)
+// The satellite lines are cut into parts with about the same number of
+// lines. Every thread parses whole parts (names stay views into the input);
+// once the size of every part is known, the names are copied into one
+// block at fixed offsets and the leaves are filled in a run of the node
+// pool taken at once, again part by part. The leaves are then sorted by
+// name (for the ranks) and by NODE_CMP with a parallel merge sort, and
+// CONSTRUCT_TREE_SORTED merges them in linear time, which gives the tree
+// of the heap. An input that is not one "FREQUENCY NAME" per line is left
+// to the serial loop
+#define BUILD_PARTS_PER_THREAD 4
+#ifndef BUILD_MIN_PART
+#define BUILD_MIN_PART 4096 // Fewer lines per part are not worth a thread
+#endif
+
+enum build_phase {
+    build_parse, build_store, build_sort, build_merge
+};
+
+typedef struct BuildBatch
+{
+    int phase; // build_phase
+    int n_tasks;
+    int next_task; // Next task to take, updated atomically
+    int n_threads;
+    pthread_t* threads;
+    int n_parts;
+    int* part_first; // First satellite of every part (n_parts + 1 entries)
+    int failed; // Some line is not "FREQUENCY NAME"
+    // Parsing and name storage
+    const char* text;
+    size_t* part_start; // First byte of every part (n_parts + 1 entries)
+    size_t* part_bytes; // Bytes taken by the names of every part, then
+                        // the offset of every part in names
+    int* freq;
+    const char** name;
+    size_t* name_len;
+    char* names; // One block holds every name
+    NodeSlab* slab;
+    int first_node; // The leaves are nodes first_node.. of slab
+    node** leaves;
+    // Merge sort: runs of run_width parts are merged two by two
+    node** items;
+    node** scratch;
+    int n_items;
+    int run_width;
+    int (*cmp)(const void*, const void*);
+} BuildBatch;
+
+int LEAF_ORDER_CMP(const void* a, const void* b)
+{
+    // Helper function for the sort of the leaves in NODE_CMP order
+    // Equal leaves keep their input order, so every thread count gives
+    // the same order
+    node* el_a = *(node* const*)a;
+    node* el_b = *(node* const*)b;
+    int result = NODE_CMP(el_a, el_b);
+    if (result == 0)
+    {
+        result = (el_a > el_b) - (el_a < el_b);
+    }
+    return result;
+}
+
+int MERGE_CO_RANK(node** run_a, int len_a, node** run_b, int len_b, int k,
+                  int (*cmp)(const void*, const void*))
+{
+    // Helper function to find how many of the first k items of the merge of
+    // two sorted runs come from the first one (equal items: first run first)
+    int low = k > len_b ? k - len_b : 0;
+    int high = k < len_a ? k : len_a;
+    while (low < high)
+    {
+        int i = low + (high - low) / 2;
+        int j = k - i;
+        if (j > 0 && i < len_a && cmp(&run_b[j - 1], &run_a[i]) >= 0)
+        {
+            low = i + 1;
+        } else {
+            high = i;
+        }
+    }
+    return low;
+}
+
+void BUILD_MERGE_SLICE(BuildBatch* batch, int task)
+{
+    // Function to write one slice of the output of a merge round
+    // Every round is cut into n_parts slices of the same size, whatever the
+    // size of the runs, so the last rounds are as parallel as the first
+    int n = batch->n_items;
+    int from = (int)((long long)task * n / batch->n_parts);
+    int to = (int)((long long)(task + 1) * n / batch->n_parts);
+    int width = batch->run_width;
+    for (int pair = 0; pair < batch->n_parts && from < to; pair += 2 * width)
+    {
+        int low = batch->part_first[pair];
+        int middle = batch->part_first[GET_MIN_INT(pair + width, batch->n_parts)];
+        int high = batch->part_first[GET_MIN_INT(pair + 2 * width, batch->n_parts)];
+        if (high <= from) continue;
+        int first = from - low;
+        int count = GET_MIN_INT(to, high) - from;
+        node** run_a = batch->items + low;
+        node** run_b = batch->items + middle;
+        int len_a = middle - low, len_b = high - middle;
+        int i = MERGE_CO_RANK(run_a, len_a, run_b, len_b, first, batch->cmp);
+        int j = first - i;
+        node** out = batch->scratch + from;
+        for (int c = 0; c < count; c++)
+        {
+            if (j >= len_b || (i < len_a && batch->cmp(&run_a[i], &run_b[j]) <= 0))
+            {
+                out[c] = run_a[i++];
+            } else {
+                out[c] = run_b[j++];
+            }
+        }
+        from += count;
+    }
+}
+
+void BUILD_PARSE_PART(BuildBatch* batch, int part)
+{
+    // Function to parse the lines of one part, like the serial loop
+    const char* end = batch->text + batch->part_start[part + 1];
+    const char* line = batch->text + batch->part_start[part];
+    size_t bytes = 0;
+    for (int i = batch->part_first[part]; i < batch->part_first[part + 1]; i++)
+    {
+        const char* line_end = (const char*)memchr(line, '\n', end - line);
+        if (line_end == NULL) line_end = end;
+        Scanner scanner;
+        SCANNER_FROM_TEXT(&scanner, line, line_end - line);
+        batch->name_len[i] = 0;
+        if (SCAN_INT(&scanner, &batch->freq[i]))
+        {
+            batch->name_len[i] = SCAN_TOKEN(&scanner, &batch->name[i]);
+            SCAN_SKIP_SPACE(&scanner);
+        }
+        if (batch->name_len[i] == 0 || scanner.pos != scanner.size)
+        {
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        bytes += batch->name_len[i] + 1;
+        line = line_end + (line_end < end);
+    }
+    batch->part_bytes[part] = bytes;
+}
+
+void BUILD_STORE_PART(BuildBatch* batch, int part)
+{
+    // Function to copy the names of one part and fill its leaves
+    char* dest = batch->names + batch->part_bytes[part];
+    for (int i = batch->part_first[part]; i < batch->part_first[part + 1]; i++)
+    {
+        size_t len = batch->name_len[i];
+        memcpy(dest, batch->name[i], len);
+        dest[len] = '\0';
+        node* leaf = &batch->slab->nodes[batch->first_node + i];
+        POOL_INIT_NODE(leaf, &batch->slab->items[batch->first_node + i]);
+        INIT_LEAF_NODE(leaf, dest, len, batch->freq[i]);
+        batch->leaves[i] = leaf;
+        dest += len + 1;
+    }
+}
+
+void* BUILD_WORKER(void* arg)
+{
+    // Function run by every thread until no task of the phase is left
+    BuildBatch* batch = (BuildBatch*)arg;
+    int task;
+    while ((task = __atomic_fetch_add(&batch->next_task, 1, __ATOMIC_RELAXED))
+           < batch->n_tasks)
+    {
+        if (batch->phase == build_parse)
+        {
+            BUILD_PARSE_PART(batch, task);
+        } else if (batch->phase == build_store) {
+            BUILD_STORE_PART(batch, task);
+        } else if (batch->phase == build_sort) {
+            int first = batch->part_first[task];
+            qsort(batch->items + first, batch->part_first[task + 1] - first,
+                  sizeof(node*), batch->cmp);
+        } else {
+            BUILD_MERGE_SLICE(batch, task);
+        }
+    }
+    return NULL;
+}
+
+void BUILD_RUN_PHASE(BuildBatch* batch, int phase)
+{
+    // Function to run one phase on every part with the calling thread and
+    // up to n_threads - 1 more (if a thread cannot start, the others take
+    // its parts)
+    batch->phase = phase;
+    batch->n_tasks = batch->n_parts;
+    batch->next_task = 0;
+    int n_started = 0;
+    for (int i = 1; i < batch->n_threads && i < batch->n_parts; i++)
+    {
+        if (pthread_create(&batch->threads[n_started], NULL, BUILD_WORKER, batch) != 0)
+        {
+            break;
+        }
+        n_started++;
+    }
+    BUILD_WORKER(batch);
+    for (int i = 0; i < n_started; i++)
+    {
+        pthread_join(batch->threads[i], NULL);
+    }
+}
+
+node** BUILD_SORT_LEAVES(BuildBatch* batch, node** items, node** scratch,
+                         int (*cmp)(const void*, const void*))
+{
+    // Function to sort items: every part is sorted with qsort, then runs
+    // are merged two by two. Returns the array that holds the result
+    // (items or scratch)
+    batch->items = items;
+    batch->scratch = scratch;
+    batch->cmp = cmp;
+    BUILD_RUN_PHASE(batch, build_sort);
+    for (batch->run_width = 1; batch->run_width < batch->n_parts; batch->run_width *= 2)
+    {
+        BUILD_RUN_PHASE(batch, build_merge);
+        node** merged = batch->scratch;
+        batch->scratch = batch->items;
+        batch->items = merged;
+    }
+    return batch->items;
+}
+
+int BUILD_SATELLITE_TREE_PARALLEL(Tree* final_tree, Heap* min_heap, Scanner* input,
+                                  int satellit_count, int n_threads)
+{
+    // Function to build the tree from the satellite lines with n_threads
+    // threads. Returns 1 once the tree is built, and 0, without reading
+    // anything, if the input is too small or its lines cannot be parsed this
+    // way (or on a malloc error of the work arrays); the caller then reads
+    // it serially. Returns -1 if the nodes or names of the tree itself
+    // cannot be allocated, since the serial path would need them too
+    int n_parts = GET_MIN_INT(n_threads * BUILD_PARTS_PER_THREAD,
+                              satellit_count / BUILD_MIN_PART);
+    if (n_threads < 2 || n_parts < 2)
+    {
+        return 0;
+    }
+    double started = STATS_NOW();
+    BuildBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.n_threads = n_threads;
+    batch.n_parts = n_parts;
+    batch.n_items = satellit_count;
+    batch.text = input->text;
+    batch.threads = (pthread_t*)malloc(sizeof(pthread_t) * n_threads);
+    batch.part_first = (int*)malloc(sizeof(int) * (n_parts + 1));
+    batch.part_start = (size_t*)malloc(sizeof(size_t) * (n_parts + 1));
+    batch.part_bytes = (size_t*)malloc(sizeof(size_t) * (n_parts + 1));
+    batch.freq = (int*)malloc(sizeof(int) * satellit_count);
+    batch.name = (const char**)malloc(sizeof(char*) * satellit_count);
+    batch.name_len = (size_t*)malloc(sizeof(size_t) * satellit_count);
+    batch.leaves = (node**)malloc(sizeof(node*) * satellit_count);
+    node** by_name = (node**)malloc(sizeof(node*) * satellit_count);
+    node** scratch = (node**)malloc(sizeof(node*) * satellit_count);
+    int parsed = 0;
+    int done = batch.threads != NULL && batch.part_first != NULL &&
+               batch.part_start != NULL && batch.part_bytes != NULL &&
+               batch.freq != NULL && batch.name != NULL && batch.name_len != NULL &&
+               batch.leaves != NULL && by_name != NULL && scratch != NULL;
+    if (done)
+    {
+        // Find the first byte of every part (and the end of the last line)
+        size_t pos = input->pos;
+        for (int part = 0; part <= n_parts; part++)
+        {
+            batch.part_first[part] = (int)((long long)part * satellit_count / n_parts);
+            int line = part == 0 ? 0 : batch.part_first[part - 1];
+            for (; line < batch.part_first[part]; line++)
+            {
+                const char* line_end = (const char*)memchr(input->text + pos, '\n',
+                                                           input->size - pos);
+                pos = line_end == NULL ? input->size : (size_t)(line_end - input->text) + 1;
+            }
+            batch.part_start[part] = pos;
+        }
+        BUILD_RUN_PHASE(&batch, build_parse);
+        done = !batch.failed;
+        parsed = done;
+    } else {
+        perror("Error on malloc parallel build");
+    }
+    if (done)
+    {
+        // Name offsets of the parts, one block and one run of nodes for all
+        size_t total = 0;
+        for (int part = 0; part < n_parts; part++)
+        {
+            size_t bytes = batch.part_bytes[part];
+            batch.part_bytes[part] = total;
+            total += bytes;
+        }
+        batch.names = POOL_ALLOC_NAME(&final_tree->pool, total - 1);
+        batch.first_node = POOL_TAKE_NODES(&final_tree->pool, satellit_count);
+        batch.slab = final_tree->pool.slabs;
+        input->pos = batch.part_start[n_parts];
+        if (batch.names != NULL && batch.first_node >= 0)
+        {
+            BUILD_RUN_PHASE(&batch, build_store);
+            STATS_PHASE_END(stats_read, started);
+            started = STATS_NOW();
+            memcpy(by_name, batch.leaves, sizeof(node*) * satellit_count);
+            ASSIGN_NAME_RANKS(BUILD_SORT_LEAVES(&batch, by_name, scratch, LEAF_NAME_CMP),
+                              satellit_count);
+            node** sorted = BUILD_SORT_LEAVES(&batch, batch.leaves, scratch,
+                                              LEAF_ORDER_CMP);
+            CONSTRUCT_TREE_SORTED(min_heap, final_tree, sorted, satellit_count);
+            STATS_PHASE_END(stats_build, started);
+            INDEX_SATELLITE_TREE(final_tree);
+        } else {
+            parsed = -1;
+        }
+    }
+    free(batch.threads);
+    free(batch.part_first);
+    free(batch.part_start);
+    free(batch.part_bytes);
+    free(batch.freq);
+    free(batch.name);
+    free(batch.name_len);
+    free(batch.leaves);
+    free(by_name);
+    free(scratch);
+    return parsed;
+}
+
+int PROCEED_TASK_1(Tree* final_tree, Heap* min_heap, Scanner* input, int n_threads)
+{
+    // Main function to perform task 1 and build the final tree for all other tasks
+    // With n_threads > 1, large inputs are read and sorted in parallel
+    // Returns 1 if the tree was built, 0 on error
+    double started = STATS_NOW();
+    int satellit_count = SCAN_COUNT(input); // Get number of satellites
+
+    // Reserve all nodes of the final tree and read n satellites from input
+    // (names are copied straight into the tree's name arena)
+    INIT_NODE_POOL(&final_tree->pool, 2 * satellit_count - 1);
+    int parsed = BUILD_SATELLITE_TREE_PARALLEL(final_tree, min_heap, input, satellit_count,
+                                               n_threads);
+    if (parsed != 0)
+    {
+        return parsed > 0 && final_tree->flat.n > 0;
+    }
+    // Array to store all satellites' frequencies
+    int* satellites_freq = (int*)malloc(sizeof(int) * satellit_count);
+    if (satellites_freq == NULL)
+    {
+        perror("Error on malloc satellites_freq");
+        return 0;
+    }
+    // Array to store all satellites' names
+    char** satellites_name = (char**)malloc(sizeof(char*) * satellit_count);
+    if (satellites_name == NULL)
+    {
+        perror("Error on malloc satellites_name vector");
+        free(satellites_freq);
+        return 0;
+    }
+    for (int i = 0; i < satellit_count; i++){
+        const char* name;
+        satellites_freq[i] = 0;
+        SCAN_INT(input, &satellites_freq[i]);
+        size_t len = SCAN_TOKEN(input, &name);
+        satellites_name[i] = POOL_STORE_NAME(&final_tree->pool, name, len);
+        if (satellites_name[i] == NULL)
+        {
+            free(satellites_freq);
+            free(satellites_name);
+            return 0;
+        }
+    }
+    STATS_PHASE_END(stats_read, started);
+    BUILD_SATELLITE_TREE(final_tree, min_heap, satellites_freq, satellites_name,
+                         satellit_count);
+    free(satellites_freq);
+    free(satellites_name);
+    // Every step of the build reports its own errors; a tree without its
+    // flat layout is one that could not be finished. No satellites give
+    // the empty tree
+    return satellit_count == 0 || final_tree->flat.n > 0;
+}
+#define DECODE_DEFAULT_BITS 8
+#define DECODE_MAX_BITS 16
+
+DecodeTable* BUILD_DECODE_TABLE(Decoder* decoder, int start)
+{
+    // Function to build the lookup table of an internal node
+    // Every subtree reachable in at most n_bits steps is walked once: a leaf
+    // found after j bits fills all entries whose low j bits are its path
+    FlatTree* flat = decoder->flat;
+    int n_bits = GET_MIN_INT(decoder->max_bits, flat->height[start] - 1);
+    size_t n_entries = (size_t)1 << n_bits;
+    DecodeTable* table = (DecodeTable*)malloc(sizeof(DecodeTable) +
+                                              sizeof(DecodeEntry) * n_entries);
+    if (table == NULL)
+    {
+        perror("Error on malloc decode table");
+        return NULL;
+    }
+    table->owner = start;
+    table->n_bits = n_bits;
+    // Explicit stack of (node, depth, path) for the walk
+    int stack_node[2 * DECODE_MAX_BITS + 2];
+    int stack_depth[2 * DECODE_MAX_BITS + 2];
+    size_t stack_path[2 * DECODE_MAX_BITS + 2];
+    int top = 0;
+    stack_node[top] = start;
+    stack_depth[top] = 0;
+    stack_path[top++] = 0;
+    while (top > 0)
+    {
+        top--;
+        int current = stack_node[top];
+        int depth = stack_depth[top];
+        size_t path = stack_path[top];
+        int is_leaf = flat->left[current] == -1;
+        if (depth > 0 && (is_leaf || depth == n_bits))
+        {
+            for (size_t i = path; i < n_entries; i += (size_t)1 << depth)
+            {
+                table->entries[i].target = current;
+                table->entries[i].n_bits = depth;
+            }
+            continue;
+        }
+        stack_node[top] = flat->left[current];
+        stack_depth[top] = depth + 1;
+        stack_path[top++] = path;
+        stack_node[top] = flat->right[current];
+        stack_depth[top] = depth + 1;
+        stack_path[top++] = path | ((size_t)1 << depth);
+    }
+    table->next = decoder->tables;
+    decoder->tables = table;
+    // Published last: another thread may read it without the lock
+    __atomic_store_n(&flat->decode_tables[start], table, __ATOMIC_RELEASE);
+    return table;
+}
+
+DecodeTable* GET_DECODE_TABLE(Decoder* decoder, int start)
+{
+    // Function to build the table of a node once, even with several threads
+    if (decoder->lock == NULL)
+    {
+        DecodeTable* table = BUILD_DECODE_TABLE(decoder, start);
+        decoder->failed |= table == NULL;
+        return table;
+    }
+    pthread_mutex_lock(decoder->lock);
+    DecodeTable* table = decoder->flat->decode_tables[start];
+    if (table == NULL)
+    {
+        table = BUILD_DECODE_TABLE(decoder, start);
+        decoder->failed |= table == NULL;
+    }
+    pthread_mutex_unlock(decoder->lock);
+    return table;
+}
+
+void FREE_DECODER(Decoder* decoder)
+{
+    // Helper function to free all tables of a decoder
+    while (decoder->tables != NULL)
+    {
+        DecodeTable* next = decoder->tables->next;
+        decoder->flat->decode_tables[decoder->tables->owner] = NULL;
+        free(decoder->tables);
+        decoder->tables = next;
+    }
+}
+
+int BIT_BUFFER_RESERVE(BitBuffer* bits, size_t n_bits)
+{
+    // Function to make room for n_bits more bits (plus one spare word,
+    // so a lookup can always read the word after the last bit)
+    size_t needed = (bits->n_bits + n_bits) / 64 + 2;
+    if (needed <= bits->capacity) return 1;
+    size_t capacity = bits->capacity == 0 ? 16 : bits->capacity;
+    while (capacity < needed)
+    {
+        capacity *= 2;
+    }
+    unsigned long long* words = (unsigned long long*)realloc(bits->words,
+                                    sizeof(unsigned long long) * capacity);
+    if (words == NULL)
+    {
+        perror("Error on realloc bit buffer");
+        return 0;
+    }
+    memset(words + bits->capacity, 0,
+           sizeof(unsigned long long) * (capacity - bits->capacity));
+    bits->words = words;
+    bits->capacity = capacity;
+    return 1;
+}
+
+void BIT_BUFFER_APPEND(BitBuffer* bits, unsigned long long value, int count)
+{
+    // Function to append the low count bits of value (count <= 64)
+    // Room must already be reserved
+    size_t word = bits->n_bits / 64;
+    int shift = bits->n_bits % 64;
+    if (count < 64)
+    {
+        value &= (1ULL << count) - 1;
+    }
+    bits->words[word] |= value << shift;
+    if (shift != 0 && shift + count > 64)
+    {
+        bits->words[word + 1] |= value >> (64 - shift);
+    }
+    bits->n_bits += count;
+}
+
+int PACK_ASCII_BITS(BitBuffer* bits, const char* code, size_t len)
+{
+    // Function to convert a '0'/'1' string into packed bits
+    // Other characters are skipped, like the per-character walk did
+    // With SSE2, 16 characters are checked and converted at once
+    // Returns 0 if the buffer could not grow
+    bits->n_bits = 0;
+    if (!BIT_BUFFER_RESERVE(bits, len)) return 0;
+    memset(bits->words, 0, sizeof(unsigned long long) * (len / 64 + 2));
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zeros = _mm_set1_epi8('0');
+    const __m128i ones = _mm_set1_epi8('1');
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(code + i));
+        int is_one = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, ones));
+        int is_zero = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zeros));
+        if ((is_one | is_zero) != 0xFFFF)
+        {
+            break; // Not a clean chunk, finish with the scalar loop
+        }
+        BIT_BUFFER_APPEND(bits, (unsigned long long)is_one, 16);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (code[i] == '0' || code[i] == '1')
+        {
+            BIT_BUFFER_APPEND(bits, code[i] == '1', 1);
+        }
+    }
+    return 1;
+}
+
+unsigned long long PEEK_BITS(BitBuffer* bits, size_t pos)
+{
+    // Function to read the 64 bits starting at pos (zeros past the end)
+    size_t word = pos / 64;
+    int shift = pos % 64;
+    unsigned long long value = bits->words[word] >> shift;
+    if (shift != 0)
+    {
+        value |= bits->words[word + 1] << (64 - shift);
+    }
+    return value;
+}
+
+size_t DECODE_BITS(Decoder* decoder, BitBuffer* bits, int* state, FILE* out_file)
+{
+    // Function to decode packed bits, one table lookup (up to k bits) per step
+    // Like the per-bit walk, it restarts from the root after every leaf
+    // Decoding starts from *state and stops before a code that is cut by
+    // the end of the buffer; the node reached and the number of bits used
+    // are returned, so a stream can continue in the next buffer
+    FlatTree* flat = decoder->flat;
+    int current = *state;
+    size_t pos = 0;
+    while (pos < bits->n_bits)
+    {
+        DecodeTable* table = __atomic_load_n(&flat->decode_tables[current],
+                                             __ATOMIC_ACQUIRE);
+        if (table == NULL)
+        {
+            table = GET_DECODE_TABLE(decoder, current);
+            if (table == NULL) break;
+        }
+        unsigned long long mask = ((unsigned long long)1 << table->n_bits) - 1;
+        DecodeEntry* entry = &table->entries[PEEK_BITS(bits, pos) & mask];
+        if ((size_t)entry->n_bits > bits->n_bits - pos)
+        {
+            break; // The code is cut by the end of the input
+        }
+        pos += entry->n_bits;
+        current = entry->target;
+        if (flat->left[current] == -1)
+        {
+            fwrite(flat->names + flat->name_offset[current], 1,
+                   flat->name_len[current], out_file);
+            fputc(' ', out_file);
+            current = 0; // Back to the root
+        }
+    }
+    *state = current;
+    STATS_COUNT(nodes_visited, pos);
+    return pos;
+}
+
+int PROCEED_TASK_2(Tree* final_tree, Scanner* input, FILE* out_file,
+                   int decode_bits)
+{
+    // Main function to perform task 2
+    // (Traverse the tree by a given binary path)
+    // Each path is packed into bits first, then decoded decode_bits at a time
+    // Returns 0 if a path could not be decoded for lack of memory
+    int done = 1;
+    BitBuffer bits = {NULL, 0, 0};
+    Decoder decoder = {decode_bits, NULL, NULL, &final_tree->flat, 0};
+    int n_codif = SCAN_COUNT(input);
+    STATS_COUNT(queries, n_codif);
+    for (int i = 0; i < n_codif; i++){
+        const char* code;
+        size_t len = SCAN_TOKEN(input, &code);
+        // A tree with less than two satellites has no paths to follow
+        if (final_tree->flat.n > 1)
+        {
+            int state = 0;
+            done = PACK_ASCII_BITS(&bits, code, len) && done;
+            DECODE_BITS(&decoder, &bits, &state, out_file);
+        }
+        fprintf(out_file, "\n");
+    }
+    FREE_DECODER(&decoder);
+    free(bits.words);
+    return done && !decoder.failed;
+}
+
+int FLAT_NAME_EQUALS(FlatTree* flat, int pos, const char* name, size_t len)
+{
+    // Helper function to check if the full name of a position is the given
+    // string (len characters, not necessarily '\0' terminated)
+    if (flat->name_offset[pos] == FLAT_NO_NAME)
+    {
+        return NAME_EQUALS(flat->source[pos], name, len);
+    }
+    return flat->name_len[pos] == len &&
+           memcmp(flat->names + flat->name_offset[pos], name, len) == 0;
+}
+
+int SEARCH_NODE(FlatTree* flat, const char* name, size_t len, int right_first)
+{
+    // Helper function to search the tree in preorder for a node by name
+    // right_first picks which subtree is visited first. The walk climbs
+    // back with the parent links, so it needs no stack
+    // Returns the position of the node, -1 if no node has the name
+    if (flat->n == 0) return -1;
+    int current = 0;
+    while (1)
+    {
+        STATS_COUNT(nodes_visited, 1);
+        if (FLAT_NAME_EQUALS(flat, current, name, len))
+        {
+            return current;
+        }
+        if (flat->left[current] != -1)
+        {
+            current = right_first ? flat->right[current] : flat->left[current];
+            continue;
+        }
+        // Climb to the first ancestor whose other subtree is not visited yet
+        while (1)
+        {
+            int parent = flat->parent[current];
+            if (parent == -1) return -1;
+            int second = right_first ? flat->left[parent] : flat->right[parent];
+            if (second != current)
+            {
+                current = second;
+                break;
+            }
+            current = parent;
+        }
+    }
+}
+
+int FLAT_INDEX_LOOKUP(FlatTree* flat, const char* name, size_t len)
+{
+    // Function to find a position by its full name in the name index of a
+    // mapped snapshot (the same hash and probes as INDEX_LOOKUP)
+    unsigned long long hash = NAME_HASH_STRING(name, len, NULL);
+    size_t slot = NAME_INDEX_SLOT(hash, flat->index_mask);
+    while (flat->index_slots[slot] != 0)
+    {
+        int candidate = flat->index_slots[slot] - 1;
+        if (FLAT_NAME_EQUALS(flat, candidate, name, len))
+        {
+            return candidate;
+        }
+        slot = (slot + 1) & flat->index_mask;
+    }
+    return -1;
+}
+
+int INDEXED_POSITION(Tree* final_tree, const char* name, size_t len, int* shared)
+{
+    // Helper function to look a name up in the index of the tree (its
+    // NameIndex, or the mapped index of a snapshot). shared is set when
+    // other nodes have the same name (read from the node itself when there
+    // is one: the updates mark names shared without patching the layout)
+    // Returns the position, -1 if the name is not there, -2 without index
+    // The leaf of a lone satellite has no code, so the queries see the
+    // empty tree there
+    if (final_tree->flat.n < 2) return -1;
+    if (final_tree->index.slots != NULL)
+    {
+        node* found = INDEX_LOOKUP(&final_tree->index, name, len);
+        if (found == NULL) return -1;
+        *shared = found->data->name_shared;
+        return found->data->flat_id;
+    }
+    if (final_tree->flat.index_slots != NULL)
+    {
+        int found = FLAT_INDEX_LOOKUP(&final_tree->flat, name, len);
+        *shared = found >= 0 && final_tree->flat.name_shared[found];
+        return found;
+    }
+    return -2;
+}
+
+int FIND_ENCODE_NODE(Tree* final_tree, const char* name, size_t len)
+{
+    // Function to find the node to encode for a name (a FlatTree position)
+    // Unique names come from the index; names shared by several nodes
+    // (or a missing index) need the search in preorder, right subtree
+    // first, which is the order the original path search used
+    int shared = 0;
+    int found = INDEXED_POSITION(final_tree, name, len, &shared);
+    if (found == -1 || (found >= 0 && !shared))
+    {
+        return found;
+    }
+    return SEARCH_NODE(&final_tree->flat, name, len, 1);
+}
+
+int OUTPUT_NODE_CODE(OutputBuffer* output, Tree* final_tree, int id,
+                     char** path, int* path_cap)
+{
+    // Function to append the binary path of a node to the output
+    // Leaf codes are expanded from the code table straight into the buffer;
+    // other nodes go through WRITE_NODE_CODE (path is only as long as the
+    // tree is deep). Returns 0 if the path buffer could not grow
+    FlatTree* flat = &final_tree->flat;
+    CodeTable* codes = &final_tree->codes;
+    if (codes->bits == NULL || flat->left[id] != -1)
+    {
+        int len = WRITE_NODE_CODE(final_tree, id, path, path_cap);
+        if (len != flat->depth[id]) return 0;
+        OUTPUT_WRITE(output, *path, len);
+        return 1;
+    }
+    size_t bit = flat->code_offset[id];
+    size_t end = bit + flat->depth[id];
+    STATS_COUNT(nodes_visited, flat->depth[id]);
+    while (bit < end)
+    {
+        if (output->used == OUTPUT_BUFFER_SIZE)
+        {
+            OUTPUT_FLUSH(output);
+        }
+        size_t room = OUTPUT_BUFFER_SIZE - output->used;
+        size_t count = end - bit < room ? end - bit : room;
+        char* dest = output->data + output->used;
+        for (size_t i = 0; i < count; i++, bit++)
+        {
+            dest[i] = (char)('0' + ((codes->bits[bit / 64] >> (bit % 64)) & 1));
+        }
+        output->used += count;
+    }
+    return 1;
+}
+
+int PROCEED_TASK_3(Tree* final_tree, Scanner* input, FILE* out_file)
+{
+    // Main function to perform task 3
+    // Reads n satellites and writes the binary path of each of them
+    // The codes go through a fixed OutputBuffer that is flushed whenever
+    // it fills up, so memory does not grow with the size of the output
+    // (-c3p writes the same codes as packed bits)
+    // Returns 0 on error
+    OutputBuffer output;
+    if (!OUTPUT_OPEN(&output, out_file))
+    {
+        return 0;
+    }
+    int path_cap = 256;
+    char* path = (char*)malloc(sizeof(char) * path_cap); // Internal nodes only
+    if (path == NULL)
+    {
+        perror("Error on malloc path");
+        OUTPUT_CLOSE(&output);
+        return 0;
+    }
+    int done = 1;
+    int n_satellites = SCAN_COUNT(input);
+    STATS_COUNT(queries, n_satellites);
+    for (int i = 0; i < n_satellites; i++)
+    {
+        const char* name;
+        size_t len = SCAN_TOKEN(input, &name);
+        int found = FIND_ENCODE_NODE(final_tree, name, len);
+        if (found != -1)
+        {
+            done = OUTPUT_NODE_CODE(&output, final_tree, found, &path, &path_cap) && done;
+        }
+    }
+    OUTPUT_CLOSE(&output);
+    free(path);
+    return done;
+}
+int FIND_NODE(Tree* final_tree, const char* name, size_t len)
+{
+    // Function to find a node by name (a FlatTree position, -1 if none),
+    // through the index when it exists, in preorder otherwise
+    int shared;
+    int found = INDEXED_POSITION(final_tree, name, len, &shared);
+    return found != -2 ? found : SEARCH_NODE(&final_tree->flat, name, len, 0);
+}
+
+int LCA_MIN_POS(LcaIndex* lca, int pos_a, int pos_b)
+{
+    // Helper function: the one of two tour positions with the lower depth
+    return lca->depth[pos_b] < lca->depth[pos_a] ? pos_b : pos_a;
+}
+
+void FREE_LCA_INDEX(LcaIndex* lca)
+{
+    // Helper function to free the LCA index
+    free(lca->euler);
+    free(lca->depth);
+    free(lca->first);
+    free(lca->prefix_min);
+    free(lca->suffix_min);
+    free(lca->sparse);
+    memset(lca, 0, sizeof(LcaIndex));
+}
+
+int LCA_ALLOC(LcaIndex* lca, int n_nodes)
+{
+    // Helper function to allocate the index of a tree with n_nodes nodes
+    // (its Euler tour has 2 * n_nodes - 1 positions)
+    int n = 2 * n_nodes - 1;
+    lca->n_blocks = (n + LCA_BLOCK - 1) / LCA_BLOCK;
+    lca->n_levels = 1;
+    while ((1 << lca->n_levels) <= lca->n_blocks)
+    {
+        lca->n_levels++;
+    }
+    lca->euler = (int*)malloc(sizeof(int) * n);
+    lca->depth = (int*)malloc(sizeof(int) * n);
+    lca->first = (int*)malloc(sizeof(int) * n_nodes);
+    lca->prefix_min = (int*)malloc(sizeof(int) * n);
+    lca->suffix_min = (int*)malloc(sizeof(int) * n);
+    lca->sparse = (int*)malloc(sizeof(int) * lca->n_levels * lca->n_blocks);
+    if (lca->euler == NULL || lca->depth == NULL || lca->first == NULL ||
+        lca->prefix_min == NULL ||
+        lca->suffix_min == NULL || lca->sparse == NULL)
+    {
+        perror("Error on malloc LCA index");
+        FREE_LCA_INDEX(lca);
+        return 0;
+    }
+    return 1;
+}
+
+void LCA_BUILD_BLOCKS(LcaIndex* lca)
+{
+    // Helper function to build the per-block prefix/suffix minima and the
+    // sparse table over blocks, once the tour and its depths are written
+    int pos = lca->n_euler;
+    for (int b = 0; b < lca->n_blocks; b++)
+    {
+        int start = b * LCA_BLOCK;
+        int end = GET_MIN_INT(start + LCA_BLOCK, pos) - 1;
+        lca->prefix_min[start] = start;
+        for (int i = start + 1; i <= end; i++)
+        {
+            lca->prefix_min[i] = LCA_MIN_POS(lca, lca->prefix_min[i - 1], i);
+        }
+        lca->suffix_min[end] = end;
+        for (int i = end - 1; i >= start; i--)
+        {
+            lca->suffix_min[i] = LCA_MIN_POS(lca, i, lca->suffix_min[i + 1]);
+        }
+        lca->sparse[b] = lca->prefix_min[end];
+    }
+    for (int level = 1; level < lca->n_levels; level++)
+    {
+        int* row = lca->sparse + level * lca->n_blocks;
+        int* prev_row = row - lca->n_blocks;
+        int half = 1 << (level - 1);
+        for (int b = 0; b + (1 << level) <= lca->n_blocks; b++)
+        {
+            row[b] = LCA_MIN_POS(lca, prev_row[b], prev_row[b + half]);
+        }
+    }
+}
+
+int BUILD_LCA_INDEX(Tree* final_tree)
+{
+    // Function to preprocess the tree for O(1) LCA queries
+    // Builds the Euler tour of the flat layout (walking with the parent
+    // links, no recursion), the per-block prefix/suffix minima and the
+    // sparse table over blocks
+    LcaIndex* lca = &final_tree->lca;
+    FlatTree* flat = &final_tree->flat;
+    if (flat->n == 0 || !LCA_ALLOC(lca, flat->n)) return 0;
+    // Euler tour: a node is written every time the walk arrives at it
+    int current = 0;
+    int previous = -1;
+    int pos = 0;
+    while (current != -1)
+    {
+        lca->euler[pos] = current;
+        lca->depth[pos] = flat->depth[current];
+        int next;
+        if (previous == flat->parent[current])
+        {
+            lca->first[current] = pos;
+            next = flat->left[current] != -1 ? flat->left[current] : flat->parent[current];
+        } else if (previous == flat->left[current]) {
+            next = flat->right[current];
+        } else {
+            next = flat->parent[current];
+        }
+        pos++;
+        previous = current;
+        current = next;
+    }
+    lca->n_euler = pos;
+    LCA_BUILD_BLOCKS(lca);
+    return 1;
+}
+
+int LCA_QUERY(LcaIndex* lca, int el_a, int el_b)
+{
+    // Function to find the lowest common ancestor of two FlatTree
+    // positions in O(1)
+    int left = lca->first[el_a];
+    int right = lca->first[el_b];
+    if (left > right)
+    {
+        int temp = left;
+        left = right;
+        right = temp;
+    }
+    int block_l = left / LCA_BLOCK;
+    int block_r = right / LCA_BLOCK;
+    int best;
+    if (block_l == block_r)
+    {
+        // Both in the same block: scan it (at most LCA_BLOCK positions)
+        best = left;
+        for (int i = left + 1; i <= right; i++)
+        {
+            best = LCA_MIN_POS(lca, best, i);
+        }
+    } else {
+        best = LCA_MIN_POS(lca, lca->suffix_min[left], lca->prefix_min[right]);
+        if (block_r - block_l > 1)
+        {
+            int from = block_l + 1;
+            int count = block_r - from;
+            int level = 0;
+            while ((2 << level) <= count)
+            {
+                level++;
+            }
+            int* row = lca->sparse + level * lca->n_blocks;
+            best = LCA_MIN_POS(lca, best, row[from]);
+            best = LCA_MIN_POS(lca, best, row[block_r - (1 << level)]);
+        }
+    }
+    return lca->euler[best];
+}
+
+int NODE_DEPTH(node* src)
+{
+    // Helper function to count the edges between a node and the root
+    int depth = 0;
+    for (node* it = src->parent; it != NULL; it = it->parent)
+    {
+        depth++;
+    }
+    return depth;
+}
+
+node* LOWEST_COMMON_NODE(node* left, node* right)
+{
+    // Helper function for Lowest Common Ancestor
+    // Lifts the deeper node to the depth of the other one, then lifts
+    // both until they meet; only the parent links are used
+    int left_depth = NODE_DEPTH(left);
+    int right_depth = NODE_DEPTH(right);
+    STATS_COUNT(nodes_visited, left_depth + right_depth);
+    for (; left_depth > right_depth; left_depth--)
+    {
+        left = left->parent;
+    }
+    for (; right_depth > left_depth; right_depth--)
+    {
+        right = right->parent;
+    }
+    while (left != right)
+    {
+        left = left->parent;
+        right = right->parent;
+    }
+    return left;
+}
+
+int LOWEST_COMMON_POSITION(FlatTree* flat, int left, int right)
+{
+    // Helper function like LOWEST_COMMON_NODE, on FlatTree positions
+    // (their depths are stored, so the lifting starts at once)
+    STATS_COUNT(nodes_visited, flat->depth[left] + flat->depth[right]);
+    while (flat->depth[left] > flat->depth[right])
+    {
+        left = flat->parent[left];
+    }
+    while (flat->depth[right] > flat->depth[left])
+    {
+        right = flat->parent[right];
+    }
+    while (left != right)
+    {
+        left = flat->parent[left];
+        right = flat->parent[right];
+    }
+    return left;
+}
+
+int LCA_OF_NODES(Tree* final_tree, int el_a, int el_b)
+{
+    // Function to find the lowest common ancestor of two FlatTree
+    // positions, through the Euler tour index when it is built, by walking
+    // the parent links otherwise
+    if (final_tree->lca.euler == NULL)
+    {
+        return LOWEST_COMMON_POSITION(&final_tree->flat, el_a, el_b);
+    }
+    STATS_COUNT(nodes_visited, 1);
+    return LCA_QUERY(&final_tree->lca, el_a, el_b);
+}
+
+int FIND_LCA(Tree* final_tree, int el_a, int el_b)
+{
+    // Function like LCA_OF_NODES for the serial tasks, which build the
+    // Euler tour index on demand: only once the walks up the parent links
+    // have taken as many steps as the tree has nodes. A few queries after
+    // a batch of updates then cost their depth, not a new index
+    LcaIndex* lca = &final_tree->lca;
+    if (lca->euler == NULL)
+    {
+        FlatTree* flat = &final_tree->flat;
+        if (lca->climbed > flat->n)
+        {
+            lca->climbed = 0; // If it cannot be built, walk as long again
+            BUILD_LCA_INDEX(final_tree);
+        }
+        lca->climbed += flat->depth[el_a] + flat->depth[el_b];
+    }
+    return LCA_OF_NODES(final_tree, el_a, el_b);
+}
+
+int PROCEED_TASK_4(Tree* final_tree, Scanner* input, FILE* out_file)
+{
+    // Main function for solving task 4
+    // (Finding the lowest common ancestor of all given nodes)
+    // Returns 0 on error
+    int n_satellites = SCAN_COUNT(input); // Read number of given nodes
+    STATS_COUNT(queries, n_satellites);
+    // Array of the given nodes (FlatTree positions, -1 if not in the tree)
+    int* node_arr = malloc(sizeof(int) * n_satellites);
     if (node_arr == NULL)
     {
-        perror("Error on malloc node_arr");
-        return;
+        perror("Error on malloc node_arr");
+        return 0;
+    }
+    for (int i = 0; i < n_satellites; i++)
+    {
+        const char* name;
+        size_t len = SCAN_TOKEN(input, &name); // Read node name
+        node_arr[i] = FIND_NODE(final_tree, name, len); // Search for it in the tree and store its position
+    }
+    // Lowest Common Ancestor algorithm
+    // Once FIND_LCA has built the Euler tour index, each pair is O(1)
+    int top_node = -1;
+    for (int i = 0; i < n_satellites; i++)
+    {
+        // For n nodes, fold the set pairwise: the ancestor of the first i
+        // nodes and the i-th node give the ancestor of the first i + 1
+        // (names that are not in the tree are skipped)
+        if (node_arr[i] == -1) continue;
+        if (top_node == -1)
+        {
+            top_node = node_arr[i]; // Set the first node as the initial ancestor
+        } else {
+            top_node = FIND_LCA(final_tree, top_node, node_arr[i]);
+        }
+    }
+    if (top_node != -1)
+    {
+        PRINT_NODE_NAME(&final_tree->flat, top_node, out_file); // Print the result
+    }
+    free(node_arr);
+    return 1;
+}
+
+void FREE_GRAFT_FOREST(GraftForest* forest)
+{
+    // Helper function to free the grafted nodes and their indexes
+    free(forest->nodes);
+    free(forest->slots);
+    FREE_LCA_INDEX(&forest->lca);
+    memset(forest, 0, sizeof(GraftForest));
+    forest->first_root = -1;
+}
+
+int GRAFT_LOOKUP(GraftForest* forest, const char* name, size_t len)
+{
+    // Function to find the last grafted node with a given name (-1 if none)
+    if (forest->slots == NULL) return -1;
+    unsigned long long hash = NAME_HASH_STRING(name, len, NULL);
+    size_t slot = NAME_INDEX_SLOT(hash, forest->mask);
+    while (forest->slots[slot] != 0)
+    {
+        GraftNode* candidate = &forest->nodes[forest->slots[slot] - 1];
+        if (candidate->name_hash == hash && candidate->name_len == len &&
+            memcmp(candidate->name, name, len) == 0)
+        {
+            return forest->slots[slot] - 1;
+        }
+        slot = (slot + 1) & forest->mask;
+    }
+    return -1;
+}
+
+void GRAFT_INDEX_INSERT(GraftForest* forest, int id)
+{
+    // Helper function to index a grafted node by name; a later node with
+    // the same name takes the place of the earlier one
+    GraftNode* src = &forest->nodes[id];
+    size_t slot = NAME_INDEX_SLOT(src->name_hash, forest->mask);
+    while (forest->slots[slot] != 0)
+    {
+        GraftNode* other = &forest->nodes[forest->slots[slot] - 1];
+        if (other->name_hash == src->name_hash && other->name_len == src->name_len &&
+            memcmp(other->name, src->name, src->name_len) == 0)
+        {
+            break;
+        }
+        slot = (slot + 1) & forest->mask;
+    }
+    forest->slots[slot] = id + 1;
+}
+
+int GRAFT_RESERVE(GraftForest* forest)
+{
+    // Helper function to make room for one more grafted node, keeping the
+    // name index at most half full
+    if (forest->n == forest->capacity)
+    {
+        int capacity = forest->capacity > 0 ? forest->capacity * 2 : 64;
+        GraftNode* nodes = (GraftNode*)realloc(forest->nodes, sizeof(GraftNode) * capacity);
+        if (nodes == NULL)
+        {
+            perror("Error on realloc grafted nodes");
+            return 0;
+        }
+        forest->nodes = nodes;
+        forest->capacity = capacity;
+    }
+    if (forest->slots == NULL || (size_t)(forest->n + 1) * 2 > forest->mask + 1)
+    {
+        size_t n_slots = forest->slots == NULL ? 128 : (forest->mask + 1) * 2;
+        int* slots = (int*)calloc(n_slots, sizeof(int));
+        if (slots == NULL)
+        {
+            perror("Error on calloc graft index");
+            return 0;
+        }
+        free(forest->slots);
+        forest->slots = slots;
+        forest->mask = n_slots - 1;
+        for (int i = 0; i < forest->n; i++)
+        {
+            GRAFT_INDEX_INSERT(forest, i);
+        }
+    }
+    return 1;
+}
+
+int GRAFT_ADD(GraftForest* forest, const char* name, size_t len, int parent,
+              int anchor, int anchor_depth)
+{
+    // Function to add a grafted node under another grafted node (parent),
+    // or, for parent -1, as the root of a graft under a node of the tree
+    // Returns the id of the new node, -1 on error
+    if (!GRAFT_RESERVE(forest)) return -1;
+    int id = forest->n++;
+    GraftNode* new_node = &forest->nodes[id];
+    new_node->name = name;
+    new_node->name_len = len;
+    new_node->name_hash = NAME_HASH_STRING(name, len, NULL);
+    new_node->parent = parent;
+    new_node->first_child = -1;
+    if (parent == -1)
+    {
+        new_node->anchor = anchor;
+        new_node->depth = anchor_depth + 1;
+        new_node->next_sibling = forest->first_root;
+        forest->first_root = id;
+    } else {
+        GraftNode* up = &forest->nodes[parent];
+        new_node->anchor = up->anchor;
+        new_node->depth = up->depth + 1;
+        new_node->next_sibling = up->first_child;
+        up->first_child = id;
+    }
+    GRAFT_INDEX_INSERT(forest, id);
+    return id;
+}
+
+int GRAFT_UP(GraftForest* forest, int id)
+{
+    // Helper function: parent of a node of the forest, where the roots of
+    // the grafts hang under a virtual root (id n) that joins them in one tree
+    if (id == forest->n) return -1;
+    return forest->nodes[id].parent == -1 ? forest->n : forest->nodes[id].parent;
+}
+
+int BUILD_GRAFT_LCA(GraftForest* forest)
+{
+    // Function to build the Euler tour index of the forest, like
+    // BUILD_LCA_INDEX does for the tree (the virtual root has depth 0)
+    LcaIndex* lca = &forest->lca;
+    if (forest->n == 0 || !LCA_ALLOC(lca, forest->n + 1)) return 0;
+    int current = forest->n;
+    int child = -1; // Child the walk came back from (-1: came from above)
+    int pos = 0;
+    while (current != -1)
+    {
+        lca->euler[pos] = current;
+        lca->depth[pos] = current == forest->n ? 0 : forest->nodes[current].depth;
+        int next;
+        if (child == -1)
+        {
+            lca->first[current] = pos;
+            next = current == forest->n ? forest->first_root :
+                                          forest->nodes[current].first_child;
+        } else {
+            next = forest->nodes[child].next_sibling;
+        }
+        pos++;
+        if (next != -1)
+        {
+            child = -1;
+            current = next;
+        } else {
+            child = current;
+            current = GRAFT_UP(forest, current);
+        }
+    }
+    lca->n_euler = pos;
+    LCA_BUILD_BLOCKS(lca);
+    return 1;
+}
+
+int GRAFT_LCA(GraftForest* forest, int el_a, int el_b)
+{
+    // Function to find the lowest common ancestor of two grafted nodes in
+    // the forest (n when they only meet in the tree), in O(1) through the
+    // index, by lifting along the parents otherwise
+    if (forest->lca.euler != NULL)
+    {
+        return LCA_QUERY(&forest->lca, el_a, el_b);
+    }
+    while (el_a != el_b)
+    {
+        int depth_a = el_a == forest->n ? 0 : forest->nodes[el_a].depth;
+        int depth_b = el_b == forest->n ? 0 : forest->nodes[el_b].depth;
+        if (depth_a >= depth_b)
+        {
+            el_a = GRAFT_UP(forest, el_a);
+        } else {
+            el_b = GRAFT_UP(forest, el_b);
+        }
+    }
+    return el_a;
+}
+
+int GRAFT_DISTANCE(Tree* final_tree, GraftForest* forest, int tree_a, int graft_a,
+                   int tree_b, int graft_b)
+{
+    // Function to find the number of edges between two nodes, each one
+    // either a node of the tree (graft -1) or a grafted node
+    //   distance = depth[a] + depth[b] - 2 * depth[lca(a, b)]
+    // Grafted nodes that meet inside the forest have their LCA there;
+    // otherwise it is the LCA of the tree nodes their grafts hang under
+    FlatTree* flat = &final_tree->flat;
+    int depth_a, depth_b;
+    if (graft_a != -1)
+    {
+        tree_a = forest->nodes[graft_a].anchor;
+        depth_a = forest->nodes[graft_a].depth;
+    } else {
+        depth_a = flat->depth[tree_a];
+    }
+    if (graft_b != -1)
+    {
+        tree_b = forest->nodes[graft_b].anchor;
+        depth_b = forest->nodes[graft_b].depth;
+    } else {
+        depth_b = flat->depth[tree_b];
+    }
+    if (graft_a != -1 && graft_b != -1)
+    {
+        int common = GRAFT_LCA(forest, graft_a, graft_b);
+        STATS_COUNT(nodes_visited, 1);
+        if (common != forest->n)
+        {
+            return depth_a + depth_b - 2 * forest->nodes[common].depth;
+        }
+    }
+    int common = FIND_LCA(final_tree, tree_a, tree_b);
+    return depth_a + depth_b - 2 * flat->depth[common];
+}
+
+int FIND_ANY_NODE(Tree* final_tree, GraftForest* forest, const char* name, size_t len,
+                  int* tree_node, int* graft)
+{
+    // Helper function to find a name in the tree first, then among the
+    // grafted nodes. Returns 0 if it is in neither
+    *tree_node = FIND_NODE(final_tree, name, len);
+    *graft = *tree_node != -1 ? -1 : GRAFT_LOOKUP(forest, name, len);
+    return *tree_node != -1 || *graft != -1;
+}
+
+int PROCEED_TASK_5(Tree* final_tree, Scanner* input, FILE* out_file)
+{
+    // Main function for solving task 5
+    // (Grafting sub-constellations under nodes, then distances between nodes)
+    // Every graft is a target name, the root of the graft ("FREQ NAME") and
+    // a number of blocks, each one a grafted node followed by its children
+    // ("count", then "FREQ NAME" per child). Targets and the parents of the
+    // blocks can be grafted nodes too. The rest of the input is pairs of
+    // names, answered with one distance per line
+    // Returns 0 if a graft could not be stored
+    int done = 1;
+    GraftForest forest;
+    memset(&forest, 0, sizeof(GraftForest));
+    forest.first_root = -1;
+    int n_grafts = SCAN_COUNT(input);
+    for (int i = 0; i < n_grafts; i++)
+    {
+        const char* name;
+        size_t len = SCAN_TOKEN(input, &name);
+        int target;
+        int target_graft;
+        int found = FIND_ANY_NODE(final_tree, &forest, name, len, &target, &target_graft);
+        int frequency;
+        SCAN_INT(input, &frequency); // Frequencies do not change distances
+        len = SCAN_TOKEN(input, &name);
+        int root = -1;
+        if (found)
+        {
+            root = GRAFT_ADD(&forest, name, len, target_graft, target,
+                             target == -1 ? 0 : final_tree->flat.depth[target]);
+            done = root != -1 && done;
+        }
+        int n_blocks = SCAN_COUNT(input);
+        for (int b = 0; b < n_blocks; b++)
+        {
+            len = SCAN_TOKEN(input, &name);
+            int parent = root == -1 ? -1 : GRAFT_LOOKUP(&forest, name, len);
+            int n_children = SCAN_COUNT(input);
+            for (int c = 0; c < n_children; c++)
+            {
+                SCAN_INT(input, &frequency);
+                len = SCAN_TOKEN(input, &name);
+                // Children of a name that was not grafted are skipped
+                if (parent != -1)
+                {
+                    done = GRAFT_ADD(&forest, name, len, parent, -1, 0) != -1 && done;
+                }
+            }
+        }
+    }
+    // Precompute the forest part of the LCA; the tree has its own index
+    // (FIND_LCA)
+    BUILD_GRAFT_LCA(&forest);
+    const char* name_a;
+    const char* name_b;
+    size_t len_a, len_b;
+    while ((len_a = SCAN_TOKEN(input, &name_a)) > 0 &&
+           (len_b = SCAN_TOKEN(input, &name_b)) > 0)
+    {
+        int tree_a, tree_b;
+        int graft_a, graft_b;
+        // Names that are not in the tree are skipped
+        if (FIND_ANY_NODE(final_tree, &forest, name_a, len_a, &tree_a, &graft_a) &&
+            FIND_ANY_NODE(final_tree, &forest, name_b, len_b, &tree_b, &graft_b))
+        {
+            STATS_COUNT(queries, 1);
+            fprintf(out_file, "%d\n", GRAFT_DISTANCE(final_tree, &forest, tree_a, graft_a,
+                                                     tree_b, graft_b));
+        }
+    }
+    FREE_GRAFT_FOREST(&forest);
+    return done;
+}
+
+// Parallel batches (-j N)
+// The items of a -c2, -c3 or -c4 input are scanned up front, then N threads
+// take chunks of BATCH_CHUNK items from a shared counter, so chunks with
+// long lines do not hold back the others. Each chunk is answered into its
+// own buffer and the buffers are written in input order at the end, so
+// the output is the same as the one of the serial task
+#define BATCH_CHUNK 256
+#define BATCH_MAX_THREADS 256
+
+enum batch_task {
+    batch_decode, batch_encode, batch_lca
+};
+
+typedef struct QueryBatch
+{
+    Tree* final_tree;
+    int task; // batch_task
+    Decoder* decoder; // Shared by all workers (-c2)
+    const char** items; // Views into the input text
+    size_t* item_len;
+    int n_items;
+    int n_chunks;
+    int next_chunk; // Next chunk to take, updated atomically
+    char** chunk_text; // Output of every chunk (-c2, -c3)
+    size_t* chunk_size;
+    int* chunk_lca; // Common ancestor of every chunk (-c4), -1 for none
+    int failed; // Set when a chunk could not be answered in full
+} QueryBatch;
+
+void* BATCH_WORKER(void* arg)
+{
+    // Function run by every thread of a batch until no chunk is left
+    QueryBatch* batch = (QueryBatch*)arg;
+    Tree* final_tree = batch->final_tree;
+    BitBuffer bits = {NULL, 0, 0};
+    int path_cap = 256;
+    char* path = (char*)malloc(sizeof(char) * path_cap);
+    if (path == NULL)
+    {
+        perror("Error on malloc path");
+        __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    int chunk;
+    while ((chunk = __atomic_fetch_add(&batch->next_chunk, 1, __ATOMIC_RELAXED))
+           < batch->n_chunks)
+    {
+        int first = chunk * BATCH_CHUNK;
+        int last = GET_MIN_INT(first + BATCH_CHUNK, batch->n_items);
+        if (batch->task == batch_lca)
+        {
+            int top_node = -1;
+            for (int i = first; i < last; i++)
+            {
+                int current = FIND_NODE(final_tree, batch->items[i], batch->item_len[i]);
+                if (current == -1) continue;
+                top_node = top_node == -1 ? current :
+                           LCA_OF_NODES(final_tree, top_node, current);
+            }
+            batch->chunk_lca[chunk] = top_node;
+            continue;
+        }
+        FILE* out_file = open_memstream(&batch->chunk_text[chunk],
+                                        &batch->chunk_size[chunk]);
+        if (out_file == NULL)
+        {
+            perror("Error on open_memstream chunk");
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        int done = 1;
+        for (int i = first; i < last; i++)
+        {
+            const char* item = batch->items[i];
+            size_t len = batch->item_len[i];
+            if (batch->task == batch_decode)
+            {
+                // Same steps as PROCEED_TASK_2
+                if (final_tree->flat.n > 1)
+                {
+                    int state = 0;
+                    done = PACK_ASCII_BITS(&bits, item, len) && done;
+                    DECODE_BITS(batch->decoder, &bits, &state, out_file);
+                }
+                fprintf(out_file, "\n");
+            } else {
+                int found = FIND_ENCODE_NODE(final_tree, item, len);
+                if (found != -1)
+                {
+                    // Same check as OUTPUT_NODE_CODE: a short path means
+                    // the path buffer could not grow
+                    int n = WRITE_NODE_CODE(final_tree, found, &path, &path_cap);
+                    done = n == final_tree->flat.depth[found] && done;
+                    fwrite(path, 1, n, out_file);
+                }
+            }
+        }
+        if (fclose(out_file) != 0 || !done)
+        {
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(bits.words);
+    free(path);
+    return NULL;
+}
+
+int PROCEED_TASK_PARALLEL(Tree* final_tree, Scanner* input, FILE* out_file,
+                          int task, int decode_bits, int n_threads)
+{
+    // Main function for -j: answers -c2, -c3 or -c4 with n_threads threads
+    // Returns 0 if a chunk could not be answered, as the serial tasks do
+    int n_items = SCAN_COUNT(input);
+    STATS_COUNT(queries, n_items);
+    pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+    Decoder decoder = {decode_bits, NULL, &table_lock, &final_tree->flat, 0};
+    QueryBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.final_tree = final_tree;
+    batch.task = task;
+    batch.decoder = &decoder;
+    batch.n_items = n_items;
+    batch.n_chunks = (n_items + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    batch.items = (const char**)malloc(sizeof(char*) * (n_items + 1));
+    batch.item_len = (size_t*)malloc(sizeof(size_t) * (n_items + 1));
+    batch.chunk_text = (char**)calloc(batch.n_chunks + 1, sizeof(char*));
+    batch.chunk_size = (size_t*)calloc(batch.n_chunks + 1, sizeof(size_t));
+    batch.chunk_lca = (int*)malloc(sizeof(int) * (batch.n_chunks + 1));
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * n_threads);
+    if (batch.items == NULL || batch.item_len == NULL || batch.chunk_text == NULL ||
+        batch.chunk_size == NULL || batch.chunk_lca == NULL || threads == NULL)
+    {
+        perror("Error on malloc batch");
+        free(batch.items);
+        free(batch.item_len);
+        free(batch.chunk_text);
+        free(batch.chunk_size);
+        free(batch.chunk_lca);
+        free(threads);
+        return 0;
+    }
+    for (int i = 0; i < n_items; i++)
+    {
+        batch.item_len[i] = SCAN_TOKEN(input, &batch.items[i]);
+    }
+    if (task == batch_lca)
+    {
+        // Built once here, the workers only read it
+        if (final_tree->lca.euler == NULL)
+        {
+            BUILD_LCA_INDEX(final_tree);
+        }
+    }
+    // The calling thread works too; if a thread cannot be started, the
+    // ones that did (or the calling thread alone) take its chunks
+    int n_started = 0;
+    for (int i = 1; i < n_threads; i++)
+    {
+        if (pthread_create(&threads[n_started], NULL, BATCH_WORKER, &batch) != 0)
+        {
+            break;
+        }
+        n_started++;
+    }
+    BATCH_WORKER(&batch);
+    for (int i = 0; i < n_started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    // Reassemble the answers in input order
+    int top_node = -1;
+    for (int chunk = 0; chunk < batch.n_chunks; chunk++)
+    {
+        if (task != batch_lca)
+        {
+            fwrite(batch.chunk_text[chunk], 1, batch.chunk_size[chunk], out_file);
+            free(batch.chunk_text[chunk]);
+        } else if (batch.chunk_lca[chunk] != -1) {
+            int current = batch.chunk_lca[chunk];
+            top_node = top_node == -1 ? current :
+                       LCA_OF_NODES(final_tree, top_node, current);
+        }
+    }
+    if (top_node != -1)
+    {
+        PRINT_NODE_NAME(&final_tree->flat, top_node, out_file);
+    }
+    FREE_DECODER(&decoder);
+    pthread_mutex_destroy(&table_lock);
+    free(batch.items);
+    free(batch.item_len);
+    free(batch.chunk_text);
+    free(batch.chunk_size);
+    free(batch.chunk_lca);
+    free(threads);
+    return !batch.failed && !decoder.failed;
+}
+// Packed stream container: a 24-byte header followed by the code bits,
+// 8 per byte, first bit in the lowest position of the first byte
+//   bytes 0..3    magic "SATB"
+//   bytes 4..7    format version (little endian)
+//   bytes 8..15   fingerprint of the tree used to encode (little endian)
+//   bytes 16..23  number of bits in the stream (little endian)
+#define PACKED_MAGIC "SATB"
+#define PACKED_VERSION 1
+#define PACKED_HEADER_SIZE 24
+#define PACKED_CHUNK_WORDS 8192 // 64 KiB of bits per read or write
+
+void STORE_U64_LE(unsigned char* dest, unsigned long long value, int n_bytes)
+{
+    // Helper function to store the low n_bytes of a value, little endian
+    for (int i = 0; i < n_bytes; i++)
+    {
+        dest[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+unsigned long long LOAD_U64_LE(const unsigned char* src, int n_bytes)
+{
+    // Helper function to load n_bytes little endian bytes
+    unsigned long long value = 0;
+    for (int i = 0; i < n_bytes; i++)
+    {
+        value |= (unsigned long long)src[i] << (8 * i);
+    }
+    return value;
+}
+
+int WRITE_PACKED_HEADER(FILE* out_file, unsigned long long fingerprint,
+                        unsigned long long n_bits)
+{
+    // Function to write the container header at the current position
+    unsigned char header[PACKED_HEADER_SIZE];
+    memcpy(header, PACKED_MAGIC, 4);
+    STORE_U64_LE(header + 4, PACKED_VERSION, 4);
+    STORE_U64_LE(header + 8, fingerprint, 8);
+    STORE_U64_LE(header + 16, n_bits, 8);
+    return fwrite(header, 1, PACKED_HEADER_SIZE, out_file) == PACKED_HEADER_SIZE;
+}
+
+int READ_PACKED_HEADER(FILE* in_file, unsigned long long* fingerprint,
+                       unsigned long long* n_bits)
+{
+    // Function to read and check the container header
+    unsigned char header[PACKED_HEADER_SIZE];
+    if (fread(header, 1, PACKED_HEADER_SIZE, in_file) != PACKED_HEADER_SIZE ||
+        memcmp(header, PACKED_MAGIC, 4) != 0 ||
+        LOAD_U64_LE(header + 4, 4) != PACKED_VERSION)
+    {
+        return 0;
+    }
+    *fingerprint = LOAD_U64_LE(header + 8, 8);
+    *n_bits = LOAD_U64_LE(header + 16, 8);
+    return 1;
+}
+
+void FLUSH_BIT_BUFFER(BitBuffer* bits, FILE* out_file, int final)
+{
+    // Function to write all complete words of the buffer (and, if final,
+    // the bytes of the last partial word). The partial word stays in the
+    // buffer so more bits can be appended to it
+    unsigned char bytes[8];
+    size_t full_words = bits->n_bits / 64;
+    for (size_t i = 0; i < full_words; i++)
+    {
+        STORE_U64_LE(bytes, bits->words[i], 8);
+        fwrite(bytes, 1, 8, out_file);
+    }
+    int rest = bits->n_bits % 64;
+    unsigned long long last = rest != 0 ? bits->words[full_words] : 0;
+    if (final && rest != 0)
+    {
+        STORE_U64_LE(bytes, last, (rest + 7) / 8);
+        fwrite(bytes, 1, (rest + 7) / 8, out_file);
+    }
+    memset(bits->words, 0, sizeof(unsigned long long) * (full_words + 1));
+    bits->words[0] = final ? 0 : last;
+    bits->n_bits = final ? 0 : (size_t)rest;
+}
+
+int APPEND_NODE_CODE(Tree* final_tree, int id, BitBuffer* bits)
+{
+    // Function to append the code of a node (a FlatTree position) to a bit
+    // buffer. Leaf codes are copied from the code table 64 bits at a time
+    FlatTree* flat = &final_tree->flat;
+    size_t len = flat->depth[id];
+    if (!BIT_BUFFER_RESERVE(bits, len)) return 0;
+    STATS_COUNT(nodes_visited, len);
+    CodeTable* codes = &final_tree->codes;
+    if (codes->bits != NULL && flat->left[id] == -1)
+    {
+        BitBuffer table = {codes->bits, codes->n_bits, 0};
+        size_t offset = flat->code_offset[id];
+        for (size_t done = 0; done < len; done += 64)
+        {
+            int count = len - done < 64 ? (int)(len - done) : 64;
+            BIT_BUFFER_APPEND(bits, PEEK_BITS(&table, offset + done), count);
+        }
+    } else {
+        size_t bit = bits->n_bits + len;
+        for (int it = id; flat->parent[it] != -1; it = flat->parent[it])
+        {
+            bit--;
+            if (flat->right[flat->parent[it]] == it)
+            {
+                bits->words[bit / 64] |= 1ULL << (bit % 64);
+            }
+        }
+        bits->n_bits += len;
+    }
+    return 1;
+}
+
+// Sync index (-i K for -c3p, used by -c2p)
+// Every K symbols the encoder records where the next code starts, so a
+// decoder can start at any checkpoint instead of bit 0. The index follows
+// the code bits of the container, where older readers stop reading:
+//   bytes 0..3    magic "SATI"
+//   bytes 4..7    symbols between checkpoints (K, little endian)
+//   bytes 8..15   number of checkpoints (little endian)
+//   then, for every checkpoint, its bit offset and the number of symbols
+//   before it (8 bytes each, little endian). The first checkpoint is (0, 0)
+//   and the last one is the end of the stream
+#define SYNC_MAGIC "SATI"
+#define SYNC_HEADER_SIZE 16
+#define SYNC_WINDOW 256 // Segments decoded before their output is written
+
+typedef struct SyncIndex
+{
+    unsigned interval;
+    size_t n; // Number of checkpoints
+    size_t capacity;
+    unsigned long long* bit_offset;
+    unsigned long long* symbol_count;
+} SyncIndex;
+
+typedef struct SyncRange
+{
+    unsigned long long first; // First symbol to decode (-r FIRST:COUNT)
+    unsigned long long count;
+} SyncRange;
+
+typedef struct SyncBatch
+{
+    Decoder* decoder; // Shared by all workers
+    SyncIndex* index;
+    int fd; // Container, read with pread so workers share no file position
+    size_t first_segment; // Segment i is between checkpoints i and i + 1
+    int n_segments;
+    int next_segment; // Next segment to take, updated atomically
+    char** segment_text;
+    size_t* segment_size;
+    int* segment_ok;
+} SyncBatch;
+
+void FREE_SYNC_INDEX(SyncIndex* index)
+{
+    // Function to free the checkpoints of an index
+    free(index->bit_offset);
+    free(index->symbol_count);
+    memset(index, 0, sizeof(SyncIndex));
+}
+
+int SYNC_INDEX_ADD(SyncIndex* index, unsigned long long bit_offset,
+                   unsigned long long symbol_count)
+{
+    // Function to append a checkpoint, growing the arrays when needed
+    if (index->n == index->capacity)
+    {
+        size_t capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+        unsigned long long* offsets = (unsigned long long*)realloc(index->bit_offset,
+                                          sizeof(unsigned long long) * capacity);
+        if (offsets == NULL)
+        {
+            perror("Error on realloc sync index");
+            return 0;
+        }
+        index->bit_offset = offsets;
+        unsigned long long* counts = (unsigned long long*)realloc(index->symbol_count,
+                                         sizeof(unsigned long long) * capacity);
+        if (counts == NULL)
+        {
+            perror("Error on realloc sync index");
+            return 0;
+        }
+        index->symbol_count = counts;
+        index->capacity = capacity;
+    }
+    index->bit_offset[index->n] = bit_offset;
+    index->symbol_count[index->n] = symbol_count;
+    index->n++;
+    return 1;
+}
+
+int WRITE_SYNC_INDEX(FILE* out_file, SyncIndex* index)
+{
+    // Function to write the index at the current position (after the bits)
+    unsigned char bytes[SYNC_HEADER_SIZE];
+    memcpy(bytes, SYNC_MAGIC, 4);
+    STORE_U64_LE(bytes + 4, index->interval, 4);
+    STORE_U64_LE(bytes + 8, index->n, 8);
+    if (fwrite(bytes, 1, SYNC_HEADER_SIZE, out_file) != SYNC_HEADER_SIZE) return 0;
+    for (size_t i = 0; i < index->n; i++)
+    {
+        STORE_U64_LE(bytes, index->bit_offset[i], 8);
+        STORE_U64_LE(bytes + 8, index->symbol_count[i], 8);
+        if (fwrite(bytes, 1, 16, out_file) != 16) return 0;
+    }
+    return 1;
+}
+
+int READ_SYNC_INDEX(FILE* in_file, unsigned long long n_bits, SyncIndex* index)
+{
+    // Function to read the index that follows the bits of a container
+    // Returns 0 if there is none (or it is damaged); the file is then left
+    // at the first byte of the bits, for a sequential decode
+    memset(index, 0, sizeof(SyncIndex));
+    struct stat info;
+    unsigned long long start = PACKED_HEADER_SIZE + (n_bits + 7) / 8;
+    unsigned char bytes[SYNC_HEADER_SIZE];
+    if (fstat(fileno(in_file), &info) != 0 || !S_ISREG(info.st_mode) ||
+        (unsigned long long)info.st_size < start + SYNC_HEADER_SIZE ||
+        fseek(in_file, (long)start, SEEK_SET) != 0)
+    {
+        return 0;
+    }
+    int valid = fread(bytes, 1, SYNC_HEADER_SIZE, in_file) == SYNC_HEADER_SIZE &&
+                memcmp(bytes, SYNC_MAGIC, 4) == 0;
+    if (valid)
+    {
+        index->interval = (unsigned)LOAD_U64_LE(bytes + 4, 4);
+        unsigned long long n = LOAD_U64_LE(bytes + 8, 8);
+        unsigned long long room = (info.st_size - start - SYNC_HEADER_SIZE) / 16;
+        valid = index->interval > 0 && n >= 1 && n <= room;
+        for (unsigned long long i = 0; valid && i < n; i++)
+        {
+            // Checkpoints start at (0, 0), never go back and end at n_bits
+            valid = fread(bytes, 1, 16, in_file) == 16;
+            unsigned long long offset = LOAD_U64_LE(bytes, 8);
+            unsigned long long count = LOAD_U64_LE(bytes + 8, 8);
+            if (valid && i == 0)
+            {
+                valid = offset == 0 && count == 0;
+            } else if (valid) {
+                valid = offset >= index->bit_offset[i - 1] && offset <= n_bits &&
+                        count >= index->symbol_count[i - 1];
+            }
+            valid = valid && SYNC_INDEX_ADD(index, offset, count);
+        }
+        valid = valid && index->bit_offset[index->n - 1] == n_bits;
+        if (!valid)
+        {
+            printf("[ERROR] Sync index is damaged, decoding from the start\n");
+        }
+    }
+    if (!valid)
+    {
+        FREE_SYNC_INDEX(index);
+    }
+    if (fseek(in_file, PACKED_HEADER_SIZE, SEEK_SET) != 0)
+    {
+        FREE_SYNC_INDEX(index);
+        return 0;
+    }
+    return valid;
+}
+
+int SYNC_LOAD_BITS(int fd, unsigned long long start, unsigned long long end,
+                   BitBuffer* bits, unsigned char** bytes, size_t* bytes_cap)
+{
+    // Helper function to load the bits start..end-1 of a container into
+    // bits, so that bit start is its bit 0
+    size_t first_byte = (size_t)(start / 8);
+    size_t n_bytes = (size_t)((end + 7) / 8) - first_byte;
+    if (n_bytes > *bytes_cap)
+    {
+        unsigned char* grown = (unsigned char*)realloc(*bytes, n_bytes);
+        if (grown == NULL)
+        {
+            perror("Error on realloc sync segment");
+            return 0;
+        }
+        *bytes = grown;
+        *bytes_cap = n_bytes;
+    }
+    for (size_t done = 0; done < n_bytes;)
+    {
+        ssize_t got = pread(fd, *bytes + done, n_bytes - done,
+                            (off_t)(PACKED_HEADER_SIZE + first_byte + done));
+        if (got <= 0)
+        {
+            printf("[ERROR] Packed stream is truncated\n");
+            return 0;
+        }
+        done += got;
+    }
+    size_t bits_left = (size_t)(end - start);
+    bits->n_bits = 0;
+    if (!BIT_BUFFER_RESERVE(bits, bits_left)) return 0;
+    memset(bits->words, 0, sizeof(unsigned long long) * (bits_left / 64 + 2));
+    for (size_t i = 0; i < n_bytes && bits_left > 0; i += 8)
+    {
+        int n = n_bytes - i < 8 ? (int)(n_bytes - i) : 8;
+        unsigned long long value = LOAD_U64_LE(*bytes + i, n);
+        int count = n * 8;
+        if (i == 0)
+        {
+            // The checkpoint may start inside the first byte
+            value >>= start % 8;
+            count -= start % 8;
+        }
+        if ((size_t)count > bits_left) count = (int)bits_left;
+        BIT_BUFFER_APPEND(bits, value, count);
+        bits_left -= count;
+    }
+    return 1;
+}
+
+void* SYNC_WORKER(void* arg)
+{
+    // Function run by every thread until no segment of the window is left
+    // A segment is decoded on its own, from its checkpoint to the next one.
+    // It is kept only if it ends exactly there after the recorded number of
+    // symbols; otherwise its bits were corrupted, and the next segment
+    // still decodes from its own checkpoint
+    SyncBatch* batch = (SyncBatch*)arg;
+    SyncIndex* index = batch->index;
+    BitBuffer bits = {NULL, 0, 0};
+    unsigned char* bytes = NULL;
+    size_t bytes_cap = 0;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next_segment, 1, __ATOMIC_RELAXED))
+           < batch->n_segments)
+    {
+        size_t segment = batch->first_segment + i;
+        unsigned long long expected = index->symbol_count[segment + 1] -
+                                      index->symbol_count[segment];
+        batch->segment_ok[i] = 0;
+        if (!SYNC_LOAD_BITS(batch->fd, index->bit_offset[segment],
+                            index->bit_offset[segment + 1], &bits, &bytes, &bytes_cap))
+        {
+            continue;
+        }
+        FILE* out_file = open_memstream(&batch->segment_text[i],
+                                        &batch->segment_size[i]);
+        if (out_file == NULL)
+        {
+            perror("Error on open_memstream segment");
+            continue;
+        }
+        int state = 0;
+        size_t used = DECODE_BITS(batch->decoder, &bits, &state, out_file);
+        fclose(out_file);
+        // Every decoded name is followed by a space, and names have none
+        unsigned long long n_symbols = 0;
+        const char* text = batch->segment_text[i];
+        for (size_t c = 0; c < batch->segment_size[i]; c++)
+        {
+            n_symbols += text[c] == ' ';
+        }
+        batch->segment_ok[i] = used == bits.n_bits && state == 0 &&
+                               n_symbols == expected;
+    }
+    free(bits.words);
+    free(bytes);
+    return NULL;
+}
+
+void WRITE_SYMBOL_SLICE(const char* text, size_t size, unsigned long long skip,
+                        unsigned long long keep, FILE* out_file)
+{
+    // Helper function to write keep decoded names of a segment, after
+    // skipping its first skip names
+    size_t begin = 0;
+    for (; skip > 0 && begin < size; begin++)
+    {
+        skip -= text[begin] == ' ';
+    }
+    size_t end = begin;
+    for (; keep > 0 && end < size; end++)
+    {
+        keep -= text[end] == ' ';
+    }
+    fwrite(text + begin, 1, end - begin, out_file);
+}
+
+int PROCEED_TASK_2_SYNCED(Tree* final_tree, FILE* in_file, FILE* out_file,
+                          SyncIndex* index, int decode_bits, int n_threads,
+                          SyncRange* range)
+{
+    // Function to decode a container through its sync index
+    // Only the segments holding the requested symbols are read; they are
+    // decoded SYNC_WINDOW at a time by n_threads threads and written in
+    // order, so the output is the matching part of a sequential decode
+    // Returns 0 if a segment was skipped or memory ran out
+    unsigned long long total = index->symbol_count[index->n - 1];
+    unsigned long long first = 0, last = total;
+    if (range != NULL)
+    {
+        first = range->first < total ? range->first : total;
+        last = range->count < total - first ? first + range->count : total;
+    }
+    // Last segment that starts at or before the first symbol
+    size_t low = 0, high = index->n - 1;
+    while (low + 1 < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (index->symbol_count[middle] <= first)
+        {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    size_t segment = low;
+    pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+    Decoder decoder = {decode_bits, NULL, n_threads > 1 ? &table_lock : NULL,
+                       &final_tree->flat, 0};
+    SyncBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.decoder = &decoder;
+    batch.index = index;
+    batch.fd = fileno(in_file);
+    int done = 1;
+    batch.segment_text = (char**)calloc(SYNC_WINDOW, sizeof(char*));
+    batch.segment_size = (size_t*)calloc(SYNC_WINDOW, sizeof(size_t));
+    batch.segment_ok = (int*)calloc(SYNC_WINDOW, sizeof(int));
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * (n_threads + 1));
+    if (batch.segment_text == NULL || batch.segment_size == NULL ||
+        batch.segment_ok == NULL || threads == NULL)
+    {
+        perror("Error on malloc sync batch");
+        segment = index->n; // Nothing is decoded
+        done = 0;
+    }
+    while (segment + 1 < index->n && index->symbol_count[segment] < last)
+    {
+        int n_segments = 0;
+        while (n_segments < SYNC_WINDOW && segment + n_segments + 1 < index->n &&
+               index->symbol_count[segment + n_segments] < last)
+        {
+            n_segments++;
+        }
+        batch.first_segment = segment;
+        batch.n_segments = n_segments;
+        batch.next_segment = 0;
+        // The calling thread works too, as for -j on the text tasks
+        int n_started = 0;
+        for (int i = 1; i < n_threads && i < n_segments; i++)
+        {
+            if (pthread_create(&threads[n_started], NULL, SYNC_WORKER, &batch) != 0)
+            {
+                break;
+            }
+            n_started++;
+        }
+        SYNC_WORKER(&batch);
+        for (int i = 0; i < n_started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < n_segments; i++)
+        {
+            unsigned long long base = index->symbol_count[segment + i];
+            unsigned long long next = index->symbol_count[segment + i + 1];
+            if (!batch.segment_ok[i])
+            {
+                printf("[ERROR] Packed stream is corrupted between symbols %llu and %llu, skipped\n",
+                       base, next);
+                done = 0;
+            } else if (next > base) {
+                unsigned long long skip = first > base ? first - base : 0;
+                unsigned long long keep = (last < next ? last : next) - (base + skip);
+                WRITE_SYMBOL_SLICE(batch.segment_text[i], batch.segment_size[i],
+                                   skip, keep, out_file);
+            }
+            free(batch.segment_text[i]);
+            batch.segment_text[i] = NULL;
+        }
+        segment += n_segments;
+    }
+    fprintf(out_file, "\n");
+    FREE_DECODER(&decoder);
+    pthread_mutex_destroy(&table_lock);
+    free(batch.segment_text);
+    free(batch.segment_size);
+    free(batch.segment_ok);
+    free(threads);
+    return done && !decoder.failed;
+}
+
+int PROCEED_TASK_3_PACKED(Tree* final_tree, Scanner* input, FILE* out_file,
+                          unsigned sync_interval)
+{
+    // Main function for the packed variant of task 3
+    // Same input as task 3; the codes are written to a packed container,
+    // flushed every PACKED_CHUNK_WORDS words, so memory use does not
+    // depend on the number of satellites. With a sync interval, a
+    // checkpoint is recorded every sync_interval codes and the index is
+    // written after the bits
+    // Returns 0 on error
+    BitBuffer bits = {NULL, 0, 0};
+    unsigned long long total_bits = 0;
+    unsigned long long n_symbols = 0;
+    SyncIndex index;
+    memset(&index, 0, sizeof(index));
+    index.interval = sync_interval;
+    if (sync_interval > 0 && !SYNC_INDEX_ADD(&index, 0, 0)) return 0;
+    if (!BIT_BUFFER_RESERVE(&bits, PACKED_CHUNK_WORDS * 64))
+    {
+        FREE_SYNC_INDEX(&index);
+        return 0;
+    }
+    if (!WRITE_PACKED_HEADER(out_file, final_tree->fingerprint, 0))
+    {
+        perror("Error on writing packed header");
+        FREE_SYNC_INDEX(&index);
+        free(bits.words);
+        return 0;
+    }
+    int done = 1;
+    int n_satellites = SCAN_COUNT(input);
+    STATS_COUNT(queries, n_satellites);
+    for (int i = 0; i < n_satellites; i++)
+    {
+        const char* name;
+        size_t len = SCAN_TOKEN(input, &name);
+        int found = FIND_ENCODE_NODE(final_tree, name, len);
+        if (found == -1) continue;
+        size_t before = bits.n_bits;
+        if (!APPEND_NODE_CODE(final_tree, found, &bits))
+        {
+            done = 0;
+            break;
+        }
+        total_bits += bits.n_bits - before;
+        n_symbols++;
+        if (sync_interval > 0 && n_symbols % sync_interval == 0 &&
+            !SYNC_INDEX_ADD(&index, total_bits, n_symbols))
+        {
+            done = 0;
+            break;
+        }
+        if (bits.n_bits >= PACKED_CHUNK_WORDS * 64)
+        {
+            FLUSH_BIT_BUFFER(&bits, out_file, 0);
+        }
+    }
+    FLUSH_BIT_BUFFER(&bits, out_file, 1);
+    if (sync_interval > 0)
+    {
+        // The last checkpoint marks the end of the stream
+        if ((index.bit_offset[index.n - 1] != total_bits ||
+             index.symbol_count[index.n - 1] != n_symbols) &&
+            !SYNC_INDEX_ADD(&index, total_bits, n_symbols))
+        {
+            index.n = 0;
+        }
+        if (index.n == 0 || !WRITE_SYNC_INDEX(out_file, &index))
+        {
+            perror("Error on writing sync index");
+            done = 0;
+        }
+        FREE_SYNC_INDEX(&index);
+    }
+    // The length is only known now, go back and complete the header
+    if (fseek(out_file, 0, SEEK_SET) != 0 ||
+        !WRITE_PACKED_HEADER(out_file, final_tree->fingerprint, total_bits))
+    {
+        perror("Error on updating packed header (output must be seekable)");
+        done = 0;
+    }
+    free(bits.words);
+    return done;
+}
+
+int PROCEED_TASK_2_PACKED(Tree* final_tree, FILE* in_file, FILE* out_file,
+                          int decode_bits, int n_threads, SyncRange* range)
+{
+    // Main function for the packed variant of task 2
+    // The input is a container written by -c3p for the same tree. It is
+    // read and decoded PACKED_CHUNK_WORDS words at a time; the few bits of
+    // a code cut by the end of a chunk are carried over to the next one.
+    // A container with a sync index is decoded through it instead
+    // Returns 0 if the stream could not be decoded completely
+    unsigned long long fingerprint, n_bits;
+    if (!READ_PACKED_HEADER(in_file, &fingerprint, &n_bits))
+    {
+        printf("[ERROR] Input is not a packed stream\n");
+        return 0;
+    }
+    if (fingerprint != final_tree->fingerprint)
+    {
+        printf("[ERROR] Packed stream was encoded with a different tree\n");
+        return 0;
+    }
+    if (final_tree->flat.n < 2)
+    {
+        fprintf(out_file, "\n");
+        return 1;
+    }
+    SyncIndex index;
+    if (READ_SYNC_INDEX(in_file, n_bits, &index))
+    {
+        int done = PROCEED_TASK_2_SYNCED(final_tree, in_file, out_file, &index,
+                                         decode_bits, n_threads, range);
+        FREE_SYNC_INDEX(&index);
+        return done;
+    }
+    if (range != NULL)
+    {
+        printf("[ERROR] -r needs a stream written with a sync index (-i)\n");
+        return 0;
+    }
+    unsigned char* chunk = (unsigned char*)malloc(PACKED_CHUNK_WORDS * 8);
+    BitBuffer bits = {NULL, 0, 0};
+    Decoder decoder = {decode_bits, NULL, NULL, &final_tree->flat, 0};
+    if (chunk == NULL || !BIT_BUFFER_RESERVE(&bits, (PACKED_CHUNK_WORDS + 1) * 64))
+    {
+        perror("Error on malloc packed stream buffers");
+        free(chunk);
+        free(bits.words);
+        return 0;
+    }
+    int done = 1;
+    int state = 0;
+    unsigned long long bits_left = n_bits;
+    while (bits_left > 0)
+    {
+        size_t want = bits_left >= PACKED_CHUNK_WORDS * 64ULL ?
+                      PACKED_CHUNK_WORDS * 8 : (size_t)((bits_left + 7) / 8);
+        size_t got = fread(chunk, 1, want, in_file);
+        if (got == 0)
+        {
+            printf("[ERROR] Packed stream is truncated\n");
+            done = 0;
+            break;
+        }
+        for (size_t i = 0; i < got; i += 8)
+        {
+            int n_bytes = got - i < 8 ? (int)(got - i) : 8;
+            int count = bits_left < (unsigned long long)n_bytes * 8 ?
+                        (int)bits_left : n_bytes * 8;
+            BIT_BUFFER_APPEND(&bits, LOAD_U64_LE(chunk + i, n_bytes), count);
+            bits_left -= count;
+        }
+        size_t used = DECODE_BITS(&decoder, &bits, &state, out_file);
+        // Keep the unused tail (shorter than one table lookup)
+        int tail = (int)(bits.n_bits - used);
+        unsigned long long rest = tail > 0 ? PEEK_BITS(&bits, used) : 0;
+        memset(bits.words, 0, sizeof(unsigned long long) * (bits.n_bits / 64 + 2));
+        bits.n_bits = 0;
+        BIT_BUFFER_APPEND(&bits, rest, tail);
+    }
+    fprintf(out_file, "\n");
+    FREE_DECODER(&decoder);
+    free(bits.words);
+    free(chunk);
+    return done && !decoder.failed;
+}
+
+// Canonical code book (-cc)
+// Only the code length of every satellite is kept from the tree: codes
+// are then reassigned in (length, name) order, each one being the previous
+// code plus one, shifted left when the length grows. A receiver rebuilds
+// the same codes from the lengths alone. Lines are "LENGTH NAME CODE"
+#define CANONICAL_MAX_LIMIT 64 // Largest value accepted by -l
+
+typedef struct CodeEntry
+{
+    const char* name; // Slice of the leaf names of the flat layout
+    size_t name_len;
+    int frequency;
+    int length;
+    int order; // Position in the preorder, to keep duplicate names stable
+} CodeEntry;
+
+int CODE_ENTRY_BY_WEIGHT(const void* a, const void* b)
+{
+    // Helper function for qsort: ascending frequency, then preorder
+    const CodeEntry* el_a = (const CodeEntry*)a;
+    const CodeEntry* el_b = (const CodeEntry*)b;
+    if (el_a->frequency != el_b->frequency)
+    {
+        return el_a->frequency < el_b->frequency ? -1 : 1;
+    }
+    return el_a->order - el_b->order;
+}
+
+int CODE_ENTRY_CANONICAL(const void* a, const void* b)
+{
+    // Helper function for qsort: ascending length, then name, then preorder
+    const CodeEntry* el_a = (const CodeEntry*)a;
+    const CodeEntry* el_b = (const CodeEntry*)b;
+    if (el_a->length != el_b->length) return el_a->length - el_b->length;
+    size_t len = el_a->name_len < el_b->name_len ? el_a->name_len : el_b->name_len;
+    int cmp = memcmp(el_a->name, el_b->name, len);
+    if (cmp == 0)
+    {
+        cmp = (el_a->name_len > el_b->name_len) - (el_a->name_len < el_b->name_len);
+    }
+    if (cmp != 0) return cmp;
+    return el_a->order - el_b->order;
+}
+
+int PACKAGE_MERGE(CodeEntry* entries, int n, int max_len)
+{
+    // Function to compute optimal code lengths of at most max_len bits
+    // (package-merge). entries must be sorted by ascending frequency.
+    // The list of level j merges the leaves with the pairs ("packages")
+    // of the list of level j + 1; only the first 2n - 2 items matter.
+    // For every level a bitmap records which items are packages, then the
+    // first 2n - 2 items of level 1 are unfolded: each leaf met on a level
+    // gets one more bit, each package takes two items of the next level
+    int max_items = 2 * n - 2;
+    size_t words = (size_t)(max_items + 63) / 64;
+    unsigned long long* is_package =
+        (unsigned long long*)calloc(words * max_len, sizeof(unsigned long long));
+    long long* prev = (long long*)malloc(sizeof(long long) * max_items);
+    long long* current = (long long*)malloc(sizeof(long long) * max_items);
+    int* counts = (int*)malloc(sizeof(int) * max_len);
+    if (is_package == NULL || prev == NULL || current == NULL || counts == NULL)
+    {
+        perror("Error on malloc package-merge lists");
+        free(is_package);
+        free(prev);
+        free(current);
+        free(counts);
+        return 0;
+    }
+    // Level max_len only holds the leaves (index level - 1 in the arrays)
+    counts[max_len - 1] = GET_MIN_INT(n, max_items);
+    for (int i = 0; i < counts[max_len - 1]; i++)
+    {
+        prev[i] = entries[i].frequency;
+    }
+    for (int level = max_len - 1; level >= 1; level--)
+    {
+        unsigned long long* bits = is_package + words * (level - 1);
+        int n_packages = counts[level] / 2;
+        int leaf = 0, package = 0, count = 0;
+        while (count < max_items && (leaf < n || package < n_packages))
+        {
+            long long package_weight = package < n_packages ?
+                prev[2 * package] + prev[2 * package + 1] : 0;
+            if (package >= n_packages ||
+                (leaf < n && entries[leaf].frequency <= package_weight))
+            {
+                current[count++] = entries[leaf++].frequency;
+            } else {
+                bits[count / 64] |= 1ULL << (count % 64);
+                current[count++] = package_weight;
+                package++;
+            }
+        }
+        counts[level - 1] = count;
+        long long* temp = prev;
+        prev = current;
+        current = temp;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        entries[i].length = 0;
+    }
+    int take = max_items;
+    for (int level = 1; level <= max_len && take > 0; level++)
+    {
+        unsigned long long* bits = is_package + words * (level - 1);
+        int n_leaves = 0, n_packages = 0;
+        for (int i = 0; i < take; i++)
+        {
+            if ((bits[i / 64] >> (i % 64)) & 1)
+            {
+                n_packages++;
+            } else {
+                entries[n_leaves++].length++;
+            }
+        }
+        take = 2 * n_packages;
+    }
+    free(is_package);
+    free(prev);
+    free(current);
+    free(counts);
+    return 1;
+}
+
+void PROCEED_CANONICAL_CODES(Tree* final_tree, FILE* out_file, int max_len)
+{
+    // Main function for the canonical code book
+    // The lengths are the leaf depths of the tree; when the tree is deeper
+    // than max_len (0 means no limit) they come from PACKAGE_MERGE instead
+    FlatTree* flat = &final_tree->flat;
+    if (flat->n == 0) return;
+    int n_leaves = flat->n / 2 + 1;
+    if (max_len > 0 && max_len < 31 && (1 << max_len) < n_leaves)
+    {
+        printf("[ERROR] %d satellites do not fit in codes of %d bits",
+               n_leaves, max_len);
+        return;
+    }
+    CodeEntry* entries = (CodeEntry*)malloc(sizeof(CodeEntry) * n_leaves);
+    int* stack = (int*)malloc(sizeof(int) * flat->n);
+    if (entries == NULL || stack == NULL)
+    {
+        perror("Error on malloc code book");
+        free(entries);
+        free(stack);
+        return;
+    }
+    int top = 0, count = 0, height = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int current = stack[--top];
+        if (flat->left[current] == -1)
+        {
+            // The leaf of a lone satellite is the root (depth 0), but
+            // its code still needs one bit
+            entries[count].name = flat->names + flat->name_offset[current];
+            entries[count].name_len = flat->name_len[current];
+            entries[count].frequency = flat->frequency[current];
+            entries[count].length = GET_MAX(flat->depth[current], 1);
+            entries[count].order = count;
+            height = GET_MAX(height, entries[count].length);
+            count++;
+            continue;
+        }
+        stack[top++] = flat->right[current];
+        stack[top++] = flat->left[current];
+    }
+    free(stack);
+    if (max_len > 0 && height > max_len)
+    {
+        qsort(entries, count, sizeof(CodeEntry), CODE_ENTRY_BY_WEIGHT);
+        if (!PACKAGE_MERGE(entries, count, max_len))
+        {
+            free(entries);
+            return;
+        }
+        height = max_len;
+    }
+    qsort(entries, count, sizeof(CodeEntry), CODE_ENTRY_CANONICAL);
+    // The code is kept as '0'/'1' characters, so lengths are not bounded
+    // by the width of an integer
+    char* code = (char*)malloc(sizeof(char) * (height + 1));
+    if (code == NULL)
+    {
+        perror("Error on malloc code");
+        free(entries);
+        return;
+    }
+    int code_len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            // Next code: add one to the previous code
+            int pos = code_len - 1;
+            while (pos >= 0 && code[pos] == '1')
+            {
+                code[pos--] = '0';
+            }
+            if (pos >= 0) code[pos] = '1';
+        }
+        while (code_len < entries[i].length)
+        {
+            code[code_len++] = '0'; // Longer code: shift left
+        }
+        code[code_len] = '\0';
+        fprintf(out_file, "%d %.*s %s\n", entries[i].length,
+                (int)entries[i].name_len, entries[i].name, code);
+    }
+    free(code);
+    free(entries);
+}
+
+// Tree snapshot (-build, -s)
+// The finished tree is written as its flat layout, so the file can be
+// mapped at any address and queried in place:
+//   SnapshotHeader
+//   code_offset, name_offset, name_len (n_nodes size_t values each)
+//   code table words (codes_words, 0 if the tree had no code table)
+//   left, right, parent, frequency, depth, height (n_nodes int values each)
+//   name index slots (position + 1, 0 for an empty slot)
+//   name_shared flags (n_nodes bytes)
+//   leaf names in the order of the leaf chain, then '\0'
+// Every section starts at a multiple of 8 bytes. Records use the byte
+// order of the host that built the snapshot; LOAD_SNAPSHOT refuses a
+// file written with another byte order or another size_t
+#define SNAPSHOT_MAGIC "SATS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x0102030405060708ULL
+
+typedef struct SnapshotHeader
+{
+    char magic[4];
+    int version;
+    unsigned long long byte_order;
+    unsigned long long fingerprint;
+    unsigned long long word_size; // sizeof(size_t) of the writer
+    unsigned long long n_nodes;
+    unsigned long long codes_bits;
+    unsigned long long codes_words;
+    unsigned long long index_slots;
+    unsigned long long names_size; // Length of the root name
+} SnapshotHeader;
+
+int WRITE_SNAPSHOT(Tree* final_tree, FILE* out_file)
+{
+    // Main function for -build: writes the tree built from the input (or
+    // mapped from another snapshot) from its flat layout
+    // Returns 0 on error
+    FlatTree* flat = &final_tree->flat;
+    int n = flat->n;
+    int* slots = flat->index_slots;
+    size_t n_slots = n > 0 ? flat->index_mask + 1 : 0;
+    if (n > 0 && slots == NULL)
+    {
+        // Tree built in memory: its name index holds nodes
+        if (final_tree->index.slots == NULL)
+        {
+            printf("[ERROR] The tree index could not be built");
+            return 0;
+        }
+        n_slots = final_tree->index.mask + 1;
+        slots = (int*)malloc(sizeof(int) * n_slots);
+        if (slots == NULL)
+        {
+            perror("Error on malloc snapshot index");
+            return 0;
+        }
+        for (size_t i = 0; i < n_slots; i++)
+        {
+            node* slot = final_tree->index.slots[i];
+            slots[i] = slot == NULL ? 0 : slot->data->flat_id + 1;
+        }
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.fingerprint = final_tree->fingerprint;
+    header.word_size = sizeof(size_t);
+    header.n_nodes = n;
+    if (final_tree->codes.bits != NULL)
+    {
+        header.codes_bits = final_tree->codes.n_bits;
+        header.codes_words = final_tree->codes.n_bits / 64 + 2;
+    }
+    header.index_slots = n_slots;
+    header.names_size = n > 0 ? flat->name_len[0] : 0;
+    int written = fwrite(&header, sizeof(header), 1, out_file) == 1;
+    if (n > 0)
+    {
+        size_t size_n = n;
+        int* columns[] = {flat->left, flat->right, flat->parent,
+                          flat->frequency, flat->depth, flat->height};
+        written = written &&
+                  fwrite(flat->code_offset, sizeof(size_t), size_n, out_file) == size_n &&
+                  fwrite(flat->name_offset, sizeof(size_t), size_n, out_file) == size_n &&
+                  fwrite(flat->name_len, sizeof(size_t), size_n, out_file) == size_n;
+        if (header.codes_words > 0)
+        {
+            written = written && fwrite(final_tree->codes.bits, sizeof(unsigned long long),
+                                        header.codes_words, out_file) == header.codes_words;
+        }
+        for (int i = 0; i < 6 && written; i++)
+        {
+            written = fwrite(columns[i], sizeof(int), size_n, out_file) == size_n;
+        }
+        written = written && fwrite(slots, sizeof(int), n_slots, out_file) == n_slots &&
+                  fwrite(flat->name_shared, 1, size_n, out_file) == size_n &&
+                  fwrite(flat->names, 1, header.names_size, out_file) == header.names_size;
+    }
+    // A full disk is only seen when the buffer is written out
+    written = written && fputc('\0', out_file) != EOF && fflush(out_file) == 0;
+    if (!written)
+    {
+        perror("Error on writing snapshot");
+    }
+    if (slots != flat->index_slots)
+    {
+        free(slots);
+    }
+    return written;
+}
+
+int LOAD_SNAPSHOT(Tree* final_tree, const char* path)
+{
+    // Function to map a snapshot written by -build. The flat layout, the
+    // code table and the name index are used in place, from the mapping:
+    // nothing is parsed, sorted, hashed or copied, and no node is built
+    // (NEED_TREE_NODES builds them for the updates)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Error on opening snapshot");
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader))
+    {
+        printf("[ERROR] %s is not a tree snapshot", path);
+        close(fd);
+        return 0;
+    }
+    size_t size = info.st_size;
+    unsigned char* base = (unsigned char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("Error on mmap snapshot");
+        return 0;
+    }
+    final_tree->snapshot.base = base;
+    final_tree->snapshot.size = size;
+    const SnapshotHeader* header = (const SnapshotHeader*)base;
+    size_t node_bytes = 3 * sizeof(size_t) + 6 * sizeof(int) + 1;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->word_size != sizeof(size_t) ||
+        header->n_nodes > size / node_bytes ||
+        header->codes_words > size / sizeof(unsigned long long) ||
+        header->index_slots > size / sizeof(int) || header->names_size >= size)
+    {
+        printf("[ERROR] %s is not a valid tree snapshot", path);
+        return 0;
+    }
+    int n = header->n_nodes;
+    size_t sizes_at = sizeof(SnapshotHeader);
+    size_t codes_at = sizes_at + 3 * sizeof(size_t) * n;
+    size_t ints_at = codes_at + header->codes_words * sizeof(unsigned long long);
+    size_t index_at = ints_at + 6 * sizeof(int) * n;
+    size_t shared_at = index_at + header->index_slots * sizeof(int);
+    size_t names_at = shared_at + n;
+    if (names_at + header->names_size + 1 != size || base[size - 1] != '\0' ||
+        (n > 0 && (n % 2 == 0 || header->index_slots <= (size_t)n ||
+                   (header->index_slots & (header->index_slots - 1)) != 0)) ||
+        (n == 0 && (header->index_slots != 0 || header->names_size != 0)) ||
+        (header->codes_words > 0 &&
+         header->codes_words != header->codes_bits / 64 + 2))
+    {
+        printf("[ERROR] %s is not a valid tree snapshot", path);
+        return 0;
+    }
+    final_tree->n_nodes = n / 2;
+    final_tree->fingerprint = header->fingerprint;
+    if (header->codes_words > 0)
+    {
+        final_tree->codes.bits = (unsigned long long*)(base + codes_at);
+        final_tree->codes.n_bits = header->codes_bits;
+        final_tree->codes.mapped = 1;
+    }
+    if (n == 0) return 1; // Snapshot of an empty tree
+    FlatTree* flat = &final_tree->flat;
+    flat->mapped = 1;
+    flat->n = n;
+    flat->code_offset = (size_t*)(base + sizes_at);
+    flat->name_offset = flat->code_offset + n;
+    flat->name_len = flat->name_offset + n;
+    flat->left = (int*)(base + ints_at);
+    flat->right = flat->left + n;
+    flat->parent = flat->right + n;
+    flat->frequency = flat->parent + n;
+    flat->depth = flat->frequency + n;
+    flat->height = flat->depth + n;
+    flat->index_slots = (int*)(base + index_at);
+    flat->index_mask = header->index_slots - 1;
+    flat->name_shared = base + shared_at;
+    flat->names = (char*)base + names_at;
+    // The arrays must form the tree they describe. Positions are given
+    // breadth-first, so the children of the internal nodes, taken in
+    // order, are exactly 1, 2, ..., n - 1: every node but the root has
+    // one parent that comes before it, and all of them are reached from
+    // the root. The children point back to their parent, and depths,
+    // heights and names agree with them: the slice of a name is split
+    // between the two children, so every slice lies in the names
+    int valid = flat->parent[0] == -1 && flat->depth[0] == 0 &&
+                flat->name_offset[0] == 0 && flat->name_len[0] == header->names_size;
+    int next_child = 1;
+    for (int i = 0; i < n && valid; i++)
+    {
+        int left = flat->left[i];
+        int right = flat->right[i];
+        if (left == -1)
+        {
+            valid = right == -1 && flat->height[i] == 1 &&
+                    (header->codes_words == 0 ||
+                     (flat->code_offset[i] <= header->codes_bits &&
+                      (size_t)flat->depth[i] <= header->codes_bits - flat->code_offset[i]));
+            continue;
+        }
+        valid = left == next_child && right == left + 1 && right < n &&
+                flat->parent[left] == i && flat->parent[right] == i &&
+                flat->depth[left] == flat->depth[i] + 1 &&
+                flat->depth[right] == flat->depth[i] + 1 &&
+                flat->height[i] == 1 + GET_MAX(flat->height[left], flat->height[right]) &&
+                flat->name_len[left] <= flat->name_len[i] &&
+                flat->name_len[right] == flat->name_len[i] - flat->name_len[left];
+        if (!valid) break;
+        // The name starts with the child that compared lower on merge
+        int first = flat->name_offset[left] == flat->name_offset[i] ? left : right;
+        int second = first == left ? right : left;
+        valid = flat->name_offset[first] == flat->name_offset[i] &&
+                flat->name_offset[second] == flat->name_offset[i] + flat->name_len[first];
+        next_child += 2;
+    }
+    valid = valid && next_child == n;
+    size_t n_used = 0;
+    for (size_t i = 0; i < header->index_slots && valid; i++)
+    {
+        valid = flat->index_slots[i] >= 0 && flat->index_slots[i] <= n;
+        n_used += flat->index_slots[i] != 0;
+    }
+    if (!valid || n_used >= header->index_slots)
+    {
+        printf("[ERROR] %s is not a valid tree snapshot", path);
+        return 0;
+    }
+    flat->decode_tables = (struct DecodeTable**)calloc(n, sizeof(struct DecodeTable*));
+    if (flat->decode_tables == NULL)
+    {
+        perror("Error on malloc flat tree");
+        return 0;
+    }
+    return 1;
+}
+
+// Adaptive updates (-u FILE, and "-u" requests of -serve)
+// Frequency changes, new satellites and removals are applied to the tree
+// in place instead of rebuilding it. The tree keeps the sibling property
+// (SiblingOrder), which makes it a Huffman tree for the new frequencies.
+// Changes are made in passes over the path of the leaf, as in the FGK
+// algorithm: every node on it first swaps places with the leader of its
+// block (the first node of the same frequency in the order), then grows
+// (a decrease swaps with the last node instead). FGK grows by one per
+// pass; here a pass adds as much as keeps every node of the path behind
+// the block before its own (RAISE_STEP), so a change takes one pass per
+// block boundary it crosses, however large it is. A pass costs O(depth)
+// swaps, and a swap renames and re-indexes the ancestors of the two nodes
+// in O(depth).
+// Children are put back in NODE_CMP order at the end of the batch, so
+// without ties between node frequencies the tree is the one a rebuild
+// gives. Where frequencies tie, nodes of other parents are not reordered:
+// the shape (and the -c1 and -c3 outputs) can differ from a rebuild, with
+// the same total code length.
+// An update file holds batches, each one a count followed by updates:
+//   + NAME FREQ   add a satellite
+//   - NAME        remove a satellite
+//   = NAME FREQ   set the frequency of a satellite
+// After a batch, REFRESH_TREE sorts and re-indexes only the nodes on the
+// changed paths, and PATCH_FLAT_TREE patches the flat layout and the code
+// table. NEED_FLAT_TREE lays the tree out breadth-first again for the
+// outputs that follow the positions.
+
+int ORDER_RESERVE(SiblingOrder* order, int n)
+{
+    // Helper function to make room for n nodes in the order
+    if (n <= order->capacity) return 1;
+    int capacity = order->capacity > 0 ? order->capacity : 64;
+    while (capacity < n)
+    {
+        capacity *= 2;
+    }
+    node** nodes = (node**)realloc(order->nodes, sizeof(node*) * capacity);
+    if (nodes == NULL)
+    {
+        perror("Error on realloc sibling order");
+        return 0;
+    }
+    order->nodes = nodes;
+    order->capacity = capacity;
+    return 1;
+}
+
+void ORDER_PLACE(SiblingOrder* order, int pos, node* src)
+{
+    // Helper function to put a node at a position of the order
+    order->nodes[pos] = src;
+    src->data->order = pos;
+}
+
+void ORDER_SWAP_SLOTS(SiblingOrder* order, int pos_a, int pos_b)
+{
+    // Helper function to exchange two positions of the order only
+    // (the tree is unchanged, so both nodes must have the same frequency)
+    node* temp = order->nodes[pos_a];
+    ORDER_PLACE(order, pos_a, order->nodes[pos_b]);
+    ORDER_PLACE(order, pos_b, temp);
+}
+
+int ORDER_FIRST(SiblingOrder* order, int frequency)
+{
+    // Function to find the first position with the given frequency
+    // (binary search: frequencies never increase along the order)
+    int low = 0, high = order->n - 1;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (order->nodes[mid]->data->frequency > frequency)
+        {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int ORDER_LAST(SiblingOrder* order, int frequency)
+{
+    // Function to find the last position with the given frequency
+    int low = 0, high = order->n - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (order->nodes[mid]->data->frequency < frequency)
+        {
+            high = mid - 1;
+        } else {
+            low = mid;
+        }
+    }
+    return low;
+}
+
+int SIBLING_PAIR_CMP(const void* a, const void* b)
+{
+    // Helper function for qsort: parents by the lower frequency of their
+    // children, then by the higher one, both decreasing
+    node* el_a = *(node* const*)a;
+    node* el_b = *(node* const*)b;
+    int low_a = GET_MIN_INT(el_a->left->data->frequency, el_a->right->data->frequency);
+    int low_b = GET_MIN_INT(el_b->left->data->frequency, el_b->right->data->frequency);
+    if (low_a != low_b)
+    {
+        return low_a < low_b ? 1 : -1;
+    }
+    int high_a = GET_MAX(el_a->left->data->frequency, el_a->right->data->frequency);
+    int high_b = GET_MAX(el_b->left->data->frequency, el_b->right->data->frequency);
+    if (high_a != high_b)
+    {
+        return high_a < high_b ? 1 : -1;
+    }
+    return 0;
+}
+
+void FREE_SIBLING_ORDER(SiblingOrder* order)
+{
+    // Helper function to release the order and its scratch stacks
+    free(order->nodes);
+    FREE_NODE_STACK(&order->path);
+    FREE_NODE_STACK(&order->removed);
+    FREE_NODE_STACK(&order->touched);
+    memset(order, 0, sizeof(SiblingOrder));
+}
+
+int BUILD_SIBLING_ORDER(Tree* final_tree, FILE* log)
+{
+    // Function to list the nodes of the tree in sibling order
+    // Each pair of children was merged at some step of the construction,
+    // and the merges come in order of frequency, so sorting the pairs
+    // like the merges, last one first, gives the order
+    SiblingOrder* order = &final_tree->order;
+    FlatTree* flat = &final_tree->flat;
+    int n = flat->n;
+    if (!NODE_STACK_INIT(&order->path, 64) || !NODE_STACK_INIT(&order->removed, 64) ||
+        !NODE_STACK_INIT(&order->touched, 64) || !ORDER_RESERVE(order, n > 0 ? n : 1))
+    {
+        FREE_SIBLING_ORDER(order);
+        return 0;
+    }
+    order->n = n;
+    if (n == 0) return 1;
+    node** parents = (node**)malloc(sizeof(node*) * (n / 2 > 0 ? n / 2 : 1));
+    if (parents == NULL)
+    {
+        perror("Error on malloc sibling pairs");
+        FREE_SIBLING_ORDER(order);
+        return 0;
+    }
+    int n_parents = 0;
+    int valid = 1;
+    for (int i = 0; i < n; i++)
+    {
+        node* current = flat->source[i];
+        // New leaves have no name rank, so from now on NODE_CMP decides
+        // ties by the names alone (the order RANK_LEAF_NAMES keeps)
+        current->data->name_rank = 0;
+        if (current->left != NULL)
+        {
+            parents[n_parents++] = current;
+            valid = valid && current->data->frequency ==
+                    current->left->data->frequency + current->right->data->frequency;
+        }
+    }
+    qsort(parents, n_parents, sizeof(node*), SIBLING_PAIR_CMP);
+    ORDER_PLACE(order, 0, final_tree->root);
+    for (int i = 0; i < n_parents; i++)
+    {
+        node* high = parents[i]->left;
+        node* low = parents[i]->right;
+        if (high->data->frequency < low->data->frequency)
+        {
+            high = parents[i]->right;
+            low = parents[i]->left;
+        }
+        ORDER_PLACE(order, 2 * i + 1, high);
+        ORDER_PLACE(order, 2 * i + 2, low);
+    }
+    free(parents);
+    for (int i = 1; i < n && valid; i++)
+    {
+        valid = order->nodes[i - 1]->data->frequency >= order->nodes[i]->data->frequency;
+    }
+    if (!valid)
+    {
+        fprintf(log, "[ERROR] The tree is not a Huffman tree of its frequencies\n");
+        FREE_SIBLING_ORDER(order);
+        return 0;
+    }
+    return 1;
+}
+
+node* LEAF_BEFORE(node* src)
+{
+    // Helper function: the leaf right before the name of src in the leaf
+    // chain of the root (NULL if the chain starts with it)
+    while (src->parent != NULL)
+    {
+        node* parent = src->parent;
+        if (parent->data->first_leaf != src->data->first_leaf)
+        {
+            node* sibling = parent->left == src ? parent->right : parent->left;
+            return sibling->data->last_leaf;
+        }
+        src = parent;
+    }
+    return NULL;
+}
+
+void RENAME_FROM_CHILDREN(node* src)
+{
+    // Helper function to recompute the name of an internal node from its
+    // children; the leaf chain tells which of them comes first
+    node* first = src->left;
+    node* second = src->right;
+    if (first->data->last_leaf->next_leaf != second->data->first_leaf)
+    {
+        first = src->right;
+        second = src->left;
+    }
+    src->data->first_leaf = first->data->first_leaf;
+    src->data->last_leaf = second->data->last_leaf;
+    src->data->name_len = first->data->name_len + second->data->name_len;
+    src->data->name_hash = first->data->name_hash * second->data->name_pow +
+                           second->data->name_hash;
+    src->data->name_pow = first->data->name_pow * second->data->name_pow;
+}
+
+void SORT_CHILDREN(node* src)
+{
+    // Helper function to put the children of an internal node back where
+    // MERGE_NODES puts them: the lower one in NODE_CMP order on the left
+    // and first in the name. The node is renamed from them
+    if (NODE_CMP(src->left, src->right) > 0)
+    {
+        node* temp = src->left;
+        src->left = src->right;
+        src->right = temp;
+    }
+    src->left->data->last_leaf->next_leaf = src->right->data->first_leaf;
+    RENAME_FROM_CHILDREN(src);
+    src->data->height = 1 + GET_MAX(src->left->data->height, src->right->data->height);
+}
+
+void MARK_CHANGED(node* from)
+{
+    // Helper function to mark a node and its ancestors as changed. The
+    // ancestors of a changed node are always changed, so the walk stops
+    // at the first node that already is
+    for (node* it = from; it != NULL && !it->data->changed; it = it->parent)
+    {
+        it->data->changed = 1;
+    }
+}
+
+int NEED_TREE_NODES(Tree* final_tree)
+{
+    // Function to build the nodes of a tree mapped from a snapshot, which
+    // the updates change in place. The tree then owns its name index, code
+    // table and flat layout, like a tree built from the input
+    // Returns 0 on error
+    FlatTree* flat = &final_tree->flat;
+    if (!flat->mapped) return 1;
+    int n = flat->n;
+    node** nodes = (node**)malloc(sizeof(node*) * n);
+    if (nodes == NULL)
+    {
+        perror("Error on malloc snapshot nodes");
+        return 0;
+    }
+    INIT_NODE_POOL(&final_tree->pool, n);
+    for (int i = 0; i < n; i++)
+    {
+        nodes[i] = POOL_NEW_NODE(&final_tree->pool);
+        if (nodes[i] == NULL)
+        {
+            free(nodes);
+            return 0;
+        }
+    }
+    // Children come after their parents, so both children of a node are
+    // done before the node itself
+    for (int i = n - 1; i >= 0; i--)
+    {
+        node* current = nodes[i];
+        current->data->height = flat->height[i];
+        current->data->name_shared = flat->name_shared[i];
+        current->parent = flat->parent[i] == -1 ? NULL : nodes[flat->parent[i]];
+        if (flat->left[i] == -1)
+        {
+            char* stored = POOL_STORE_NAME(&final_tree->pool,
+                                           flat->names + flat->name_offset[i],
+                                           flat->name_len[i]);
+            if (stored == NULL)
+            {
+                free(nodes);
+                return 0;
+            }
+            INIT_LEAF_NODE(current, stored, flat->name_len[i], flat->frequency[i]);
+            continue;
+        }
+        current->data->frequency = flat->frequency[i];
+        current->left = nodes[flat->left[i]];
+        current->right = nodes[flat->right[i]];
+        // Link the leaf ranges in the order of the name
+        node* first = current->left;
+        node* second = current->right;
+        if (flat->name_offset[flat->left[i]] != flat->name_offset[i])
+        {
+            first = current->right;
+            second = current->left;
+        }
+        first->data->last_leaf->next_leaf = second->data->first_leaf;
+        RENAME_FROM_CHILDREN(current);
+    }
+    final_tree->root = nodes[0];
+    free(nodes);
+    // Drop what points into the mapping and index the new nodes
+    final_tree->codes.bits = NULL;
+    final_tree->codes.n_bits = 0;
+    final_tree->codes.capacity = 0;
+    final_tree->codes.n_stale = 0;
+    final_tree->codes.mapped = 0;
+    FREE_LCA_INDEX(&final_tree->lca);
+    FREE_FLAT_TREE(flat);
+    INDEX_SATELLITE_TREE(final_tree);
+    return flat->n > 0;
+}
+
+void UNINDEX_NODE(Tree* final_tree, node* src)
+{
+    // Helper function to take a node out of the index before its name
+    // changes. If it stood for other nodes of the same name, they are
+    // indexed again at the end of the batch
+    if (INDEX_REMOVE(&final_tree->index, src) && src->data->name_shared)
+    {
+        final_tree->order.lost_shared = 1;
+    }
+}
+
+int PATH_PUSH_ANCESTORS(Tree* final_tree, node* from, node* stop)
+{
+    // Helper function to add from and its ancestors, up to (not including)
+    // stop, to the list of nodes renamed by the current change
+    for (node* it = from; it != stop; it = it->parent)
+    {
+        if (!NODE_STACK_PUSH(&final_tree->order.path, it))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void PATH_UNINDEX(Tree* final_tree)
+{
+    // Helper function to take every node of the path out of the index
+    NodeStack* path = &final_tree->order.path;
+    for (int i = 0; i < path->top; i++)
+    {
+        UNINDEX_NODE(final_tree, path->items[i]);
+    }
+}
+
+void PATH_REINDEX(Tree* final_tree)
+{
+    // Helper function to rename the nodes of the path (children come
+    // before their parents in it) and put them back in the index
+    // The path runs up to the root; its nodes are sorted at the end of
+    // the batch (REFRESH_TREE)
+    NodeStack* path = &final_tree->order.path;
+    for (int i = 0; i < path->top; i++)
+    {
+        RENAME_FROM_CHILDREN(path->items[i]);
+        INDEX_INSERT(&final_tree->index, path->items[i]);
+        path->items[i]->data->changed = 1;
+    }
+}
+
+int SWAP_SUBTREES(Tree* final_tree, node* el_a, node* el_b)
+{
+    // Function to exchange the places of two nodes of the same frequency,
+    // neither of them an ancestor of the other: their subtrees trade
+    // parents, leaf ranges and positions in the order
+    node* common = LOWEST_COMMON_NODE(el_a, el_b);
+    final_tree->order.path.top = 0;
+    if (!PATH_PUSH_ANCESTORS(final_tree, el_a->parent, common) ||
+        !PATH_PUSH_ANCESTORS(final_tree, el_b->parent, common) ||
+        !PATH_PUSH_ANCESTORS(final_tree, common, NULL))
+    {
+        return 0;
+    }
+    PATH_UNINDEX(final_tree);
+    // Swap the two leaf ranges in the chain
+    node* before_a = LEAF_BEFORE(el_a);
+    node* before_b = LEAF_BEFORE(el_b);
+    node* first_a = el_a->data->first_leaf;
+    node* last_a = el_a->data->last_leaf;
+    node* first_b = el_b->data->first_leaf;
+    node* last_b = el_b->data->last_leaf;
+    node* after_a = last_a->next_leaf;
+    node* after_b = last_b->next_leaf;
+    if (after_a == first_b)
+    {
+        if (before_a != NULL) before_a->next_leaf = first_b;
+        last_b->next_leaf = first_a;
+        last_a->next_leaf = after_b;
+    } else if (after_b == first_a) {
+        if (before_b != NULL) before_b->next_leaf = first_a;
+        last_a->next_leaf = first_b;
+        last_b->next_leaf = after_a;
+    } else {
+        if (before_a != NULL) before_a->next_leaf = first_b;
+        if (before_b != NULL) before_b->next_leaf = first_a;
+        last_b->next_leaf = after_a;
+        last_a->next_leaf = after_b;
+    }
+    // Swap the tree links
+    node* parent_a = el_a->parent;
+    node* parent_b = el_b->parent;
+    if (parent_a == parent_b)
+    {
+        node* temp = parent_a->left;
+        parent_a->left = parent_a->right;
+        parent_a->right = temp;
+    } else {
+        if (parent_a->left == el_a) parent_a->left = el_b; else parent_a->right = el_b;
+        if (parent_b->left == el_b) parent_b->left = el_a; else parent_b->right = el_a;
+    }
+    el_a->parent = parent_b;
+    el_b->parent = parent_a;
+    int pos_a = el_a->data->order;
+    ORDER_PLACE(&final_tree->order, el_b->data->order, el_a);
+    ORDER_PLACE(&final_tree->order, pos_a, el_b);
+    PATH_REINDEX(final_tree);
+    return 1;
+}
+
+int RAISE_STEP(SiblingOrder* order, node* leaf, int limit)
+{
+    // Function to find how much a leaf can grow in one pass of
+    // INCREMENT_LEAF, up to limit. Every node of the path takes the place
+    // of the leader of its block (the first node of its frequency) and
+    // may grow until it reaches the frequency right before that block.
+    // The nodes the pass swaps all have lower frequencies than the blocks
+    // above them, so the blocks and leaders met here are the ones the pass
+    // meets. Returns 0 where a pass of one is needed: a leaf of frequency
+    // 0, or a node that ties with its parent (its sibling is 0)
+    if (leaf->data->frequency == 0) return 0;
+    int step = limit;
+    node* current = leaf;
+    while (current != NULL)
+    {
+        int frequency = current->data->frequency;
+        if (current->parent != NULL && current->parent->data->frequency == frequency)
+        {
+            return 0;
+        }
+        int first = ORDER_FIRST(order, frequency);
+        if (first > 0)
+        {
+            step = GET_MIN_INT(step, order->nodes[first - 1]->data->frequency - frequency);
+        }
+        // After the swap, the parent of the leader is the next node
+        current = order->nodes[first]->parent;
+        if (current != NULL && current->data->frequency == frequency)
+        {
+            return 0;
+        }
+    }
+    return step;
+}
+
+int LOWER_STEP(SiblingOrder* order, node* leaf, int limit)
+{
+    // Function like RAISE_STEP for DECREMENT_LEAF: every node of the path
+    // takes the place of the last node of its frequency and may shrink
+    // down to the frequency right after its block
+    int step = limit;
+    node* current = leaf;
+    while (current != NULL)
+    {
+        int frequency = current->data->frequency;
+        if (current->parent != NULL && current->parent->data->frequency == frequency)
+        {
+            return 0;
+        }
+        int last = ORDER_LAST(order, frequency);
+        if (last + 1 < order->n)
+        {
+            step = GET_MIN_INT(step, frequency - order->nodes[last + 1]->data->frequency);
+        }
+        current = order->nodes[last]->parent;
+        if (current != NULL && current->data->frequency == frequency)
+        {
+            return 0;
+        }
+    }
+    return step;
+}
+
+int INCREMENT_LEAF(Tree* final_tree, node* leaf, int step)
+{
+    // Function to add step to the frequency of a leaf in one pass over
+    // its path (step is 1 unless RAISE_STEP allows more)
+    SiblingOrder* order = &final_tree->order;
+    node* current = leaf;
+    if (leaf->data->frequency == 0)
+    {
+        // Frequencies of 0 fill the end of the order, and the highest node
+        // of the zero subtree holding the leaf comes first among them.
+        // The leaf is moved under that node and its pair right after it,
+        // so that both of them can become 1 where they are
+        node* top = leaf;
+        while (top->parent != NULL && top->parent->data->frequency == 0)
+        {
+            top = top->parent;
+        }
+        if (top != leaf)
+        {
+            node* child = leaf;
+            while (child->parent != top)
+            {
+                child = child->parent;
+            }
+            if (child != leaf &&
+                !SWAP_SUBTREES(final_tree, leaf, top->left == child ? top->right : top->left))
+            {
+                return 0;
+            }
+            int slot = top->data->order + 1;
+            int pair = leaf->data->order - (leaf->data->order + 1) % 2;
+            if (pair != slot)
+            {
+                ORDER_SWAP_SLOTS(order, pair, slot);
+                ORDER_SWAP_SLOTS(order, pair + 1, slot + 1);
+            }
+            if (leaf->data->order != slot)
+            {
+                ORDER_SWAP_SLOTS(order, slot, slot + 1);
+            }
+            leaf->data->frequency = 1;
+        }
+        top->data->frequency = 1;
+        current = top->parent;
+    }
+    while (current != NULL)
+    {
+        node* first = order->nodes[ORDER_FIRST(order, current->data->frequency)];
+        if (first == current->parent)
+        {
+            // The sibling of current is 0, so its parent has the same
+            // frequency and comes first. If current is right after it,
+            // both grow where they are; otherwise current is moved there
+            // and then takes the place of its (former) parent
+            int next = first->data->order + 1;
+            if (current->data->order == next)
+            {
+                current->data->frequency += step;
+                first->data->frequency += step;
+                current = first->parent;
+                continue;
+            }
+            if (!SWAP_SUBTREES(final_tree, current, order->nodes[next]) ||
+                !SWAP_SUBTREES(final_tree, current, first))
+            {
+                return 0;
+            }
+        } else if (first != current && !SWAP_SUBTREES(final_tree, current, first)) {
+            return 0;
+        }
+        current->data->frequency += step;
+        current = current->parent;
+    }
+    return 1;
+}
+
+int DECREMENT_LEAF(Tree* final_tree, node* leaf, int step)
+{
+    // Function to take step from the frequency of a leaf in one pass
+    // (step is at most the frequency, and 1 unless LOWER_STEP allows more)
+    SiblingOrder* order = &final_tree->order;
+    for (node* current = leaf; current != NULL; current = current->parent)
+    {
+        node* last = order->nodes[ORDER_LAST(order, current->data->frequency)];
+        if (last != current && last != current->parent &&
+            !SWAP_SUBTREES(final_tree, current, last))
+        {
+            return 0;
+        }
+        current->data->frequency -= step;
+    }
+    return 1;
+}
+
+int SET_FREQUENCY(Tree* final_tree, node* leaf, int frequency)
+{
+    // Function to bring the frequency of a leaf to a new value
+    // Every pass crosses at least one block boundary on the path, so the
+    // number of passes depends on the frequencies between the old and the
+    // new value, not on their difference
+    // Every node whose frequency changed is the leaf or an ancestor of it
+    SiblingOrder* order = &final_tree->order;
+    while (leaf->data->frequency < frequency)
+    {
+        int step = RAISE_STEP(order, leaf, frequency - leaf->data->frequency);
+        if (!INCREMENT_LEAF(final_tree, leaf, step > 0 ? step : 1)) return 0;
+    }
+    while (leaf->data->frequency > frequency)
+    {
+        int step = LOWER_STEP(order, leaf, leaf->data->frequency - frequency);
+        if (!DECREMENT_LEAF(final_tree, leaf, step > 0 ? step : 1)) return 0;
+    }
+    MARK_CHANGED(leaf);
+    return 1;
+}
+
+node* ADD_SATELLITE(Tree* final_tree, const char* name, size_t len)
+{
+    // Function to add a leaf with frequency 0 (SET_FREQUENCY raises it)
+    // The last node of the order has the lowest frequency; it is replaced
+    // by a new parent of itself and the leaf, and the two children are
+    // added at the end of the order
+    SiblingOrder* order = &final_tree->order;
+    if (!ORDER_RESERVE(order, order->n + 2) || !INDEX_RESERVE(&final_tree->index, 2))
+    {
+        return NULL;
+    }
+    char* stored = POOL_STORE_NAME(&final_tree->pool, name, len);
+    node* leaf = stored == NULL ? NULL : CREATE_LEAF_NODE(&final_tree->pool, stored, 0);
+    if (leaf == NULL) return NULL;
+    if (final_tree->root == NULL)
+    {
+        final_tree->root = leaf;
+        ORDER_PLACE(order, 0, leaf);
+        order->n = 1;
+        INDEX_INSERT(&final_tree->index, leaf);
+        return leaf;
+    }
+    node* last = order->nodes[order->n - 1];
+    node* parent = POOL_NEW_NODE(&final_tree->pool);
+    order->path.top = 0;
+    if (parent == NULL || !PATH_PUSH_ANCESTORS(final_tree, last->parent, NULL))
+    {
+        return NULL;
+    }
+    PATH_UNINDEX(final_tree);
+    parent->data->frequency = last->data->frequency;
+    parent->parent = last->parent;
+    if (last->parent == NULL)
+    {
+        final_tree->root = parent;
+    } else if (last->parent->left == last) {
+        last->parent->left = parent;
+    } else {
+        last->parent->right = parent;
+    }
+    parent->left = last;
+    parent->right = leaf;
+    last->parent = parent;
+    leaf->parent = parent;
+    // The name of the new parent is the name of last followed by the leaf
+    leaf->next_leaf = last->data->last_leaf->next_leaf;
+    last->data->last_leaf->next_leaf = leaf;
+    RENAME_FROM_CHILDREN(parent);
+    parent->data->changed = 1;
+    ORDER_PLACE(order, last->data->order, parent);
+    ORDER_PLACE(order, order->n, last);
+    ORDER_PLACE(order, order->n + 1, leaf);
+    order->n += 2;
+    final_tree->n_nodes++;
+    INDEX_INSERT(&final_tree->index, parent);
+    INDEX_INSERT(&final_tree->index, leaf);
+    PATH_REINDEX(final_tree);
+    return leaf;
+}
+
+int REMOVE_SATELLITE(Tree* final_tree, node* leaf)
+{
+    // Function to take a leaf out of the tree
+    // Its frequency is brought down to 0 first; then its parent is
+    // replaced by its sibling and the pair leaves the order
+    if (!SET_FREQUENCY(final_tree, leaf, 0)) return 0;
+    SiblingOrder* order = &final_tree->order;
+    if (!NODE_STACK_PUSH(&order->removed, leaf) ||
+        (leaf->parent != NULL && !NODE_STACK_PUSH(&order->removed, leaf->parent)))
+    {
+        return 0;
+    }
+    UNINDEX_NODE(final_tree, leaf);
+    if (leaf == final_tree->root)
+    {
+        final_tree->root = NULL;
+        order->n = 0;
+        return 1;
+    }
+    node* parent = leaf->parent;
+    node* sibling = parent->left == leaf ? parent->right : parent->left;
+    order->path.top = 0;
+    if (!PATH_PUSH_ANCESTORS(final_tree, parent->parent, NULL))
+    {
+        INDEX_INSERT(&final_tree->index, leaf);
+        return 0;
+    }
+    PATH_UNINDEX(final_tree);
+    UNINDEX_NODE(final_tree, parent);
+    node* before = LEAF_BEFORE(leaf);
+    if (before != NULL)
+    {
+        before->next_leaf = leaf->next_leaf;
+    }
+    sibling->parent = parent->parent;
+    if (parent->parent == NULL)
+    {
+        final_tree->root = sibling;
+    } else if (parent->parent->left == parent) {
+        parent->parent->left = sibling;
+    } else {
+        parent->parent->right = sibling;
+    }
+    int pair = leaf->data->order - (leaf->data->order + 1) % 2;
+    ORDER_PLACE(order, parent->data->order, sibling);
+    if (pair != order->n - 2)
+    {
+        ORDER_PLACE(order, pair, order->nodes[order->n - 2]);
+        ORDER_PLACE(order, pair + 1, order->nodes[order->n - 1]);
+    }
+    order->n -= 2;
+    final_tree->n_nodes--;
+    PATH_REINDEX(final_tree);
+    return 1;
+}
+
+node* FIND_UPDATE_LEAF(Tree* final_tree, const char* name, size_t len)
+{
+    // Function to find the leaf an update is about
+    node* found = INDEX_LOOKUP(&final_tree->index, name, len);
+    if (found != NULL && found->left == NULL)
+    {
+        return found;
+    }
+    if (found == NULL && !final_tree->order.lost_shared)
+    {
+        return NULL;
+    }
+    // The index keeps one node per name: a leaf that shares its name
+    // with the indexed node (or lost it in this batch) is searched for
+    SiblingOrder* order = &final_tree->order;
+    for (int i = 0; i < order->n; i++)
+    {
+        node* current = order->nodes[i];
+        if (current->left == NULL && NAME_EQUALS(current, name, len))
+        {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+void INDEX_CLAIM(NameIndex* index, node* src)
+{
+    // Helper function to index src for its name, unless a node of the
+    // same name that comes earlier in preorder is already indexed. That
+    // node may have been named while src was out of the index, so it is
+    // marked as shared here
+    size_t slot = NAME_INDEX_SLOT(src->data->name_hash, index->mask);
+    while (index->slots[slot] != NULL)
+    {
+        node* other = index->slots[slot];
+        if (other == src) return;
+        if (other->data->name_hash == src->data->name_hash &&
+            other->data->name_len == src->data->name_len &&
+            NAME_CMP(other, src) == 0)
+        {
+            other->data->name_shared = 1;
+            if (src->data->preorder < other->data->preorder)
+            {
+                index->slots[slot] = src;
+            }
+            return;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot] = src;
+    index->n_used++;
+}
+
+int RENUMBER_TREE(Tree* final_tree)
+{
+    // Function to number the nodes in preorder and fold them into the
+    // fingerprint in one walk, then to index the nodes of shared names
+    // again (the first of a name in preorder keeps the entry)
+    final_tree->fingerprint = 0;
+    final_tree->order.lost_shared = 0;
+    if (final_tree->root == NULL) return 1;
+    int n = 2 * final_tree->n_nodes + 1;
+    node** stack = (node**)malloc(sizeof(node*) * n);
+    node** shared = (node**)malloc(sizeof(node*) * n);
+    if (stack == NULL || shared == NULL)
+    {
+        perror("Error on malloc tree refresh");
+        free(stack);
+        free(shared);
+        return 0;
+    }
+    unsigned long long fingerprint = 0;
+    int top = 0, n_visited = 0, n_shared = 0;
+    stack[top++] = final_tree->root;
+    while (top > 0)
+    {
+        node* current = stack[--top];
+        current->data->preorder = n_visited++;
+        if (current->data->name_shared)
+        {
+            shared[n_shared++] = current;
+        }
+        fingerprint = FINGERPRINT_NODE(fingerprint, current);
+        if (current->left != NULL)
+        {
+            stack[top++] = current->right;
+            stack[top++] = current->left;
+        }
+    }
+    final_tree->fingerprint = fingerprint;
+    if (n_shared > 0 && INDEX_RESERVE(&final_tree->index, n_shared))
+    {
+        for (int i = 0; i < n_shared; i++)
+        {
+            INDEX_CLAIM(&final_tree->index, shared[i]);
+        }
+    }
+    free(stack);
+    free(shared);
+    return 1;
+}
+
+int FLAT_RESERVE(FlatTree* flat, int n)
+{
+    // Helper function to make room for n positions in the flat layout
+    // Columns that could grow keep their new size if another one fails
+    if (n <= flat->capacity) return 1;
+    int capacity = flat->capacity > 32 ? flat->capacity : 32;
+    while (capacity < n)
+    {
+        capacity *= 2;
+    }
+    int done = 1;
+    int** columns[] = { &flat->left, &flat->right, &flat->parent, &flat->frequency,
+                        &flat->depth, &flat->height };
+    for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+    {
+        int* temp = (int*)realloc(*columns[i], sizeof(int) * capacity);
+        if (temp == NULL) done = 0; else *columns[i] = temp;
+    }
+    size_t** wide_columns[] = { &flat->code_offset, &flat->name_offset, &flat->name_len };
+    for (size_t i = 0; i < sizeof(wide_columns) / sizeof(wide_columns[0]); i++)
+    {
+        size_t* temp = (size_t*)realloc(*wide_columns[i], sizeof(size_t) * capacity);
+        if (temp == NULL) done = 0; else *wide_columns[i] = temp;
+    }
+    unsigned char* shared = (unsigned char*)realloc(flat->name_shared, capacity);
+    if (shared == NULL) done = 0; else flat->name_shared = shared;
+    node** source = (node**)realloc(flat->source, sizeof(node*) * capacity);
+    if (source == NULL) done = 0; else flat->source = source;
+    struct DecodeTable** tables = (struct DecodeTable**)realloc(
+        flat->decode_tables, sizeof(struct DecodeTable*) * capacity);
+    if (tables == NULL)
+    {
+        done = 0;
+    } else {
+        memset(tables + flat->capacity, 0,
+               sizeof(struct DecodeTable*) * (capacity - flat->capacity));
+        flat->decode_tables = tables;
+    }
+    if (!done)
+    {
+        perror("Error on realloc flat tree");
+        return 0;
+    }
+    flat->capacity = capacity;
+    return 1;
+}
+
+int FLAT_TOUCH(SiblingOrder* order, node* src)
+{
+    // Helper function to list a node, its parent and its children as
+    // nodes whose flat entries need to be written again
+    return NODE_STACK_PUSH(&order->touched, src) &&
+           (src->parent == NULL || NODE_STACK_PUSH(&order->touched, src->parent)) &&
+           (src->left == NULL || (NODE_STACK_PUSH(&order->touched, src->left) &&
+                                  NODE_STACK_PUSH(&order->touched, src->right)));
+}
+
+void FLAT_SWAP_POSITIONS(FlatTree* flat, int pos_a, int pos_b)
+{
+    // Helper function to exchange two positions of the flat layout (either
+    // can be a hole left by a removed node, with no source). Only the
+    // entries move: the links that point at them are fixed by the caller
+    int* columns[] = { flat->left, flat->right, flat->parent, flat->frequency,
+                       flat->depth, flat->height };
+    for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+    {
+        int temp = columns[i][pos_a];
+        columns[i][pos_a] = columns[i][pos_b];
+        columns[i][pos_b] = temp;
+    }
+    size_t* wide_columns[] = { flat->code_offset, flat->name_offset, flat->name_len };
+    for (size_t i = 0; i < sizeof(wide_columns) / sizeof(wide_columns[0]); i++)
+    {
+        size_t temp = wide_columns[i][pos_a];
+        wide_columns[i][pos_a] = wide_columns[i][pos_b];
+        wide_columns[i][pos_b] = temp;
+    }
+    unsigned char shared = flat->name_shared[pos_a];
+    flat->name_shared[pos_a] = flat->name_shared[pos_b];
+    flat->name_shared[pos_b] = shared;
+    struct DecodeTable* table = flat->decode_tables[pos_a];
+    flat->decode_tables[pos_a] = flat->decode_tables[pos_b];
+    flat->decode_tables[pos_b] = table;
+    node* source = flat->source[pos_a];
+    flat->source[pos_a] = flat->source[pos_b];
+    flat->source[pos_b] = source;
+    if (flat->source[pos_a] != NULL) flat->source[pos_a]->data->flat_id = pos_a;
+    if (flat->source[pos_b] != NULL) flat->source[pos_b]->data->flat_id = pos_b;
+}
+
+int APPEND_LEAF_NAME(FlatTree* flat, node* leaf)
+{
+    // Helper function to add the name of a new leaf at the end of the name
+    // string (the slices of the other nodes stay where they are)
+    size_t len = leaf->data->name_len;
+    if (flat->names_used + len + 1 > flat->names_capacity)
+    {
+        size_t capacity = flat->names_capacity * 2;
+        while (capacity < flat->names_used + len + 1)
+        {
+            capacity *= 2;
+        }
+        char* temp = (char*)realloc(flat->names, capacity);
+        if (temp == NULL)
+        {
+            perror("Error on realloc flat names");
+            return 0;
+        }
+        flat->names = temp;
+        flat->names_capacity = capacity;
+    }
+    memcpy(flat->names + flat->names_used, leaf->data->name, len);
+    flat->name_offset[leaf->data->flat_id] = flat->names_used;
+    flat->names_used += len;
+    flat->names[flat->names_used] = '\0';
+    return 1;
+}
+
+int APPEND_LEAF_CODE(CodeTable* codes, node* leaf, int old_depth)
+{
+    // Helper function to write the new code of a leaf at the end of the
+    // code table. Its old code (old_depth bits) stays behind as stale bits
+    // until PACK_CODE_TABLE. Past CODE_TABLE_MAX_BITS the table is dropped
+    // and codes are read from the parent links
+    if (codes->bits == NULL) return 1;
+    codes->n_stale += old_depth;
+    size_t n_bits = codes->n_bits + leaf->data->depth;
+    if (n_bits > CODE_TABLE_MAX_BITS)
+    {
+        free(codes->bits);
+        memset(codes, 0, sizeof(CodeTable));
+        return 1;
+    }
+    // Words past the last code are kept 0, and one of them spare
+    if (n_bits / 64 + 2 > codes->capacity)
+    {
+        size_t capacity = codes->capacity * 2;
+        while (capacity < n_bits / 64 + 2)
+        {
+            capacity *= 2;
+        }
+        unsigned long long* temp = (unsigned long long*)realloc(
+            codes->bits, sizeof(unsigned long long) * capacity);
+        if (temp == NULL)
+        {
+            perror("Error on realloc code table");
+            return 0;
+        }
+        memset(temp + codes->capacity, 0,
+               sizeof(unsigned long long) * (capacity - codes->capacity));
+        codes->bits = temp;
+        codes->capacity = capacity;
+    }
+    STORE_LEAF_CODE(codes, leaf, codes->n_bits);
+    codes->n_bits = n_bits;
+    return 1;
+}
+
+void PACK_CODE_TABLE(Tree* final_tree)
+{
+    // Function to write the codes of all leaves back to back again, in
+    // the order of the leaf chain, without the stale bits of the updates
+    // Leaves keep the depth the layout gives them
+    CodeTable* codes = &final_tree->codes;
+    FlatTree* flat = &final_tree->flat;
+    if (!codes->mapped)
+    {
+        free(codes->bits);
+    }
+    memset(codes, 0, sizeof(CodeTable));
+    if (final_tree->root == NULL) return;
+    node* last = final_tree->root->data->last_leaf;
+    size_t total_bits = 0;
+    for (node* leaf = final_tree->root->data->first_leaf; ; leaf = leaf->next_leaf)
+    {
+        total_bits += leaf->data->depth;
+        if (leaf == last) break;
+    }
+    if (total_bits > CODE_TABLE_MAX_BITS) return;
+    codes->capacity = total_bits / 64 + 2;
+    codes->bits = (unsigned long long*)calloc(codes->capacity,
+                                              sizeof(unsigned long long));
+    if (codes->bits == NULL)
+    {
+        perror("Error on calloc code table");
+        codes->capacity = 0;
+        return;
+    }
+    for (node* leaf = final_tree->root->data->first_leaf; ; leaf = leaf->next_leaf)
+    {
+        STORE_LEAF_CODE(codes, leaf, codes->n_bits);
+        codes->n_bits += leaf->data->depth;
+        if (leaf->data->flat_id >= 0 && leaf->data->flat_id < flat->n)
+        {
+            flat->code_offset[leaf->data->flat_id] = leaf->data->code_offset;
+        }
+        if (leaf == last) break;
+    }
+}
+
+int LAY_OUT_TREE(Tree* final_tree)
+{
+    // Function to build the flat layout and the code table of the tree
+    // from scratch, with the preorder numbers and the fingerprint
+    // Returns 0 on error
+    FREE_LCA_INDEX(&final_tree->lca);
+    FREE_FLAT_TREE(&final_tree->flat);
+    if (!RENUMBER_TREE(final_tree) || !BUILD_FLAT_TREE(final_tree) ||
+        final_tree->flat.n == 0)
+    {
+        return 0;
+    }
+    PACK_CODE_TABLE(final_tree);
+    return 1;
+}
+
+int WALK_MOVED(Tree* final_tree, node* from)
+{
+    // Helper function for a subtree that moved as a whole: every node of it
+    // gets its new depth and every leaf its new code. The nodes are listed
+    // as touched, and the list doubles as the queue of the walk
+    NodeStack* touched = &final_tree->order.touched;
+    int start = touched->top;
+    if (!NODE_STACK_PUSH(touched, from)) return 0;
+    for (int i = start; i < touched->top; i++)
+    {
+        node* current = touched->items[i];
+        int old_depth = current->data->depth;
+        current->data->depth = current->parent == NULL ? 0 : current->parent->data->depth + 1;
+        if (current->left == NULL)
+        {
+            if (!APPEND_LEAF_CODE(&final_tree->codes, current, old_depth)) return 0;
+            continue;
+        }
+        if (!NODE_STACK_PUSH(touched, current->left) ||
+            !NODE_STACK_PUSH(touched, current->right))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int CHILD_MOVED(FlatTree* flat, node* parent, node* child)
+{
+    // Helper function: whether the code of a child of a changed node is
+    // not the one the flat layout has for it (parent is not moved)
+    int parent_id = parent->data->flat_id;
+    int child_id = child->data->flat_id;
+    if (parent_id == -1 || child_id == -1 || flat->parent[child_id] != parent_id)
+    {
+        return 1;
+    }
+    return (flat->left[parent_id] == child_id) != (parent->left == child);
+}
+
+int PATCH_FLAT_TREE(Tree* final_tree)
+{
+    // Function to bring the flat layout and the code table in line with a
+    // batch of updates, in time proportional to the changed paths and to
+    // the subtrees that moved. The changed nodes are listed from the root
+    // down (REFRESH_TREE). A node moved if its code is not the one it had:
+    // its depth is set again and a leaf gets its new code at the end of
+    // the code table. Removed nodes leave holes, which new nodes take
+    // first; the last positions then fill the rest, and the root goes back
+    // to position 0. Only the entries of changed, moved and displaced
+    // nodes are written again
+    // Returns 0 on error
+    FlatTree* flat = &final_tree->flat;
+    SiblingOrder* order = &final_tree->order;
+    NodeStack* changed = &order->path;
+    NodeStack* removed = &order->removed;
+    NodeStack* touched = &order->touched;
+    node* root = final_tree->root;
+    if (changed->top == 0 && removed->top == 0) return 1;
+    FREE_LCA_INDEX(&final_tree->lca);
+    if (flat->n == 0)
+    {
+        removed->top = 0;
+        return LAY_OUT_TREE(final_tree);
+    }
+    touched->top = 0;
+    // New codes: a changed node knows if it moved from its parent, which
+    // comes first in the list; unchanged subtrees that moved are walked
+    if (!root->data->changed && root->data->flat_id != 0 && !WALK_MOVED(final_tree, root))
+    {
+        return 0;
+    }
+    for (int i = 0; i < changed->top; i++)
+    {
+        node* current = changed->items[i];
+        if (current == root)
+        {
+            current->data->moved = current->data->flat_id != 0;
+        }
+        if (current->data->moved)
+        {
+            int old_depth = current->data->depth;
+            current->data->depth = current->parent == NULL ? 0 : current->parent->data->depth + 1;
+            if (current->left == NULL &&
+                !APPEND_LEAF_CODE(&final_tree->codes, current, old_depth))
+            {
+                return 0;
+            }
+        }
+        if (current->left == NULL) continue;
+        node* children[2] = { current->left, current->right };
+        for (int j = 0; j < 2; j++)
+        {
+            int moved = current->data->moved || CHILD_MOVED(flat, current, children[j]);
+            if (children[j]->data->changed)
+            {
+                children[j]->data->moved = moved;
+            } else if (moved && !WALK_MOVED(final_tree, children[j])) {
+                return 0;
+            }
+        }
+    }
+    // Removed nodes leave holes (their codes become stale)
+    int n_holes = 0;
+    for (int i = 0; i < removed->top; i++)
+    {
+        node* current = removed->items[i];
+        if (current->data->flat_id < 0) continue; // Added in the same batch
+        flat->source[current->data->flat_id] = NULL;
+        if (current->left == NULL && final_tree->codes.bits != NULL)
+        {
+            final_tree->codes.n_stale += current->data->depth;
+        }
+        // The hole is remembered in place of the node
+        removed->items[n_holes++] = current;
+    }
+    // New nodes take the holes first, then positions at the end
+    for (int i = 0; i < changed->top; i++)
+    {
+        node* current = changed->items[i];
+        if (current->data->flat_id != -1) continue;
+        int pos;
+        if (n_holes > 0)
+        {
+            pos = removed->items[--n_holes]->data->flat_id;
+        } else {
+            if (!FLAT_RESERVE(flat, flat->n + 1)) return 0;
+            pos = flat->n++;
+        }
+        flat->source[pos] = current;
+        flat->decode_tables[pos] = NULL;
+        current->data->flat_id = pos;
+        if (current->left == NULL && !APPEND_LEAF_NAME(flat, current)) return 0;
+    }
+    // The last positions fill the holes that are left
+    for (int i = 0; i < n_holes; i++)
+    {
+        int hole = removed->items[i]->data->flat_id;
+        while (flat->n > 0 && flat->source[flat->n - 1] == NULL)
+        {
+            flat->n--;
+        }
+        if (hole >= flat->n) continue;
+        FLAT_SWAP_POSITIONS(flat, hole, flat->n - 1);
+        flat->n--;
+        if (!FLAT_TOUCH(order, flat->source[hole])) return 0;
+    }
+    while (flat->n > 0 && flat->source[flat->n - 1] == NULL)
+    {
+        flat->n--;
+    }
+    removed->top = 0;
+    if (root->data->flat_id != 0)
+    {
+        node* first = flat->source[0];
+        FLAT_SWAP_POSITIONS(flat, 0, root->data->flat_id);
+        if (!FLAT_TOUCH(order, root) || !FLAT_TOUCH(order, first)) return 0;
+    }
+    // Entries are written again from the nodes. Leaves and unchanged
+    // internal nodes keep their slice of the name string; a changed
+    // internal node is named through its leaf chain
+    for (int k = 0; k < 2; k++)
+    {
+        NodeStack* list = k == 0 ? changed : touched;
+        for (int i = 0; i < list->top; i++)
+        {
+            node* current = list->items[i];
+            Item* data = current->data;
+            int pos = data->flat_id;
+            flat->parent[pos] = current->parent == NULL ? -1 : current->parent->data->flat_id;
+            flat->left[pos] = current->left == NULL ? -1 : current->left->data->flat_id;
+            flat->right[pos] = current->right == NULL ? -1 : current->right->data->flat_id;
+            flat->frequency[pos] = data->frequency;
+            flat->depth[pos] = data->depth;
+            flat->height[pos] = data->height;
+            flat->code_offset[pos] = data->code_offset;
+            flat->name_len[pos] = data->name_len;
+            flat->name_shared[pos] = (unsigned char)data->name_shared;
+            if (k == 0 && current->left != NULL)
+            {
+                flat->name_offset[pos] = FLAT_NO_NAME;
+            }
+        }
+    }
+    touched->top = 0;
+    flat->patched = 1;
+    // Removed and renamed leaves leave garbage behind: once it outweighs
+    // what is in use, the layout or the code table is built again
+    if (flat->names_used > 2 * root->data->name_len)
+    {
+        return LAY_OUT_TREE(final_tree);
+    }
+    if (final_tree->codes.n_stale > final_tree->codes.n_bits / 2)
+    {
+        PACK_CODE_TABLE(final_tree);
+    }
+    return 1;
+}
+
+int REFRESH_TREE(Tree* final_tree)
+{
+    // Function to finish a batch in time proportional to its changes.
+    // The ancestors of a changed node are changed too, so the changed
+    // nodes are listed from the root down. Walking the list backwards,
+    // children before parents, every changed node gets its children back
+    // in NODE_CMP order, hence the name and height a rebuild would give
+    // it, and is indexed again under that name. PATCH_FLAT_TREE then
+    // patches the flat layout and the code table
+    SiblingOrder* order = &final_tree->order;
+    if (final_tree->root == NULL)
+    {
+        // The last satellite was removed
+        if (!final_tree->codes.mapped)
+        {
+            free(final_tree->codes.bits);
+        }
+        memset(&final_tree->codes, 0, sizeof(CodeTable));
+        FREE_LCA_INDEX(&final_tree->lca);
+        FREE_FLAT_TREE(&final_tree->flat);
+        order->removed.top = 0;
+        return RENUMBER_TREE(final_tree);
+    }
+    NodeStack* changed = &order->path;
+    changed->top = 0;
+    if (final_tree->root->data->changed &&
+        !NODE_STACK_PUSH(changed, final_tree->root))
+    {
+        return 0;
+    }
+    for (int i = 0; i < changed->top; i++)
+    {
+        node* current = changed->items[i];
+        if (current->left == NULL) continue;
+        if ((current->left->data->changed && !NODE_STACK_PUSH(changed, current->left)) ||
+            (current->right->data->changed && !NODE_STACK_PUSH(changed, current->right)))
+        {
+            return 0;
+        }
+    }
+    for (int i = 0; i < changed->top; i++)
+    {
+        if (changed->items[i]->left != NULL)
+        {
+            UNINDEX_NODE(final_tree, changed->items[i]);
+        }
+    }
+    for (int i = changed->top - 1; i >= 0; i--)
+    {
+        node* current = changed->items[i];
+        if (current->left == NULL) continue;
+        SORT_CHILDREN(current);
+        INDEX_INSERT(&final_tree->index, current);
+    }
+    final_tree->root->data->last_leaf->next_leaf = NULL;
+    // A shared name that left the index needs the preorder to find the
+    // node that keeps its entry, which takes a walk of the whole tree
+    int done = (!order->lost_shared || RENUMBER_TREE(final_tree)) &&
+               PATCH_FLAT_TREE(final_tree);
+    for (int i = 0; i < changed->top; i++)
+    {
+        changed->items[i]->data->changed = 0;
+        changed->items[i]->data->moved = 0;
+    }
+    return done;
+}
+
+int NEED_FLAT_TREE(Tree* final_tree)
+{
+    // Function to lay a patched tree out breadth-first again, for the
+    // outputs that follow the positions (the levels of task 1, -cc and
+    // snapshots), with the preorder numbers and fingerprint. Queries do
+    // not need it
+    // Returns 0 on error
+    if (final_tree->root == NULL || !final_tree->flat.patched) return 1;
+    return LAY_OUT_TREE(final_tree);
+}
+
+int APPLY_UPDATES(Tree* final_tree, Scanner* input, int n_updates, FILE* log)
+{
+    // Main function for one batch of updates (n_updates < 0 reads until
+    // the input ends). Errors are written to log; returns the number of
+    // updates applied, or -1 if the tree could not be refreshed
+    if (!NEED_TREE_NODES(final_tree))
+    {
+        fprintf(log, "[ERROR] The snapshot tree could not be built\n");
+        return -1;
+    }
+    if (final_tree->root != NULL && final_tree->index.slots == NULL)
+    {
+        fprintf(log, "[ERROR] The tree index could not be built\n");
+        return -1;
+    }
+    if (final_tree->order.nodes == NULL && !BUILD_SIBLING_ORDER(final_tree, log))
+    {
+        return 0;
+    }
+    int applied = 0;
+    for (int i = 0; n_updates < 0 || i < n_updates; i++)
+    {
+        const char* op;
+        const char* name;
+        int frequency = 0;
+        size_t op_len = SCAN_TOKEN(input, &op);
+        if (op_len == 0) break;
+        size_t len = SCAN_TOKEN(input, &name);
+        if (op_len != 1 || strchr("+-=", op[0]) == NULL || len == 0 ||
+            (op[0] != '-' && !SCAN_INT(input, &frequency)))
+        {
+            fprintf(log, "[ERROR] Update %d should be + NAME FREQ, - NAME or = NAME FREQ\n",
+                    i + 1);
+            break;
+        }
+        if (frequency < 0)
+        {
+            fprintf(log, "[ERROR] Frequency of %.*s should not be negative\n", (int)len, name);
+            continue;
+        }
+        node* leaf = FIND_UPDATE_LEAF(final_tree, name, len);
+        if (op[0] == '+' && leaf != NULL)
+        {
+            fprintf(log, "[ERROR] Satellite %.*s is already in the tree\n", (int)len, name);
+            continue;
+        }
+        if (op[0] != '+' && leaf == NULL)
+        {
+            fprintf(log, "[ERROR] Satellite %.*s is not in the tree\n", (int)len, name);
+            continue;
+        }
+        if (op[0] == '+')
+        {
+            leaf = ADD_SATELLITE(final_tree, name, len);
+        }
+        int done = leaf != NULL;
+        if (done && op[0] == '-')
+        {
+            done = REMOVE_SATELLITE(final_tree, leaf);
+        } else if (done) {
+            done = SET_FREQUENCY(final_tree, leaf, frequency);
+        }
+        if (!done)
+        {
+            fprintf(log, "[ERROR] Update of %.*s could not be applied\n", (int)len, name);
+            break;
+        }
+        applied++;
+    }
+    if (!REFRESH_TREE(final_tree))
+    {
+        return -1;
+    }
+    return applied;
+}
+
+int PROCEED_UPDATES(Tree* final_tree, const char* path)
+{
+    // Main function for -u: applies every batch of an update file
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("Error on opening update file");
+        return 0;
+    }
+    Scanner updates;
+    int done = SCANNER_OPEN(&updates, file);
+    int n_updates;
+    while (done && SCAN_INT(&updates, &n_updates))
+    {
+        done = APPLY_UPDATES(final_tree, &updates, n_updates, stdout) >= 0;
+    }
+    SCANNER_CLOSE(&updates);
+    fclose(file);
+    return done && NEED_FLAT_TREE(final_tree);
+}
+
+// Query server (-serve)
+// The tree is built once, then requests are answered until the input
+// ends or a QUIT request arrives. A request is one line: a task followed
+// by the items of its input, e.g. "-c3 S01 S02" or "-c2 0101 110"
+// ("-c5 A B C D" asks for the distances A-B and C-D, without grafts).
+// The answer is one line: the output of the task, its lines separated by
+// tabs (one per path for -c2). Requests come from stdin (answers go to
+// stdout) or, when ENDPOINT is not "-", from clients of a Unix socket
+#define SERVE_BACKLOG 16
+
+void SERVE_REPLY(const char* text, size_t len, FILE* reply)
+{
+    // Helper function to write the output of a task as one line
+    // Runs of spaces are collapsed and each output line becomes a field
+    if (len > 0 && text[len - 1] == '\n') len--;
+    int pending_space = 0, field_start = 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '\n')
+        {
+            fputc('\t', reply);
+            pending_space = 0;
+            field_start = 1;
+        } else if (text[i] == ' ') {
+            pending_space = !field_start;
+        } else {
+            if (pending_space) fputc(' ', reply);
+            fputc(text[i], reply);
+            pending_space = 0;
+            field_start = 0;
+        }
+    }
+    fputc('\n', reply);
+    fflush(reply);
+}
+
+int SERVE_UPDATES(Tree* final_tree, const char* updates, FILE* reply)
+{
+    // Function to answer a "-u" request: the rest of the line is one batch
+    // of updates. The reply holds the errors, then "OK" and the number of
+    // updates applied. Returns 0 when the tree could not be refreshed
+    char* answer = NULL;
+    size_t answer_size = 0;
+    FILE* out_file = open_memstream(&answer, &answer_size);
+    if (out_file == NULL)
+    {
+        perror("Error on opening request stream");
+        return 0;
+    }
+    Scanner input;
+    SCANNER_FROM_TEXT(&input, updates, strlen(updates));
+    int applied = APPLY_UPDATES(final_tree, &input, -1, out_file);
+    if (applied >= 0)
+    {
+        fprintf(out_file, "OK %d\n", applied);
+    }
+    fclose(out_file);
+    SERVE_REPLY(answer, answer_size, reply);
+    free(answer);
+    return applied >= 0;
+}
+
+int SERVE_REQUEST(Tree* final_tree, char* line, FILE* reply, int decode_bits)
+{
+    // Function to answer one request line
+    // The items are rewritten as the input file of the task ("count" and
+    // one item per line), so the task functions are used unchanged
+    // Returns 0 when the server should stop
+    size_t line_len = strlen(line);
+    char* save = NULL;
+    char* task = strtok_r(line, " \t\r\n", &save);
+    if (task == NULL)
+    {
+        SERVE_REPLY("", 0, reply);
+        return 1;
+    }
+    if (strcmp(task, "QUIT") == 0) return 0;
+    if (strcmp(task, "-u") == 0)
+    {
+        return SERVE_UPDATES(final_tree, save, reply);
+    }
+    if (strcmp(task, "-c2") != 0 && strcmp(task, "-c3") != 0 &&
+        strcmp(task, "-c4") != 0 && strcmp(task, "-c5") != 0)
+    {
+        fprintf(reply, "[ERROR] Unknown request %s\n", task);
+        fflush(reply);
+        return 1;
+    }
+    // Every item ends a token, so a line has at most len / 2 + 1 items
+    char** tokens = (char**)malloc(sizeof(char*) * (line_len / 2 + 1));
+    char* items = NULL;
+    size_t items_size = 0;
+    FILE* items_file = open_memstream(&items, &items_size);
+    if (tokens == NULL || items_file == NULL)
+    {
+        perror("Error on malloc request");
+        free(tokens);
+        if (items_file != NULL) fclose(items_file);
+        free(items);
+        return 0;
+    }
+    int n_items = 0;
+    for (char* it = strtok_r(NULL, " \t\r\n", &save); it != NULL;
+         it = strtok_r(NULL, " \t\r\n", &save))
+    {
+        tokens[n_items++] = it;
+    }
+    // Task 5 starts with its number of grafts (none) and reads pairs until
+    // the input ends
+    fprintf(items_file, "%d\n", strcmp(task, "-c5") == 0 ? 0 : n_items);
+    for (int i = 0; i < n_items; i++)
+    {
+        fprintf(items_file, "%s\n", tokens[i]);
+    }
+    fclose(items_file);
+    free(tokens);
+    char* answer = NULL;
+    size_t answer_size = 0;
+    Scanner input;
+    SCANNER_FROM_TEXT(&input, items, items_size);
+    FILE* out_file = open_memstream(&answer, &answer_size);
+    if (out_file == NULL)
+    {
+        perror("Error on opening request stream");
+        free(items);
+        return 0;
+    }
+    if (strcmp(task, "-c2") == 0)
+    {
+        PROCEED_TASK_2(final_tree, &input, out_file, decode_bits);
+    } else if (strcmp(task, "-c3") == 0) {
+        PROCEED_TASK_3(final_tree, &input, out_file);
+    } else if (strcmp(task, "-c4") == 0) {
+        PROCEED_TASK_4(final_tree, &input, out_file);
+    } else {
+        PROCEED_TASK_5(final_tree, &input, out_file);
+    }
+    fclose(out_file);
+    SERVE_REPLY(answer, answer_size, reply);
+    free(items);
+    free(answer);
+    return 1;
+}
+
+int SERVE_STREAM(Tree* final_tree, FILE* requests, FILE* reply, int decode_bits)
+{
+    // Function to answer the requests of one stream until it ends
+    // Returns 0 if a QUIT request was read
+    char* line = NULL;
+    size_t line_cap = 0;
+    int running = 1;
+    while (running && getline(&line, &line_cap, requests) != -1)
+    {
+        running = SERVE_REQUEST(final_tree, line, reply, decode_bits);
+    }
+    free(line);
+    return running;
+}
+
+void PROCEED_SERVE(Tree* final_tree, const char* endpoint, int decode_bits)
+{
+    // Main function for -serve
+    if (strcmp(endpoint, "-") == 0)
+    {
+        SERVE_STREAM(final_tree, stdin, stdout, decode_bits);
+        return;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(endpoint) >= sizeof(address.sun_path))
+    {
+        printf("[ERROR] Socket path %s is too long\n", endpoint);
+        return;
+    }
+    strcpy(address.sun_path, endpoint);
+    // A socket left by an earlier server is replaced, anything else is kept
+    struct stat info;
+    if (lstat(endpoint, &info) == 0)
+    {
+        if (!S_ISSOCK(info.st_mode))
+        {
+            printf("[ERROR] %s exists and is not a socket\n", endpoint);
+            return;
+        }
+        unlink(endpoint);
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0)
+    {
+        perror("Error on socket");
+        return;
+    }
+    if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server, SERVE_BACKLOG) != 0)
+    {
+        perror("Error on binding socket");
+        close(server);
+        return;
+    }
+    // A client that leaves early must not stop the server
+    signal(SIGPIPE, SIG_IGN);
+    int running = 1;
+    while (running)
+    {
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+        {
+            perror("Error on accept");
+            break;
+        }
+        // Clients are served one at a time, each until it disconnects
+        int client_out = dup(client);
+        FILE* requests = fdopen(client, "r");
+        FILE* reply = client_out >= 0 ? fdopen(client_out, "w") : NULL;
+        if (requests == NULL || reply == NULL)
+        {
+            perror("Error on fdopen client");
+            if (requests != NULL) fclose(requests); else close(client);
+            if (reply != NULL) fclose(reply); else if (client_out >= 0) close(client_out);
+            continue;
+        }
+        running = SERVE_STREAM(final_tree, requests, reply, decode_bits);
+        fclose(requests);
+        fclose(reply);
+    }
+    close(server);
+    unlink(endpoint);
+}
+
+void FREE_TREE(Tree* final_tree)
+{
+    // Helper function to free the tree memory
+    // Every node, item and name lives in the pool, so there is
+    // no need to walk the tree
+    if (final_tree == NULL) return;
+    FREE_TREE_INDEX(final_tree);
+    FREE_LCA_INDEX(&final_tree->lca);
+    FREE_FLAT_TREE(&final_tree->flat);
+    FREE_SIBLING_ORDER(&final_tree->order);
+    FREE_NODE_POOL(&final_tree->pool);
+    if (final_tree->snapshot.base != NULL)
+    {
+        munmap(final_tree->snapshot.base, final_tree->snapshot.size);
+    }
+    free(final_tree);
+}
+
+// Block compression (-compress, -decompress)
+// Any file is cut into blocks of COMPRESS_BLOCK_SIZE bytes. Every block
+// gets its own tree, built from its byte frequencies by the same code as
+// the satellites (the 256 byte values are leaves named by their hex
+// value), so blocks are coded and decoded independently, in parallel:
+//   bytes 0..3    magic "SATZ"
+//   bytes 4..7    format version
+//   bytes 8..15   size of the original file
+//   bytes 16..19  block size
+//   bytes 20..23  number of blocks
+//   then the compressed size of every block (8 bytes each) and the blocks
+// A COMPRESS_CODED block holds the code lengths of the 256 byte values
+// (4 bits each, 0 for values that do not occur) followed by the canonical
+// codes of its bytes, first bit in the lowest position. A block that
+// would not get smaller is COMPRESS_STORED as it is. All numbers are
+// little endian
+#define COMPRESS_MAGIC "SATZ"
+#define COMPRESS_VERSION 1
+#define COMPRESS_HEADER_SIZE 24
+#define COMPRESS_BLOCK_SIZE (1 << 20)
+#define COMPRESS_MAX_BITS 12 // Longest code; one decode lookup covers it
+#define COMPRESS_TABLE_SIZE 128 // 256 code lengths of 4 bits
+#define COMPRESS_STORED 0
+#define COMPRESS_CODED 1
+
+typedef struct CompressBatch
+{
+    // Blocks shared by the threads of -compress and -decompress
+    int decompress;
+    const unsigned char* input; // -compress: the original file
+    unsigned char* output; // -decompress: the original file
+    size_t original_size;
+    size_t block_size;
+    int n_blocks;
+    int next_block; // Taken with an atomic add
+    unsigned char** block_data; // Compressed blocks (views into the input
+                                // when decompressing)
+    size_t* block_bytes;
+    int failed;
+} CompressBatch;
+
+int COMPRESS_CODE_LENGTHS(const unsigned char* src, size_t size, Heap* min_heap,
+                          unsigned char* lengths)
+{
+    // Function to get the code length of every byte value of a block
+    // The leaves are ranked and built into a tree by CONSTRUCT_HEAP and
+    // CONSTRUCT_TREE, like the satellites; lengths are the leaf depths, or
+    // come from PACKAGE_MERGE when the tree is deeper than COMPRESS_MAX_BITS
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < size; i++)
+    {
+        counts[src[i]]++;
+    }
+    Tree block_tree;
+    memset(&block_tree, 0, sizeof(Tree));
+    INIT_NODE_POOL(&block_tree.pool, 2 * 256 - 1);
+    node* leaves[256];
+    int n = 0;
+    for (int value = 0; value < 256; value++)
+    {
+        lengths[value] = 0;
+        if (counts[value] == 0) continue;
+        char name[3];
+        snprintf(name, sizeof(name), "%02x", value);
+        char* stored = POOL_STORE_NAME(&block_tree.pool, name, 2);
+        leaves[n] = stored == NULL ? NULL :
+                    CREATE_LEAF_NODE(&block_tree.pool, stored, (int)counts[value]);
+        if (leaves[n] == NULL)
+        {
+            FREE_NODE_POOL(&block_tree.pool);
+            return 0;
+        }
+        n++;
+    }
+    if (n == 1)
+    {
+        // A lone byte value still needs one bit
+        lengths[strtol(leaves[0]->data->name, NULL, 16)] = 1;
+        FREE_NODE_POOL(&block_tree.pool);
+        return 1;
+    }
+    RANK_LEAF_NAMES(leaves, n);
+    CONSTRUCT_HEAP(min_heap, leaves, n);
+    CONSTRUCT_TREE(min_heap, &block_tree);
+    min_heap->n_nodes = 0;
+    if (block_tree.root == NULL)
+    {
+        FREE_NODE_POOL(&block_tree.pool);
+        return 0;
+    }
+    CodeEntry entries[256];
+    int height = 0;
+    for (int i = 0; i < n; i++)
+    {
+        entries[i].name = leaves[i]->data->name;
+        entries[i].name_len = leaves[i]->data->name_len;
+        entries[i].frequency = leaves[i]->data->frequency;
+        entries[i].order = i;
+        entries[i].length = 0;
+        for (node* it = leaves[i]; it->parent != NULL; it = it->parent)
+        {
+            entries[i].length++;
+        }
+        height = GET_MAX(height, entries[i].length);
+    }
+    int done = 1;
+    if (height > COMPRESS_MAX_BITS)
+    {
+        qsort(entries, n, sizeof(CodeEntry), CODE_ENTRY_BY_WEIGHT);
+        done = PACKAGE_MERGE(entries, n, COMPRESS_MAX_BITS);
+    }
+    for (int i = 0; i < n && done; i++)
+    {
+        lengths[strtol(entries[i].name, NULL, 16)] =
+            (unsigned char)entries[i].length;
+    }
+    FREE_NODE_POOL(&block_tree.pool);
+    return done;
+}
+
+int COMPRESS_CANONICAL(const unsigned char* lengths, unsigned int* codes)
+{
+    // Function to give canonical codes to the byte values: by length, then
+    // by value, like the -cc code book. Codes are stored bit-reversed, as
+    // the first bit goes to the lowest position. Returns 0 if the lengths
+    // do not form a prefix code
+    int count[COMPRESS_MAX_BITS + 1] = {0};
+    for (int value = 0; value < 256; value++)
+    {
+        if (lengths[value] > COMPRESS_MAX_BITS) return 0;
+        count[lengths[value]]++;
+    }
+    count[0] = 0;
+    unsigned int next[COMPRESS_MAX_BITS + 1];
+    unsigned int code = 0;
+    for (int len = 1; len <= COMPRESS_MAX_BITS; len++)
+    {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (int value = 0; value < 256; value++)
+    {
+        int len = lengths[value];
+        codes[value] = 0;
+        if (len == 0) continue;
+        code = next[len]++;
+        if (code >= (1u << len)) return 0;
+        for (int bit = 0; bit < len; bit++)
+        {
+            codes[value] |= ((code >> bit) & 1) << (len - 1 - bit);
+        }
+    }
+    return 1;
+}
+
+size_t COMPRESS_BLOCK(const unsigned char* src, size_t size, Heap* min_heap,
+                      unsigned char* dest)
+{
+    // Function to compress one block into dest (room for
+    // 1 + COMPRESS_TABLE_SIZE + size + 8 bytes)
+    // Returns the number of bytes written, 0 on error
+    unsigned char lengths[256];
+    unsigned int codes[256];
+    if (!COMPRESS_CODE_LENGTHS(src, size, min_heap, lengths) ||
+        !COMPRESS_CANONICAL(lengths, codes))
+    {
+        return 0;
+    }
+    unsigned long long n_bits = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        n_bits += lengths[src[i]];
+    }
+    size_t coded_size = 1 + COMPRESS_TABLE_SIZE + (size_t)((n_bits + 7) / 8);
+    if (coded_size >= 1 + size)
+    {
+        dest[0] = COMPRESS_STORED;
+        memcpy(dest + 1, src, size);
+        return 1 + size;
+    }
+    dest[0] = COMPRESS_CODED;
+    for (int value = 0; value < 256; value += 2)
+    {
+        dest[1 + value / 2] = (unsigned char)(lengths[value] | lengths[value + 1] << 4);
+    }
+    // Codes are gathered in a 64-bit accumulator and written 32 bits at a time
+    unsigned char* out = dest + 1 + COMPRESS_TABLE_SIZE;
+    unsigned long long acc = 0;
+    int n_acc = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        acc |= (unsigned long long)codes[src[i]] << n_acc;
+        n_acc += lengths[src[i]];
+        if (n_acc >= 32)
+        {
+            STORE_U64_LE(out, acc, 4);
+            out += 4;
+            acc >>= 32;
+            n_acc -= 32;
+        }
+    }
+    for (; n_acc > 0; n_acc -= 8)
+    {
+        *out++ = (unsigned char)acc;
+        acc >>= 8;
+    }
+    return coded_size;
+}
+
+int DECOMPRESS_BLOCK(const unsigned char* src, size_t size, unsigned char* dest,
+                     size_t original_size)
+{
+    // Function to decode one block into original_size bytes
+    // Each step looks the next COMPRESS_MAX_BITS bits up in a table that
+    // gives the byte value and the length of its code. Returns 0 if the
+    // block is damaged
+    if (size < 1) return 0;
+    if (src[0] == COMPRESS_STORED)
+    {
+        if (size - 1 != original_size) return 0;
+        memcpy(dest, src + 1, original_size);
+        return 1;
+    }
+    if (src[0] != COMPRESS_CODED || size < 1 + COMPRESS_TABLE_SIZE) return 0;
+    unsigned char lengths[256];
+    unsigned int codes[256];
+    for (int value = 0; value < 256; value += 2)
+    {
+        lengths[value] = src[1 + value / 2] & 15;
+        lengths[value + 1] = src[1 + value / 2] >> 4;
+    }
+    if (!COMPRESS_CANONICAL(lengths, codes)) return 0;
+    unsigned short table[1 << COMPRESS_MAX_BITS] = {0}; // length << 8 | value
+    for (int value = 0; value < 256; value++)
+    {
+        int len = lengths[value];
+        if (len == 0) continue;
+        for (unsigned int k = codes[value]; k < (1u << COMPRESS_MAX_BITS); k += 1u << len)
+        {
+            table[k] = (unsigned short)(len << 8 | value);
+        }
+    }
+    const unsigned char* payload = src + 1 + COMPRESS_TABLE_SIZE;
+    size_t payload_size = size - 1 - COMPRESS_TABLE_SIZE;
+    size_t pos = 0, i = 0;
+    unsigned long long acc = 0;
+    int n_acc = 0;
+    // Fast path: a refill loads 8 bytes and keeps the whole bytes that fit
+    // (at least 56 bits), enough for four codes. The bits loaded past them
+    // are loaded again, at the same place, by the next refill
+    while (i + 4 <= original_size && pos + 8 <= payload_size)
+    {
+        acc |= LOAD_U64_LE(payload + pos, 8) << n_acc;
+        pos += (63 - n_acc) / 8;
+        n_acc |= 56;
+        for (int k = 0; k < 4; k++)
+        {
+            unsigned short entry = table[acc & ((1u << COMPRESS_MAX_BITS) - 1)];
+            int len = entry >> 8;
+            if (len == 0) return 0;
+            dest[i++] = (unsigned char)entry;
+            acc >>= len;
+            n_acc -= len;
+        }
+    }
+    for (; i < original_size; i++)
+    {
+        while (n_acc <= 56 && pos < payload_size)
+        {
+            acc |= (unsigned long long)payload[pos++] << n_acc;
+            n_acc += 8;
+        }
+        unsigned short entry = table[acc & ((1u << COMPRESS_MAX_BITS) - 1)];
+        int len = entry >> 8;
+        if (len == 0 || len > n_acc) return 0;
+        dest[i] = (unsigned char)entry;
+        acc >>= len;
+        n_acc -= len;
+    }
+    return 1;
+}
+
+void* COMPRESS_WORKER(void* arg)
+{
+    // Function run by every thread until no block is left
+    CompressBatch* batch = (CompressBatch*)arg;
+    Heap* min_heap = NULL;
+    if (!batch->decompress)
+    {
+        INIT_HEAP(&min_heap);
+        if (min_heap == NULL || min_heap->data_arr == NULL)
+        {
+            FREE_HEAP(min_heap);
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    int block;
+    while ((block = __atomic_fetch_add(&batch->next_block, 1, __ATOMIC_RELAXED))
+           < batch->n_blocks)
+    {
+        size_t first = (size_t)block * batch->block_size;
+        size_t size = batch->original_size - first < batch->block_size ?
+                      batch->original_size - first : batch->block_size;
+        int done;
+        if (batch->decompress)
+        {
+            done = DECOMPRESS_BLOCK(batch->block_data[block], batch->block_bytes[block],
+                                    batch->output + first, size);
+        } else {
+            batch->block_data[block] =
+                (unsigned char*)malloc(1 + COMPRESS_TABLE_SIZE + size + 8);
+            batch->block_bytes[block] = batch->block_data[block] == NULL ? 0 :
+                COMPRESS_BLOCK(batch->input + first, size, min_heap, batch->block_data[block]);
+            done = batch->block_bytes[block] > 0;
+        }
+        if (!done)
+        {
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    FREE_HEAP(min_heap);
+    return NULL;
+}
+
+void COMPRESS_RUN(CompressBatch* batch, int n_threads)
+{
+    // Function to work through the blocks with n_threads threads (0 means
+    // one per core); the calling thread works too
+    if (n_threads < 1)
+    {
+        long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cores < 1 ? 1 : (int)GET_MIN_INT((int)n_cores, BATCH_MAX_THREADS);
+    }
+    n_threads = GET_MIN_INT(n_threads, GET_MAX(batch->n_blocks, 1));
+    pthread_t threads[BATCH_MAX_THREADS];
+    int n_started = 0;
+    for (int i = 1; i < n_threads; i++)
+    {
+        if (pthread_create(&threads[n_started], NULL, COMPRESS_WORKER, batch) != 0)
+        {
+            break;
+        }
+        n_started++;
+    }
+    COMPRESS_WORKER(batch);
+    for (int i = 0; i < n_started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int PROCEED_COMPRESS(FILE* in_file, FILE* out_file, int n_threads)
+{
+    // Main function for -compress
+    Scanner input;
+    if (!SCANNER_OPEN(&input, in_file))
+    {
+        return 0;
+    }
+    CompressBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.input = (const unsigned char*)input.text + input.pos;
+    batch.original_size = input.size - input.pos;
+    batch.block_size = COMPRESS_BLOCK_SIZE;
+    batch.n_blocks = (int)((batch.original_size + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE);
+    batch.block_data = (unsigned char**)calloc(batch.n_blocks + 1, sizeof(unsigned char*));
+    batch.block_bytes = (size_t*)calloc(batch.n_blocks + 1, sizeof(size_t));
+    if (batch.block_data == NULL || batch.block_bytes == NULL)
+    {
+        perror("Error on malloc compressed blocks");
+        free(batch.block_data);
+        free(batch.block_bytes);
+        SCANNER_CLOSE(&input);
+        return 0;
+    }
+    STATS_COUNT(queries, batch.n_blocks);
+    COMPRESS_RUN(&batch, n_threads);
+    int done = !batch.failed;
+    if (done)
+    {
+        unsigned char header[COMPRESS_HEADER_SIZE];
+        memcpy(header, COMPRESS_MAGIC, 4);
+        STORE_U64_LE(header + 4, COMPRESS_VERSION, 4);
+        STORE_U64_LE(header + 8, batch.original_size, 8);
+        STORE_U64_LE(header + 16, batch.block_size, 4);
+        STORE_U64_LE(header + 20, batch.n_blocks, 4);
+        done = fwrite(header, 1, COMPRESS_HEADER_SIZE, out_file) == COMPRESS_HEADER_SIZE;
+        for (int block = 0; block < batch.n_blocks && done; block++)
+        {
+            unsigned char bytes[8];
+            STORE_U64_LE(bytes, batch.block_bytes[block], 8);
+            done = fwrite(bytes, 1, 8, out_file) == 8;
+        }
+        for (int block = 0; block < batch.n_blocks && done; block++)
+        {
+            done = fwrite(batch.block_data[block], 1, batch.block_bytes[block],
+                          out_file) == batch.block_bytes[block];
+        }
+        if (!done)
+        {
+            perror("Error on writing compressed file");
+        }
+    } else {
+        printf("[ERROR] Could not compress the input\n");
+    }
+    for (int block = 0; block < batch.n_blocks; block++)
+    {
+        free(batch.block_data[block]);
+    }
+    free(batch.block_data);
+    free(batch.block_bytes);
+    SCANNER_CLOSE(&input);
+    return done;
+}
+
+int PROCEED_DECOMPRESS(FILE* in_file, FILE* out_file, int n_threads)
+{
+    // Main function for -decompress
+    // The sizes in the directory give the position of every block, so all
+    // blocks are decoded at once into the original file
+    Scanner input;
+    if (!SCANNER_OPEN(&input, in_file))
+    {
+        return 0;
     }
-    for (int i = 0; i < n_satellites; i++)
+    const unsigned char* data = (const unsigned char*)input.text + input.pos;
+    size_t size = input.size - input.pos;
+    CompressBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.decompress = 1;
+    int valid = size >= COMPRESS_HEADER_SIZE && memcmp(data, COMPRESS_MAGIC, 4) == 0 &&
+                LOAD_U64_LE(data + 4, 4) == COMPRESS_VERSION;
+    if (valid)
     {
-        fscanf(in_file, "%s", buff); // Read node name
-        node_arr[i] = GET_NODE(final_tree->root, buff); // Search for it in the tree and store the pointer
+        batch.original_size = LOAD_U64_LE(data + 8, 8);
+        batch.block_size = LOAD_U64_LE(data + 16, 4);
+        batch.n_blocks = (int)LOAD_U64_LE(data + 20, 4);
+        valid = batch.block_size > 0 && batch.n_blocks >= 0 &&
+                (size - COMPRESS_HEADER_SIZE) / 8 >= (size_t)batch.n_blocks &&
+                (batch.n_blocks == 0 ? batch.original_size == 0 :
+                 (batch.original_size - 1) / batch.block_size + 1 == (size_t)batch.n_blocks);
     }
-    // Lowest Common Ancestor algorithm
-    node* top_node = node_arr[0]; // Set the first node as the initial ancestor
-    for (int i = 1; i < n_satellites; i++)
+    if (!valid)
     {
-        // For n nodes, call the helper function LOWEST_COMMON_NODE
-        // It takes the current ancestor and the i-th node from the array
-        // and tries to find their common ancestor
-        top_node = LOWEST_COMMON_NODE(final_tree->root, top_node, node_arr[i]);
+        printf("[ERROR] Input is not a compressed file\n");
+        SCANNER_CLOSE(&input);
+        return 0;
     }
-    fprintf(out_file, "%s", top_node->data->name); // Print the result
-    free(node_arr);
+    batch.block_data = (unsigned char**)calloc(batch.n_blocks + 1, sizeof(unsigned char*));
+    batch.block_bytes = (size_t*)calloc(batch.n_blocks + 1, sizeof(size_t));
+    batch.output = (unsigned char*)malloc(batch.original_size + 1);
+    if (batch.block_data == NULL || batch.block_bytes == NULL || batch.output == NULL)
+    {
+        perror("Error on malloc decompressed file");
+        free(batch.block_data);
+        free(batch.block_bytes);
+        free(batch.output);
+        SCANNER_CLOSE(&input);
+        return 0;
+    }
+    size_t offset = COMPRESS_HEADER_SIZE + (size_t)batch.n_blocks * 8;
+    for (int block = 0; block < batch.n_blocks && valid; block++)
+    {
+        batch.block_bytes[block] = LOAD_U64_LE(data + COMPRESS_HEADER_SIZE + 8 * block, 8);
+        batch.block_data[block] = (unsigned char*)data + offset;
+        valid = batch.block_bytes[block] <= size - offset;
+        offset += batch.block_bytes[block];
+    }
+    if (valid)
+    {
+        STATS_COUNT(queries, batch.n_blocks);
+        COMPRESS_RUN(&batch, n_threads);
+        valid = !batch.failed;
+    }
+    if (valid)
+    {
+        if (fwrite(batch.output, 1, batch.original_size, out_file) != batch.original_size)
+        {
+            perror("Error on writing decompressed file");
+            valid = 0;
+        }
+    } else {
+        printf("[ERROR] Compressed file is damaged\n");
+    }
+    free(batch.block_data);
+    free(batch.block_bytes);
+    free(batch.output);
+    SCANNER_CLOSE(&input);
+    return valid;
+}
+
+// Batch of constellations (-batch)
+// IN_FILE holds many constellations, each one a header line followed by
+// the usual input of its task (satellites, then the task part):
+//   @ NAME TASK
+// where TASK is -c1 .. -c5 and NAME is made of letters, digits, '.', '_'
+// and '-' (a line that starts with '@' always begins a new constellation).
+// IN_FILE can also be a directory: its files are read in name order, and
+// each of them must start with its own header line (a constellation does
+// not continue into the next file). OUT_FILE is a directory; the output of
+// constellation NAME is written to NAME.out and one "NAME TASK ok|error"
+// line per constellation, in input order, to batch.summary. "ok" means the
+// tree was built, the task answered every query (names that are not in
+// the tree are skipped, as in a single run) and NAME.out was written. Constellations are built
+// and answered by a pool of workers, one at a time per worker, and start in
+// input order once their estimated memory fits the budget (-m), so a few
+// large constellations cannot run out of memory together
+#define BATCH_NAME_MAX 128
+#define BATCH_SATELLITE_BYTES 512 // Estimated memory of a tree per satellite
+#define BATCH_DEFAULT_MEMORY_MB 1024
+#define BATCH_SUMMARY "batch.summary"
+
+typedef struct Constellation
+{
+    const char* name; // View into the input
+    size_t name_len;
+    int task; // 1 .. 5 for -c1 .. -c5, 0 if the header is wrong
+    const char* text; // Input of the task, a view into the input
+    size_t size;
+    size_t memory; // Estimate, in bytes
+    int ok;
+} Constellation;
+
+typedef struct ConstellationPool
+{
+    Constellation* items;
+    int n;
+    int capacity;
+    int next_item; // Next constellation to take
+    int next_start; // Next constellation allowed to start
+    size_t in_flight; // Estimated memory of the running constellations
+    size_t budget;
+    pthread_mutex_t lock; // Guards the three fields above
+    pthread_cond_t changed;
+    const char* out_dir;
+    int decode_bits;
+} ConstellationPool;
+
+int CONSTELLATION_ADD(ConstellationPool* pool, const char* header, size_t header_len)
+{
+    // Function to append a constellation from its header line
+    if (pool->n == pool->capacity)
+    {
+        int capacity = pool->capacity == 0 ? 64 : pool->capacity * 2;
+        Constellation* items = (Constellation*)realloc(pool->items,
+                                                       sizeof(Constellation) * capacity);
+        if (items == NULL)
+        {
+            perror("Error on realloc constellations");
+            return 0;
+        }
+        pool->items = items;
+        pool->capacity = capacity;
+    }
+    Constellation* item = &pool->items[pool->n++];
+    memset(item, 0, sizeof(Constellation));
+    Scanner line;
+    SCANNER_FROM_TEXT(&line, header + 1, header_len - 1); // After the '@'
+    const char* task;
+    item->name_len = SCAN_TOKEN(&line, &item->name);
+    size_t task_len = SCAN_TOKEN(&line, &task);
+    SCAN_SKIP_SPACE(&line);
+    int valid = item->name_len > 0 && item->name_len <= BATCH_NAME_MAX &&
+                item->name[0] != '.' && line.pos == line.size && task_len == 3 &&
+                task[0] == '-' && task[1] == 'c' && task[2] >= '1' && task[2] <= '5';
+    for (size_t i = 0; i < item->name_len && valid; i++)
+    {
+        char c = item->name[i];
+        valid = isalnum((unsigned char)c) || c == '.' || c == '_' || c == '-';
+    }
+    if (valid)
+    {
+        item->task = task[2] - '0';
+    } else {
+        printf("[ERROR] Wrong constellation header: %.*s\n", (int)header_len, header);
+    }
+    return 1;
 }
-void FREE_NODES(node* root)
+
+int CONSTELLATION_SPLIT(ConstellationPool* pool, Scanner* input)
 {
-    // Recursive function to free all nodes in the tree
-    if (root == NULL) return;
-    FREE_NODES(root->left);
-    FREE_NODES(root->right);
-    if (root->data != NULL)
+    // Function to cut an input into constellations at the header lines
+    const char* text = input->text + input->pos;
+    const char* end = input->text + input->size;
+    Constellation* current = NULL;
+    while (text < end)
     {
-        if (root->data->name != NULL)
+        const char* line_end = (const char*)memchr(text, '\n', end - text);
+        if (line_end == NULL) line_end = end;
+        if (*text == '@')
+        {
+            if (!CONSTELLATION_ADD(pool, text, line_end - text)) return 0;
+            current = &pool->items[pool->n - 1];
+            current->text = line_end + (line_end < end);
+        } else if (current == NULL) {
+            Scanner line;
+            SCANNER_FROM_TEXT(&line, text, line_end - text);
+            SCAN_SKIP_SPACE(&line);
+            if (line.pos != line.size)
+            {
+                printf("[ERROR] Input does not start with a constellation header\n");
+                return 0;
+            }
+        }
+        if (current != NULL)
         {
-            free(root->data->name);
+            current->size = (size_t)((line_end + (line_end < end)) - current->text);
         }
-        free(root->data);
+        text = line_end + (line_end < end);
     }
-    free(root);
+    return 1;
 }
-void FREE_TREE(Tree* final_tree)
+
+int CONSTELLATION_NAME_CMP(const void* a, const void* b)
 {
-    // Helper function to free the tree memory
-    if (final_tree == NULL) return;
-    FREE_NODES(final_tree->root);
-    free(final_tree);
+    // Helper function for qsort: constellations by name
+    const Constellation* el_a = *(const Constellation* const*)a;
+    const Constellation* el_b = *(const Constellation* const*)b;
+    size_t len = el_a->name_len < el_b->name_len ? el_a->name_len : el_b->name_len;
+    int result = memcmp(el_a->name, el_b->name, len);
+    if (result == 0)
+    {
+        result = (el_a->name_len > el_b->name_len) - (el_a->name_len < el_b->name_len);
+    }
+    return result != 0 ? result : (el_a > el_b) - (el_a < el_b);
 }
-void FREE_HEAP(Heap* min_heap)
+
+int CONSTELLATION_CHECK(ConstellationPool* pool)
 {
-    // Helper function to free the heap memory
-    if (min_heap == NULL) return;
-    if (min_heap->data_arr != NULL)
+    // Function to reject names given twice (they would share an output)
+    // and to estimate the memory of every constellation
+    Constellation** by_name = (Constellation**)malloc(sizeof(Constellation*) *
+                                                      (pool->n + 1));
+    if (by_name == NULL)
     {
-        free(min_heap->data_arr);
+        perror("Error on malloc constellation names");
+        return 0;
+    }
+    for (int i = 0; i < pool->n; i++)
+    {
+        by_name[i] = &pool->items[i];
+        Scanner input;
+        SCANNER_FROM_TEXT(&input, pool->items[i].text, pool->items[i].size);
+        pool->items[i].memory = pool->items[i].size +
+                                (size_t)SCAN_COUNT(&input) * BATCH_SATELLITE_BYTES;
+    }
+    qsort(by_name, pool->n, sizeof(Constellation*), CONSTELLATION_NAME_CMP);
+    for (int i = 1; i < pool->n; i++)
+    {
+        Constellation* item = by_name[i];
+        if (item->task != 0 && item->name_len == by_name[i - 1]->name_len &&
+            memcmp(item->name, by_name[i - 1]->name, item->name_len) == 0)
+        {
+            printf("[ERROR] Constellation %.*s is given twice\n",
+                   (int)item->name_len, item->name);
+            item->task = 0;
+        }
+    }
+    free(by_name);
+    return 1;
+}
+
+int CONSTELLATION_RUN(ConstellationPool* pool, Constellation* item)
+{
+    // Function to build the tree of one constellation and run its task,
+    // like main does for a single input
+    // Returns 1 only if the tree was built, the task answered every query
+    // and the output file was written
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%.*s.out", pool->out_dir,
+                 (int)item->name_len, item->name) >= (int)sizeof(path))
+    {
+        printf("[ERROR] Output path of %.*s is too long\n",
+               (int)item->name_len, item->name);
+        return 0;
+    }
+    FILE* out_file = fopen(path, "w");
+    if (out_file == NULL)
+    {
+        perror("Error on opening constellation output");
+        return 0;
+    }
+    Tree* final_tree;
+    Heap* min_heap;
+    INIT_TREE(&final_tree);
+    INIT_HEAP(&min_heap);
+    int done = final_tree != NULL && min_heap != NULL;
+    Scanner input;
+    SCANNER_FROM_TEXT(&input, item->text, item->size);
+    if (done)
+    {
+        done = PROCEED_TASK_1(final_tree, min_heap, &input, 1);
+    }
+    if (done)
+    {
+        double started = STATS_NOW();
+        switch (item->task)
+        {
+            case 1: {
+                done = PRINT_TREE_LEVELS(final_tree, out_file);
+                break;
+            }
+            case 2: {
+                done = PROCEED_TASK_2(final_tree, &input, out_file, pool->decode_bits);
+                break;
+            }
+            case 3: {
+                done = PROCEED_TASK_3(final_tree, &input, out_file);
+                break;
+            }
+            case 4: {
+                done = PROCEED_TASK_4(final_tree, &input, out_file);
+                break;
+            }
+            case 5: {
+                done = PROCEED_TASK_5(final_tree, &input, out_file);
+                break;
+            }
+        }
+        STATS_PHASE_END(stats_task, started);
+    }
+    done = fclose(out_file) == 0 && done;
+    double started = STATS_NOW();
+    FREE_TREE(final_tree);
+    FREE_HEAP(min_heap);
+    STATS_PHASE_END(stats_free, started);
+    return done;
+}
+
+void* CONSTELLATION_WORKER(void* arg)
+{
+    // Function run by every worker until no constellation is left
+    ConstellationPool* pool = (ConstellationPool*)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next_item++;
+        if (i >= pool->n)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        Constellation* item = &pool->items[i];
+        size_t memory = item->task != 0 ? item->memory : 0;
+        // Start in input order, when the memory fits (or nothing else runs)
+        while (pool->next_start != i ||
+               (pool->in_flight > 0 && pool->in_flight + memory > pool->budget))
+        {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        pool->next_start++;
+        pool->in_flight += memory;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        if (item->task != 0)
+        {
+            item->ok = CONSTELLATION_RUN(pool, item);
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->in_flight -= memory;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int CONSTELLATION_FILE_CMP(const void* a, const void* b)
+{
+    // Helper function for qsort: file names of a batch directory
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int PROCEED_CONSTELLATIONS(const char* in_path, const char* out_dir, int n_threads,
+                           int decode_bits, size_t budget)
+{
+    // Main function for -batch
+    // Returns 0 if the batch could not be read or a constellation failed
+    ConstellationPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.out_dir = out_dir;
+    pool.decode_bits = decode_bits;
+    pool.budget = budget;
+    // Every input file stays mapped until the end: the constellations are
+    // views into them
+    int n_files = 0;
+    char** files = NULL;
+    int listed = 1;
+    DIR* dir = opendir(in_path);
+    int is_dir = dir != NULL;
+    if (is_dir)
+    {
+        struct dirent* entry;
+        int capacity = 0;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.') continue;
+            if (n_files == capacity)
+            {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                char** grown = (char**)realloc(files, sizeof(char*) * capacity);
+                if (grown == NULL)
+                {
+                    perror("Error on realloc batch files");
+                    listed = 0;
+                    break;
+                }
+                files = grown;
+            }
+            size_t len = strlen(in_path) + strlen(entry->d_name) + 2;
+            files[n_files] = (char*)malloc(len);
+            if (files[n_files] == NULL)
+            {
+                perror("Error on malloc batch file name");
+                listed = 0;
+                break;
+            }
+            snprintf(files[n_files], len, "%s/%s", in_path, entry->d_name);
+            n_files++;
+        }
+        closedir(dir);
+        if (n_files > 0)
+        {
+            qsort(files, n_files, sizeof(char*), CONSTELLATION_FILE_CMP);
+        }
+    } else if (errno == ENOTDIR) {
+        files = (char**)malloc(sizeof(char*));
+        if (files != NULL)
+        {
+            files[0] = strdup(in_path);
+            n_files = files[0] != NULL;
+        }
+        listed = n_files == 1;
+    } else {
+        perror("Error on opening batch input");
+        return 0;
+    }
+    Scanner* inputs = (Scanner*)calloc(n_files + 1, sizeof(Scanner));
+    int done = listed && inputs != NULL;
+    if (!done)
+    {
+        printf("[ERROR] Could not list the batch input\n");
+    }
+    for (int i = 0; i < n_files && done; i++)
+    {
+        struct stat info;
+        if (stat(files[i], &info) != 0 || !S_ISREG(info.st_mode)) continue;
+        FILE* in_file = fopen(files[i], "r");
+        if (in_file == NULL)
+        {
+            perror("Error on opening batch input");
+            done = 0;
+            break;
+        }
+        done = SCANNER_OPEN(&inputs[i], in_file) && CONSTELLATION_SPLIT(&pool, &inputs[i]);
+        fclose(in_file);
+    }
+    done = done && CONSTELLATION_CHECK(&pool);
+    if (done && mkdir(out_dir, 0777) != 0 && errno != EEXIST)
+    {
+        perror("Error on creating output directory");
+        done = 0;
+    }
+    if (done)
+    {
+        if (n_threads < 1)
+        {
+            long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+            n_threads = n_cores < 1 ? 1 : GET_MIN_INT((int)n_cores, BATCH_MAX_THREADS);
+        }
+        n_threads = GET_MIN_INT(n_threads, GET_MAX(pool.n, 1));
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.changed, NULL);
+        pthread_t threads[BATCH_MAX_THREADS];
+        int n_started = 0;
+        for (int i = 1; i < n_threads; i++)
+        {
+            if (pthread_create(&threads[n_started], NULL, CONSTELLATION_WORKER, &pool) != 0)
+            {
+                break;
+            }
+            n_started++;
+        }
+        CONSTELLATION_WORKER(&pool);
+        for (int i = 0; i < n_started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_cond_destroy(&pool.changed);
+        pthread_mutex_destroy(&pool.lock);
+        // The summary is written once every constellation is done
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", out_dir, BATCH_SUMMARY);
+        FILE* summary = fopen(path, "w");
+        if (summary == NULL)
+        {
+            perror("Error on opening batch summary");
+            done = 0;
+        }
+        for (int i = 0; i < pool.n && summary != NULL; i++)
+        {
+            Constellation* item = &pool.items[i];
+            if (item->task != 0)
+            {
+                fprintf(summary, "%.*s -c%d %s\n", (int)item->name_len, item->name,
+                        item->task, item->ok ? "ok" : "error");
+            } else {
+                fprintf(summary, "%.*s - error\n", (int)item->name_len, item->name);
+            }
+            done = done && item->ok;
+        }
+        if (summary != NULL) fclose(summary);
+    }
+    for (int i = 0; i < n_files; i++)
+    {
+        if (inputs != NULL) SCANNER_CLOSE(&inputs[i]);
+        free(files[i]);
+    }
+    free(files);
+    free(inputs);
+    free(pool.items);
+    return done;
+}
+
+size_t STATS_HEAP_IN_USE(void)
+{
+    // Helper function to get the bytes currently allocated with malloc
+    // (0 where the C library cannot tell)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+    // Before glibc 2.33 only mallinfo exists, with int fields
+    struct mallinfo info = mallinfo();
+    return (size_t)(unsigned int)info.uordblks + (size_t)(unsigned int)info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+void STATS_WRITE(const char* path, const char* task, size_t heap_in_use)
+{
+    // Function to write the stats of the run as one JSON object
+    // ("-" writes them to stderr)
+    FILE* out_file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (out_file == NULL)
+    {
+        perror("Error on fopen stats");
+        return;
+    }
+    const char* phase_names[stats_phase_count] = {
+        "read", "build", "index", "flat", "updates", "task", "free"
+    };
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out_file, "{\"task\": \"%s\", \"phase_clock\": \"%s\", \"seconds\": {", task,
+            run_stats.phase_clock == CLOCK_MONOTONIC ? "wall" : "thread_cpu");
+    for (int i = 0; i < stats_phase_count; i++)
+    {
+        fprintf(out_file, "\"%s\": %.6f, ", phase_names[i], run_stats.phase_seconds[i]);
+    }
+    // The total is always wall time
+    fprintf(out_file, "\"total\": %.6f}, ",
+            STATS_CLOCK(CLOCK_MONOTONIC) - run_stats.started);
+    fprintf(out_file, "\"counters\": {\"node_cmp\": %llu, \"name_cmp\": %llu, "
+            "\"heap_sifts\": %llu, \"queries\": %llu, \"nodes_visited\": %llu, "
+            "\"nodes_per_query\": %.2f}, ",
+            run_stats.node_cmp, run_stats.name_cmp, run_stats.heap_sifts,
+            run_stats.queries, run_stats.nodes_visited,
+            run_stats.queries > 0 ? (double)run_stats.nodes_visited / run_stats.queries : 0.0);
+    fprintf(out_file, "\"memory\": {\"pool_allocations\": %llu, \"pool_bytes\": %llu, "
+            "\"heap_in_use_bytes\": %zu, \"peak_rss_kb\": %ld}}\n",
+            run_stats.pool_allocations, run_stats.pool_bytes, heap_in_use,
+            usage.ru_maxrss);
+    if (out_file != stderr)
+    {
+        fclose(out_file);
     }
-    free(min_heap);
 }
 
 int main(int argc, char** argv)
 {
+    // Read the options placed before the task argument
+    //   -k BITS  bits decoded per table lookup in task 2 (1..16)
+    //   -t FILE  read the satellites from FILE instead of IN_FILE, so
+    //            IN_FILE only holds the task input (required by -c2p)
+    //   -l BITS  maximum code length of the canonical code book (-cc)
+    //   -s FILE  load the tree from a snapshot written by -build instead
+    //            of reading the satellites
+    //   -j N     build large trees and answer -c2, -c3 and -c4 with N
+    //            threads (and use N threads instead of one per core for
+    //            -compress, -decompress and -batch; -c2p uses them when
+    //            the stream has a sync index)
+    //   -i K     record a checkpoint every K codes in -c3p (sync index)
+    //   -r FIRST:COUNT  decode only COUNT names from name FIRST in -c2p
+    //                   (needs a sync index)
+    //   -u FILE  apply the batches of updates in FILE to the tree before
+    //            the task (see APPLY_UPDATES)
+    //   -m MB    memory budget of the constellations that -batch runs at
+    //            once (estimated, default BATCH_DEFAULT_MEMORY_MB)
+    //   --stats FILE  write phase timings and counters as JSON to FILE
+    //                 ("-" for stderr) at the end of the run
+    int decode_bits = DECODE_DEFAULT_BITS;
+    int max_code_len = 0;
+    char* tree_path = NULL;
+    char* snapshot_path = NULL;
+    char* update_path = NULL;
+    char* stats_path = NULL;
+    int n_threads = 0; // 0: not given
+    unsigned sync_interval = 0;
+    SyncRange range = {0, 0};
+    int has_range = 0;
+    size_t batch_memory = (size_t)BATCH_DEFAULT_MEMORY_MB << 20;
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-' &&
+           (strcmp(argv[arg], "-k") == 0 || strcmp(argv[arg], "-t") == 0 ||
+            strcmp(argv[arg], "-l") == 0 || strcmp(argv[arg], "-s") == 0 ||
+            strcmp(argv[arg], "-j") == 0 || strcmp(argv[arg], "-u") == 0 ||
+            strcmp(argv[arg], "-i") == 0 || strcmp(argv[arg], "-r") == 0 ||
+            strcmp(argv[arg], "-m") == 0 ||
+            strcmp(argv[arg], "--stats") == 0))
+    {
+        if (strcmp(argv[arg], "-k") == 0)
+        {
+            decode_bits = atoi(argv[arg + 1]);
+            if (decode_bits < 1 || decode_bits > DECODE_MAX_BITS)
+            {
+                printf("[ERROR] -k should be between 1 and %d", DECODE_MAX_BITS);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "-l") == 0) {
+            max_code_len = atoi(argv[arg + 1]);
+            if (max_code_len < 1 || max_code_len > CANONICAL_MAX_LIMIT)
+            {
+                printf("[ERROR] -l should be between 1 and %d", CANONICAL_MAX_LIMIT);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "-s") == 0) {
+            snapshot_path = argv[arg + 1];
+        } else if (strcmp(argv[arg], "-u") == 0) {
+            update_path = argv[arg + 1];
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            stats_path = argv[arg + 1];
+            run_stats.enabled = 1;
+            run_stats.phase_clock = CLOCK_MONOTONIC;
+            run_stats.started = STATS_CLOCK(CLOCK_MONOTONIC);
+        } else if (strcmp(argv[arg], "-i") == 0) {
+            int interval = atoi(argv[arg + 1]);
+            if (interval < 1)
+            {
+                printf("[ERROR] -i should be at least 1");
+                return 1;
+            }
+            sync_interval = (unsigned)interval;
+        } else if (strcmp(argv[arg], "-m") == 0) {
+            int megabytes = atoi(argv[arg + 1]);
+            if (megabytes < 1)
+            {
+                printf("[ERROR] -m should be at least 1");
+                return 1;
+            }
+            batch_memory = (size_t)megabytes << 20;
+        } else if (strcmp(argv[arg], "-r") == 0) {
+            if (sscanf(argv[arg + 1], "%llu:%llu", &range.first, &range.count) != 2)
+            {
+                printf("[ERROR] -r should be FIRST:COUNT");
+                return 1;
+            }
+            has_range = 1;
+        } else if (strcmp(argv[arg], "-j") == 0) {
+            n_threads = atoi(argv[arg + 1]);
+            if (n_threads < 1 || n_threads > BATCH_MAX_THREADS)
+            {
+                printf("[ERROR] -j should be between 1 and %d", BATCH_MAX_THREADS);
+                return 1;
+            }
+        } else {
+            tree_path = argv[arg + 1];
+        }
+        arg += 2;
+    }
+    argc -= arg - 1;
+    argv += arg - 1;
     // Check if the number of command line arguments is correct
     if (argc != 4)
     {
         printf("[ERROR] You should have 3 args | TASK | IN_FILE | OUT_FILE |");
         return 1;
     }
-    // Initialize the tree of satellites and the min-heap to access the lowest nodes
-    Tree* final_tree;
-    Heap* min_heap;
-    INIT_TREE(&final_tree);
-    INIT_HEAP(&min_heap);
-    FILE* in_file = fopen(argv[2], "r");
-    FILE* out_file = fopen(argv[3], "w");
     // Initialize a vector of strings that can be extended with more subtasks
     // A simple mapping variant
     const char* task_type[] = {
-        "-c1", "-c2", "-c3", "-c4", "-c5"
+        "-c1", "-c2", "-c3", "-c4", "-c5", "-c2p", "-c3p", "-cc",
+        "-build", "-serve", "-compress", "-decompress", "-batch"
     };
     enum task_enum {
-        task_c1, task_c2, task_c3, task_c4, task_c5
+        task_c1, task_c2, task_c3, task_c4, task_c5, task_c2p, task_c3p,
+        task_cc, task_build, task_serve, task_compress, task_decompress,
+        task_batch
     };
     int task_len = sizeof(task_type) / sizeof(task_type[0]);
     int type = -1;
     for (int i = 0; i < task_len; i++)
     {
         // Try to map the task argument
-        if (strstr(argv[1], task_type[i]) != NULL) 
+        if (strcmp(argv[1], task_type[i]) == 0)
         {
             type = i;
         }
     }
     if (type == -1)
     {
-        printf("Task %s is invalid argument", argv[2]);
+        printf("Task %s is invalid argument", argv[1]);
+        return 1;
+    }
+    if (type == task_c2p && tree_path == NULL && snapshot_path == NULL)
+    {
+        printf("[ERROR] -c2p reads a binary stream, give the satellites with -t or -s");
+        return 1;
+    }
+    if (tree_path != NULL && snapshot_path != NULL)
+    {
+        printf("[ERROR] -t and -s both give the tree, use only one");
+        return 1;
+    }
+    if (type == task_batch)
+    {
+        // Many constellations: IN_FILE is a file or a directory of them and
+        // OUT_FILE the directory of their outputs
+        run_stats.phase_clock = CLOCK_THREAD_CPUTIME_ID;
+        if (tree_path != NULL || snapshot_path != NULL || update_path != NULL)
+        {
+            printf("[ERROR] -batch reads every tree from its own input, -t, -s and -u cannot be used");
+            return 1;
+        }
+        int done = PROCEED_CONSTELLATIONS(argv[2], argv[3], n_threads, decode_bits,
+                                          batch_memory);
+        if (stats_path != NULL)
+        {
+            STATS_WRITE(stats_path, task_type[type], STATS_HEAP_IN_USE());
+        }
+        return done ? 0 : 1;
+    }
+    int binary_in = type == task_c2p || type == task_compress || type == task_decompress;
+    int binary_out = type == task_c3p || type == task_build || type == task_compress ||
+                     type == task_decompress;
+    FILE* in_file = fopen(argv[2], binary_in ? "rb" : "r");
+    // -serve takes an endpoint instead of an output file ("-" or a socket)
+    FILE* out_file = type == task_serve ? stdout : fopen(argv[3], binary_out ? "wb" : "w");
+    FILE* tree_file = tree_path != NULL ? fopen(tree_path, "r") : in_file;
+    if (in_file == NULL || out_file == NULL || tree_file == NULL)
+    {
+        perror("Error on opening files");
+        if (in_file != NULL) fclose(in_file);
+        if (out_file != NULL) fclose(out_file);
+        if (tree_file != NULL && tree_file != in_file) fclose(tree_file);
+        return 1;
+    }
+    if (type == task_compress || type == task_decompress)
+    {
+        // Any file, no satellites: every block builds its own tree
+        double started = STATS_NOW();
+        int done = type == task_compress ? PROCEED_COMPRESS(in_file, out_file, n_threads) :
+                                           PROCEED_DECOMPRESS(in_file, out_file, n_threads);
+        if (done && fflush(out_file) != 0)
+        {
+            // A full disk is only seen when the buffer is written out
+            perror("Error on writing output");
+            done = 0;
+        }
+        STATS_PHASE_END(stats_task, started);
+        if (tree_file != in_file) fclose(tree_file);
+        fclose(in_file);
+        fclose(out_file);
+        if (stats_path != NULL)
+        {
+            STATS_WRITE(stats_path, task_type[type], STATS_HEAP_IN_USE());
+        }
+        return done ? 0 : 1;
+    }
+    // Initialize the tree of satellites and the min-heap to access the lowest nodes
+    Tree* final_tree;
+    Heap* min_heap;
+    INIT_TREE(&final_tree);
+    INIT_HEAP(&min_heap);
+    // Text inputs are mapped and scanned in place. When the satellites and
+    // the task share a file, one scanner reads both parts
+    Scanner tree_input, task_input;
+    SCANNER_FROM_TEXT(&tree_input, NULL, 0);
+    SCANNER_FROM_TEXT(&task_input, NULL, 0);
+    Scanner* input = &task_input;
+    int scanned = 1;
+    if (snapshot_path == NULL)
+    {
+        scanned = SCANNER_OPEN(&tree_input, tree_file);
+        if (tree_file == in_file) input = &tree_input;
+    }
+    if (scanned && type != task_c2p && input == &task_input)
+    {
+        scanned = SCANNER_OPEN(&task_input, in_file);
+    }
+    // Every task starts from the tree of satellites, built from the input
+    // or mapped from a snapshot
+    double started = STATS_NOW();
+    int loaded = snapshot_path == NULL || LOAD_SNAPSHOT(final_tree, snapshot_path);
+    STATS_PHASE_END(stats_read, started);
+    if (!scanned || !loaded)
+    {
+        SCANNER_CLOSE(&tree_input);
+        SCANNER_CLOSE(&task_input);
+        FREE_TREE(final_tree);
+        FREE_HEAP(min_heap);
+        if (tree_file != in_file) fclose(tree_file);
+        fclose(in_file);
+        fclose(out_file);
+        return 1;
+    }
+    int built = snapshot_path != NULL ||
+                PROCEED_TASK_1(final_tree, min_heap, &tree_input, n_threads);
+    started = STATS_NOW();
+    int updated = built && (update_path == NULL || PROCEED_UPDATES(final_tree, update_path));
+    STATS_PHASE_END(stats_updates, started);
+    if (!updated || (final_tree->root != NULL && final_tree->flat.n == 0))
+    {
+        // The tree could not be built, or the updates or the flat layout
+        // could not be applied
+        SCANNER_CLOSE(&tree_input);
+        SCANNER_CLOSE(&task_input);
+        FREE_TREE(final_tree);
+        FREE_HEAP(min_heap);
+        if (tree_file != in_file) fclose(tree_file);
+        fclose(in_file);
+        fclose(out_file);
         return 1;
     }
     // Switch that can be adapted and extended for more tasks
     // by adding a new case and its name to the enum
+    started = STATS_NOW();
+    int done = 1;
     switch (type)
     {
         case task_c1: {
-            PROCEED_TASK_1(final_tree, min_heap, in_file); 
             PRINT_TREE_LEVELS(final_tree, out_file);
             break;
         }
         case task_c2: {
-            PROCEED_TASK_1(final_tree, min_heap, in_file); 
-            PROCEED_TASK_2(final_tree, in_file, out_file);
+            if (n_threads > 1)
+            {
+                done = PROCEED_TASK_PARALLEL(final_tree, input, out_file,
+                                             batch_decode, decode_bits, n_threads);
+                break;
+            }
+            done = PROCEED_TASK_2(final_tree, input, out_file, decode_bits);
             break;
         }
         case task_c3: {
-            PROCEED_TASK_1(final_tree, min_heap, in_file); 
-            PROCEED_TASK_3(final_tree, in_file, out_file);
+            if (n_threads > 1)
+            {
+                done = PROCEED_TASK_PARALLEL(final_tree, input, out_file,
+                                             batch_encode, decode_bits, n_threads);
+                break;
+            }
+            done = PROCEED_TASK_3(final_tree, input, out_file);
             break;
         }
         case task_c4: {
-            PROCEED_TASK_1(final_tree, min_heap, in_file);
-            PROCEED_TASK_4(final_tree, in_file, out_file);
+            if (n_threads > 1)
+            {
+                done = PROCEED_TASK_PARALLEL(final_tree, input, out_file,
+                                             batch_lca, decode_bits, n_threads);
+                break;
+            }
+            done = PROCEED_TASK_4(final_tree, input, out_file);
+            break;
+        }
+        case task_c5: {
+            done = PROCEED_TASK_5(final_tree, input, out_file);
+            break;
+        }
+        case task_c2p: {
+            done = PROCEED_TASK_2_PACKED(final_tree, in_file, out_file, decode_bits,
+                                         n_threads, has_range ? &range : NULL);
+            break;
+        }
+        case task_c3p: {
+            done = PROCEED_TASK_3_PACKED(final_tree, input, out_file, sync_interval);
+            break;
+        }
+        case task_cc: {
+            PROCEED_CANONICAL_CODES(final_tree, out_file, max_code_len);
+            break;
+        }
+        case task_build: {
+            done = WRITE_SNAPSHOT(final_tree, out_file);
+            break;
+        }
+        case task_serve: {
+            PROCEED_SERVE(final_tree, argv[3], decode_bits);
             break;
         }
     }
+    if (done && fflush(out_file) != 0)
+    {
+        perror("Error on writing output");
+        done = 0;
+    }
+    STATS_PHASE_END(stats_task, started);
+    size_t heap_in_use = run_stats.enabled ? STATS_HEAP_IN_USE() : 0;
+    started = STATS_NOW();
+    SCANNER_CLOSE(&tree_input);
+    SCANNER_CLOSE(&task_input);
     FREE_TREE(final_tree);
     FREE_HEAP(min_heap);
+    STATS_PHASE_END(stats_free, started);
+    if (tree_file != in_file)
+    {
+        fclose(tree_file);
+    }
     fclose(in_file);
-    fclose(out_file);
-    return 0;
+    if (fclose(out_file) != 0 && done)
+    {
+        perror("Error on writing output");
+        done = 0;
+    }
+    if (stats_path != NULL)
+    {
+        STATS_WRITE(stats_path, task_type[type], heap_in_use);
+    }
+    return done ? 0 : 1;
 }
-
-
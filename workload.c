@@ -0,0 +1,399 @@
+// Workload generator and benchmark driver for tema2
+//
+//   ./workload gen DIST N TASK FILE
+//       Writes one input: N satellites with DIST frequencies (uniform,
+//       zipf, geometric, equal) followed by a query batch for TASK
+//       (b for build only, 1, 2, 3, 4 or 5)
+//   ./workload run [-b TEMA2] [-s SIZES] [-d DISTS] [-t TASKS] [-w DIR] [-o REPORT]
+//       Generates every (size, distribution, task) workload in DIR, runs
+//       TEMA2 on it and writes one JSON record per run to REPORT
+//       (wall time, throughput and peak RSS of the child)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_SIZES "1000,10000,100000,1000000"
+#define BENCH_DEFAULT_DISTS "uniform,zipf,geometric,equal"
+#define BENCH_DEFAULT_TASKS "b,1,2,3,4,5"
+#define BENCH_PATH_BITS 256 // Length of every -c2 path
+#define BENCH_GRAFT_CHILDREN 4 // Children of the root of every -c5 graft
+#define BENCH_SEED 0x9e3779b97f4a7c15ULL
+
+typedef struct Rng
+{
+    // xorshift64* generator, so workloads are the same on every machine
+    unsigned long long state;
+} Rng;
+
+enum { dist_uniform, dist_zipf, dist_geometric, dist_equal, dist_count };
+const char* DIST_NAMES[dist_count] = { "uniform", "zipf", "geometric", "equal" };
+
+unsigned long long RNG_NEXT(Rng* rng)
+{
+    // Function to return the next 64 random bits
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545f4914f6cdd1dULL;
+}
+
+int RNG_BELOW(Rng* rng, int n)
+{
+    // Helper function for a random number in [0, n)
+    return (int)((RNG_NEXT(rng) >> 33) % (unsigned long long)n);
+}
+
+int PARSE_DIST(const char* name)
+{
+    // Helper function to find a distribution by name (-1 if unknown)
+    for (int i = 0; i < dist_count; i++)
+    {
+        if (strcmp(name, DIST_NAMES[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int GEN_FREQUENCY(Rng* rng, int dist, int rank)
+{
+    // Function to draw the frequency of the satellite with the given rank
+    // Sums stay below 2^31 up to 10^7 satellites, as tema2 adds them in int
+    switch (dist)
+    {
+        case dist_uniform:
+            return 1 + RNG_BELOW(rng, 100);
+        case dist_zipf: {
+            // Frequency proportional to 1 / rank
+            int frequency = 100000000 / (rank + 1);
+            return frequency > 0 ? frequency : 1;
+        }
+        case dist_geometric: {
+            // 2^k with P(k) = 2^-(k+1), capped at 2^20
+            int k = 0;
+            unsigned long long bits = RNG_NEXT(rng);
+            while (k < 20 && (bits & 1))
+            {
+                bits >>= 1;
+                k++;
+            }
+            return 1 << k;
+        }
+        default:
+            return 1;
+    }
+}
+
+void WRITE_NAME(FILE* out_file, int id)
+{
+    // Helper function: satellite names are S followed by 8 digits
+    fprintf(out_file, "S%08d", id);
+}
+
+int GENERATE_WORKLOAD(const char* path, int dist, int n, char task, long long* n_items)
+{
+    // Function to write one input file; n_items receives the number of
+    // items the task processes (satellites or queries)
+    FILE* out_file = fopen(path, "w");
+    if (out_file == NULL)
+    {
+        perror("Error on fopen workload");
+        return 0;
+    }
+    static char buffer[1 << 20];
+    setvbuf(out_file, buffer, _IOFBF, sizeof(buffer));
+    Rng rng = { BENCH_SEED ^ ((unsigned long long)n << 8) ^ (unsigned long long)dist };
+    // Names are a random permutation of 0..n-1, so the input is never
+    // sorted and the heap build is always used
+    int* ids = (int*)malloc(sizeof(int) * n);
+    if (ids == NULL)
+    {
+        perror("Error on malloc workload ids");
+        fclose(out_file);
+        return 0;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        ids[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--)
+    {
+        int j = RNG_BELOW(&rng, i + 1);
+        int temp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = temp;
+    }
+    fprintf(out_file, "%d\n", n);
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(out_file, "%d ", GEN_FREQUENCY(&rng, dist, ids[i]));
+        WRITE_NAME(out_file, ids[i]);
+        fputc('\n', out_file);
+    }
+    free(ids);
+    int n_queries = n;
+    *n_items = n_queries;
+    switch (task)
+    {
+        case 'b':
+            // Build only: -c3 with no names
+            fprintf(out_file, "0\n");
+            *n_items = n;
+            break;
+        case '1':
+            *n_items = n;
+            break;
+        case '2':
+            // Random paths always decode (every internal node has two
+            // children); the bits left at the end are ignored
+            n_queries = n / 16 > 0 ? n / 16 : 1;
+            fprintf(out_file, "%d\n", n_queries);
+            for (int q = 0; q < n_queries; q++)
+            {
+                for (int b = 0; b < BENCH_PATH_BITS; b += 64)
+                {
+                    unsigned long long bits = RNG_NEXT(&rng);
+                    for (int i = 0; i < 64; i++, bits >>= 1)
+                    {
+                        fputc('0' + (int)(bits & 1), out_file);
+                    }
+                }
+                fputc('\n', out_file);
+            }
+            *n_items = (long long)n_queries * BENCH_PATH_BITS; // Bits
+            break;
+        case '3':
+        case '4':
+            // -c4 answers one set made of all the names
+            fprintf(out_file, "%d\n", n_queries);
+            for (int q = 0; q < n_queries; q++)
+            {
+                WRITE_NAME(out_file, RNG_BELOW(&rng, n));
+                fputc('\n', out_file);
+            }
+            break;
+        case '5': {
+            // One graft per 100 satellites: a root with a few children,
+            // then distance queries between satellites and grafted nodes
+            int n_grafts = n / 100 > 0 ? n / 100 : 1;
+            fprintf(out_file, "%d\n", n_grafts);
+            for (int g = 0; g < n_grafts; g++)
+            {
+                WRITE_NAME(out_file, RNG_BELOW(&rng, n));
+                fprintf(out_file, "\n1 G%d_0\n1\nG%d_0\n%d\n", g, g, BENCH_GRAFT_CHILDREN);
+                for (int c = 1; c <= BENCH_GRAFT_CHILDREN; c++)
+                {
+                    fprintf(out_file, "1 G%d_%d\n", g, c);
+                }
+            }
+            for (int q = 0; q < n_queries; q++)
+            {
+                for (int side = 0; side < 2; side++)
+                {
+                    if (side == 1)
+                    {
+                        fputc(' ', out_file);
+                    }
+                    if (RNG_BELOW(&rng, 2) == 0)
+                    {
+                        WRITE_NAME(out_file, RNG_BELOW(&rng, n));
+                    } else {
+                        fprintf(out_file, "G%d_%d", RNG_BELOW(&rng, n_grafts),
+                                RNG_BELOW(&rng, BENCH_GRAFT_CHILDREN + 1));
+                    }
+                }
+                fputc('\n', out_file);
+            }
+            break;
+        }
+    }
+    int failed = ferror(out_file);
+    if (fclose(out_file) != 0 || failed)
+    {
+        perror("Error on writing workload");
+        return 0;
+    }
+    return 1;
+}
+
+long long FILE_SIZE(const char* path)
+{
+    // Helper function to get the size of a file (0 if it is missing)
+    struct stat info;
+    return stat(path, &info) == 0 ? (long long)info.st_size : 0;
+}
+
+int RUN_TEMA2(const char* binary, char task, const char* in_path, const char* out_path,
+              double* seconds, long* peak_rss_kb)
+{
+    // Function to run tema2 once and measure it; returns its exit status
+    // (-1 if it could not be started or was killed by a signal)
+    char option[4] = { '-', 'c', task == 'b' ? '3' : task, '\0' };
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    if (child < 0)
+    {
+        perror("Error on fork");
+        return -1;
+    }
+    if (child == 0)
+    {
+        execl(binary, binary, option, in_path, out_path, (char*)NULL);
+        perror("Error on exec tema2");
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) < 0)
+    {
+        perror("Error on wait4");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *seconds = (double)(end.tv_sec - start.tv_sec) +
+               (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    *peak_rss_kb = usage.ru_maxrss; // Kilobytes on Linux
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int RUN_SUITE(const char* binary, char* sizes, char* dists, const char* tasks,
+              const char* work_dir, const char* report_path)
+{
+    // Main function of the benchmark: every combination is generated, run
+    // and deleted right away, so only one workload is on disk at a time
+    FILE* report = fopen(report_path, "w");
+    if (report == NULL)
+    {
+        perror("Error on fopen report");
+        return 1;
+    }
+    mkdir(work_dir, 0755);
+    char in_path[4096], out_path[4096];
+    snprintf(in_path, sizeof(in_path), "%s/workload.in", work_dir);
+    snprintf(out_path, sizeof(out_path), "%s/workload.out", work_dir);
+    int first = 1, failures = 0;
+    fprintf(report, "[\n");
+    for (char* size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ","))
+    {
+        int n = atoi(size);
+        char* dist_list = strdup(dists);
+        char* dist_save = NULL;
+        for (char* dist_name = strtok_r(dist_list, ",", &dist_save); dist_name != NULL;
+             dist_name = strtok_r(NULL, ",", &dist_save))
+        {
+            int dist = PARSE_DIST(dist_name);
+            if (dist < 0 || n < 1)
+            {
+                printf("[ERROR] Unknown distribution %s or bad size %s\n", dist_name, size);
+                failures++;
+                continue;
+            }
+            for (const char* task = tasks; *task != '\0'; task++)
+            {
+                if (*task == ',')
+                {
+                    continue;
+                }
+                long long n_items = 0;
+                if (!GENERATE_WORKLOAD(in_path, dist, n, *task, &n_items))
+                {
+                    failures++;
+                    continue;
+                }
+                double seconds = 0;
+                long peak_rss_kb = 0;
+                int status = RUN_TEMA2(binary, *task, in_path, out_path, &seconds, &peak_rss_kb);
+                long long in_bytes = FILE_SIZE(in_path);
+                long long out_bytes = FILE_SIZE(out_path);
+                char task_name[8] = "build";
+                if (*task != 'b')
+                {
+                    snprintf(task_name, sizeof(task_name), "-c%c", *task);
+                }
+                fprintf(report, "%s  {\"size\": %d, \"distribution\": \"%s\", \"task\": \"%s\", "
+                        "\"status\": %d, \"seconds\": %.6f, \"items\": %lld, "
+                        "\"items_per_second\": %.1f, \"input_bytes\": %lld, "
+                        "\"output_bytes\": %lld, \"input_mb_per_second\": %.2f, "
+                        "\"peak_rss_kb\": %ld}",
+                        first ? "" : ",\n", n, DIST_NAMES[dist], task_name, status, seconds,
+                        n_items, seconds > 0 ? n_items / seconds : 0.0, in_bytes, out_bytes,
+                        seconds > 0 ? in_bytes / seconds / 1e6 : 0.0, peak_rss_kb);
+                fflush(report);
+                first = 0;
+                printf("%8d %-9s %-5s %9.3f s %10ld KB%s\n", n, DIST_NAMES[dist], task_name,
+                       seconds, peak_rss_kb, status == 0 ? "" : "  FAILED");
+                fflush(stdout);
+                failures += status != 0;
+                unlink(in_path);
+                unlink(out_path);
+            }
+        }
+        free(dist_list);
+    }
+    fprintf(report, "\n]\n");
+    fclose(report);
+    rmdir(work_dir);
+    return failures > 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 6 && strcmp(argv[1], "gen") == 0)
+    {
+        int dist = PARSE_DIST(argv[2]);
+        int n = atoi(argv[3]);
+        long long n_items;
+        if (dist < 0 || n < 1 || strchr("b12345", argv[4][0]) == NULL)
+        {
+            printf("[ERROR] Usage: %s gen uniform|zipf|geometric|equal N b|1|2|3|4|5 FILE\n",
+                   argv[0]);
+            return 1;
+        }
+        return GENERATE_WORKLOAD(argv[5], dist, n, argv[4][0], &n_items) ? 0 : 1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "run") == 0)
+    {
+        const char* binary = "./tema2";
+        char* sizes = BENCH_DEFAULT_SIZES;
+        char* dists = BENCH_DEFAULT_DISTS;
+        const char* tasks = BENCH_DEFAULT_TASKS;
+        const char* work_dir = "./bench_data";
+        const char* report_path = "./bench_report.json";
+        for (int i = 2; i + 1 < argc; i += 2)
+        {
+            if (strcmp(argv[i], "-b") == 0)
+            {
+                binary = argv[i + 1];
+            } else if (strcmp(argv[i], "-s") == 0) {
+                sizes = argv[i + 1];
+            } else if (strcmp(argv[i], "-d") == 0) {
+                dists = argv[i + 1];
+            } else if (strcmp(argv[i], "-t") == 0) {
+                tasks = argv[i + 1];
+            } else if (strcmp(argv[i], "-w") == 0) {
+                work_dir = argv[i + 1];
+            } else if (strcmp(argv[i], "-o") == 0) {
+                report_path = argv[i + 1];
+            } else {
+                printf("[ERROR] Unknown option %s\n", argv[i]);
+                return 1;
+            }
+        }
+        char* size_list = strdup(sizes);
+        int result = RUN_SUITE(binary, size_list, dists, tasks, work_dir, report_path);
+        free(size_list);
+        return result;
+    }
+    printf("[ERROR] Usage: %s gen DIST N TASK FILE | %s run [-b TEMA2] [-s SIZES] "
+           "[-d DISTS] [-t TASKS] [-w DIR] [-o REPORT]\n", argv[0], argv[0]);
+    return 1;
+}